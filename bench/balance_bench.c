@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bank_helper.h"
+
+// Compares the atomic deposit and withdraw helpers against the rwlock-per-operation
+// helpers they replaced, at 1, 4 and 32 threads. Each thread alternates deposits and
+// withdrawals, either all on one hot account or each on an account of its own. On the hot
+// account the current helpers also run with flat combining, see combine.
+//
+// Usage: balance_bench [operations per thread]
+
+#define MAX_THREADS 32
+
+// The earlier helpers: a double balance behind a write lock for every change.
+struct Locked_account {
+    double balance;
+    pthread_rwlock_t lock;
+};
+
+struct Run {
+    int atomic;     // Use the current helpers instead of the locked ones
+    int combined;   // Keep the account hot, so its changes are combined
+    int hot;        // Every thread on account 0
+    long operations;
+    struct Account_store *store;
+    struct Locked_account *locked;
+};
+
+struct Thread_arg {
+    struct Run *run;
+    int id;
+};
+
+
+static void locked_deposit(struct Locked_account *account, double amount) {
+    pthread_rwlock_wrlock(&account->lock);
+    account->balance += amount;
+    pthread_rwlock_unlock(&account->lock);
+}
+
+
+static int locked_withdraw(struct Locked_account *account, double amount) {
+    pthread_rwlock_wrlock(&account->lock);
+    if (amount > account->balance) {
+        pthread_rwlock_unlock(&account->lock);
+        return 0;
+    }
+    account->balance -= amount;
+    pthread_rwlock_unlock(&account->lock);
+    return 1;
+}
+
+
+static void *run_thread(void *arg) {
+    struct Thread_arg *thread = arg;
+    struct Run *run = thread->run;
+    int slot = run->hot ? 0 : thread->id;
+
+    if (run->atomic) {
+        struct Account *account = account_at(run->store, slot);
+        for (long i = 0; i < run->operations; i += 2) {
+            if (run->combined) {
+                make_hot(account);      // A lone thread's account cools down
+            }
+            deposit(account, 1);
+            withdraw(account, 1);
+        }
+    }
+    else {
+        struct Locked_account *account = &run->locked[slot];
+        for (long i = 0; i < run->operations; i += 2) {
+            locked_deposit(account, 0.01);
+            locked_withdraw(account, 0.01);
+        }
+    }
+    return NULL;
+}
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Millions of operations per second over all threads.
+static double measure(struct Run *run, int threads) {
+    pthread_t ids[MAX_THREADS];
+    struct Thread_arg args[MAX_THREADS];
+
+    double start = now_s();
+    for (int i = 0; i < threads; i++) {
+        args[i].run = run;
+        args[i].id = i;
+        pthread_create(&ids[i], NULL, run_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    return run->operations * threads / (now_s() - start) / 1e6;
+}
+
+
+int main(int argc, char **argv) {
+    long operations = argc > 1 ? atol(argv[1]) : 2000000;
+    int thread_counts[] = {1, 4, 32};
+
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    struct Locked_account locked[MAX_THREADS];
+    if (!init_account_store(&store, MAX_THREADS)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < MAX_THREADS; i++) {
+        create_new_account(&store, i, &store_lock);
+        locked[i].balance = 0;
+        pthread_rwlock_init(&locked[i].lock, NULL);
+    }
+
+    // Accounts only get hot where the runs ask for it
+    set_hot_contention(0);
+    for (int hot = 1; hot >= 0; hot--) {
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            struct Run run = { 0, 0, hot, operations, &store, locked };
+            double locked_mops = measure(&run, thread_counts[t]);
+            run.atomic = 1;
+            double atomic_mops = measure(&run, thread_counts[t]);
+
+            printf("%s_threads_%d_locked_mops %.2f\n", hot ? "hot" : "spread", thread_counts[t], locked_mops);
+            printf("%s_threads_%d_atomic_mops %.2f\n", hot ? "hot" : "spread", thread_counts[t], atomic_mops);
+            if (hot) {
+                run.combined = 1;
+                printf("hot_threads_%d_combined_mops %.2f\n", thread_counts[t], measure(&run, thread_counts[t]));
+            }
+        }
+    }
+
+    destroy_account_store(&store);
+    return 0;
+}
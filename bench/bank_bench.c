@@ -0,0 +1,544 @@
+#define _POSIX_C_SOURCE 202009L
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Load generator. Opens several connections to the server and drives a mix of balance
+// checks, withdrawals, deposits and transfers over them, then reports throughput, latency
+// percentiles and how long connections waited for "ready". Output is one "key value" pair
+// per line, so runs of different builds can be compared with diff or a script.
+//
+// Closed loop (default): every connection sends its next command as soon as the reply
+// to the previous one arrives.
+// Open loop (-r): commands are sent on a fixed schedule whether or not replies have
+// arrived, and latency is measured from the time a command was due, so a server that
+// falls behind can't hide it by slowing the client down.
+//
+// Usage: bank_bench [-c connections] [-d seconds] [-a accounts] [-z zipf exponent]
+//                   [-m l:w:d:t weights] [-r total commands per second] [-H histogram file]
+
+#define SOCKET_PATH "/tmp/bank-socket"
+#define BUFSIZE 255
+#define MAX_CONNECTIONS 1024
+#define MAX_IN_FLIGHT 4096      // Open loop commands a connection may have unanswered
+#define HIST_SUB_BITS 6         // 2^6 sub-buckets per power of two: values within ~3%
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_SIZE (60 * HIST_HALF)     // Enough for every 64-bit value
+
+// Log-linear histogram of nanosecond values, in the manner of HdrHistogram: exact below
+// 2^HIST_SUB_BITS, and split in HIST_HALF equal buckets within every higher power of two.
+struct Histogram {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+};
+
+struct Config {
+    int connections;
+    double duration;
+    int accounts;
+    double zipf;
+    double rate;                // Commands per second over all connections, 0 for closed loop
+    int mix[4];                 // Weights of l, w, d and t
+    const char *histogram_path;
+};
+
+struct Connection_run {
+    int index;
+    uint64_t random;
+    struct Histogram latency;
+    long operations;
+    long failures;
+    double ready_ns;            // Connect until "ready", -1 if the server never greeted
+    int broken;
+};
+
+static struct Config config = { 4, 5.0, 1000, 0.0, 0.0, { 25, 25, 25, 25 }, NULL };
+static double *zipf_cdf;        // Cumulative probability of account ids, NULL for uniform
+static double bench_start;
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int histogram_index(uint64_t value) {
+    if (value < 2 * HIST_HALF) {
+        return value;
+    }
+    int msb = 0;
+    while (value >> (msb + 1)) {
+        msb++;
+    }
+    int shift = msb - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (value >> shift);
+}
+
+
+// Highest value that lands in the bucket with given index.
+static uint64_t histogram_value(int index) {
+    if (index < 2 * HIST_HALF) {
+        return index;
+    }
+    int shift = index / HIST_HALF - 1;
+    uint64_t low = (uint64_t)(index - shift * HIST_HALF) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+
+static void histogram_record(struct Histogram *histogram, double value_ns) {
+    uint64_t value = value_ns > 0 ? (uint64_t)value_ns : 0;
+    int index = histogram_index(value);
+    histogram->counts[index < HIST_SIZE ? index : HIST_SIZE - 1]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+
+static void histogram_add(struct Histogram *into, const struct Histogram *from) {
+    for (int i = 0; i < HIST_SIZE; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+
+static uint64_t histogram_percentile(const struct Histogram *histogram, double percentile) {
+    uint64_t wanted = (uint64_t)ceil(histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+// xorshift64*, one generator per connection.
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * UINT64_C(2685821657736338717);
+}
+
+
+static double random_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// Account ids follow a Zipf distribution when -z is given: id k is picked with a
+// probability proportional to 1 / (k + 1)^z, so low ids are the hot ones.
+static int pick_account(uint64_t *state) {
+    if (!zipf_cdf) {
+        return next_random(state) % config.accounts;
+    }
+    double target = random_unit(state);
+    int low = 0;
+    int high = config.accounts - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (zipf_cdf[middle] < target) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+static int init_zipf(void) {
+    zipf_cdf = malloc(config.accounts * sizeof(double));
+    if (!zipf_cdf) {
+        return 0;
+    }
+    double sum = 0;
+    for (int k = 0; k < config.accounts; k++) {
+        sum += 1.0 / pow(k + 1, config.zipf);
+        zipf_cdf[k] = sum;
+    }
+    for (int k = 0; k < config.accounts; k++) {
+        zipf_cdf[k] /= sum;
+    }
+    return 1;
+}
+
+
+// Write the next command of the mix into buffer and return its length.
+static int next_command(uint64_t *state, char *buffer) {
+    int total = config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3];
+    int pick = next_random(state) % total;
+    int account = pick_account(state);
+
+    if ((pick -= config.mix[0]) < 0) {
+        return snprintf(buffer, BUFSIZE, "l %d\n", account);
+    }
+    if ((pick -= config.mix[1]) < 0) {
+        return snprintf(buffer, BUFSIZE, "w %d 0.01\n", account);
+    }
+    if ((pick -= config.mix[2]) < 0) {
+        return snprintf(buffer, BUFSIZE, "d %d 0.01\n", account);
+    }
+    return snprintf(buffer, BUFSIZE, "t %d %d 0.01\n", account, pick_account(state));
+}
+
+
+static int write_all(int sock, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(sock, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+
+// Connect and wait for "ready". Returns the socket, or -1.
+static int connect_to_server(struct Connection_run *run) {
+    char buffer[BUFSIZE];
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+
+    double start = now_ns();
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    if (read(sock, buffer, sizeof(buffer)) <= 0) {
+        close(sock);
+        return -1;
+    }
+    run->ready_ns = now_ns() - start;
+    return sock;
+}
+
+
+// Count the replies in what was read. Replies that begin with "fail" are counted as failures
+// as well; a reply split between reads is recognised by the state kept in *line_start.
+static int count_replies(struct Connection_run *run, const char *buffer, ssize_t n, int *line_start) {
+    int replies = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        if (*line_start && buffer[i] == 'f') {
+            run->failures++;
+        }
+        *line_start = buffer[i] == '\n';
+        replies += *line_start;
+    }
+    return replies;
+}
+
+
+static void run_closed_loop(struct Connection_run *run, int sock, double deadline) {
+    char command[BUFSIZE];
+    char buffer[BUFSIZE];
+    int line_start = 1;
+
+    while (now_ns() < deadline) {
+        int length = next_command(&run->random, command);
+        double sent = now_ns();
+        if (!write_all(sock, command, length)) {
+            run->broken = 1;
+            return;
+        }
+        int replies = 0;
+        while (replies == 0) {
+            ssize_t n = read(sock, buffer, sizeof(buffer));
+            if (n <= 0) {
+                run->broken = 1;
+                return;
+            }
+            replies = count_replies(run, buffer, n, &line_start);
+        }
+        histogram_record(&run->latency, now_ns() - sent);
+        run->operations++;
+    }
+}
+
+
+static void run_open_loop(struct Connection_run *run, int sock, double deadline) {
+    char command[BUFSIZE];
+    char buffer[16384];
+    int line_start = 1;
+    double *due = malloc(MAX_IN_FLIGHT * sizeof(double));
+    long sent = 0;
+    long answered = 0;
+    double interval = 1e9 * config.connections / config.rate;
+    // Spread the connections' schedules over one interval
+    double next_due = now_ns() + interval * run->index / config.connections;
+
+    if (!due) {
+        run->broken = 1;
+        return;
+    }
+    while (answered < sent || next_due < deadline) {
+        double now = now_ns();
+        while (next_due <= now && next_due < deadline && sent - answered < MAX_IN_FLIGHT) {
+            int length = next_command(&run->random, command);
+            if (!write_all(sock, command, length)) {
+                run->broken = 1;
+                free(due);
+                return;
+            }
+            due[sent++ % MAX_IN_FLIGHT] = next_due;
+            next_due += interval;
+        }
+
+        // Wait for replies, but no longer than until the next command is due
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        double wait = next_due < deadline && sent - answered < MAX_IN_FLIGHT ? next_due - now_ns() : 1e9;
+        struct timespec timeout = { 0, 0 };
+        if (wait > 0) {
+            timeout.tv_sec = (time_t)(wait / 1e9);
+            timeout.tv_nsec = (long)(wait - timeout.tv_sec * 1e9);
+        }
+        if (pselect(sock + 1, &readable, NULL, NULL, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        ssize_t n = read(sock, buffer, sizeof(buffer));
+        if (n <= 0) {
+            run->broken = 1;
+            break;
+        }
+        int replies = count_replies(run, buffer, n, &line_start);
+        double received = now_ns();
+        for (int i = 0; i < replies && answered < sent; i++) {
+            histogram_record(&run->latency, received - due[answered++ % MAX_IN_FLIGHT]);
+            run->operations++;
+        }
+    }
+    free(due);
+}
+
+
+static void *run_connection(void *arg) {
+    struct Connection_run *run = arg;
+    int sock = connect_to_server(run);
+    if (sock == -1) {
+        run->broken = 1;
+        return NULL;
+    }
+
+    double deadline = bench_start + config.duration * 1e9;
+    if (config.rate > 0) {
+        run_open_loop(run, sock, deadline);
+    }
+    else {
+        run_closed_loop(run, sock, deadline);
+    }
+
+    if (!run->broken) {
+        char buffer[BUFSIZE];
+        if (write_all(sock, "q\n", 2)) {
+            read(sock, buffer, sizeof(buffer));
+        }
+    }
+    close(sock);
+    return NULL;
+}
+
+
+// Give every account some money first, so withdrawals and transfers mostly succeed.
+static int fill_accounts(void) {
+    struct Connection_run run;
+    char buffer[16384];
+    int line_start = 1;
+    memset(&run, 0, sizeof(run));
+
+    int sock = connect_to_server(&run);
+    if (sock == -1) {
+        return 0;
+    }
+    for (int first = 0; first < config.accounts; first += 256) {
+        int count = config.accounts - first < 256 ? config.accounts - first : 256;
+        size_t length = 0;
+        for (int i = 0; i < count; i++) {
+            length += snprintf(buffer + length, 64, "d %d 1000\n", first + i);
+        }
+        if (!write_all(sock, buffer, length)) {
+            close(sock);
+            return 0;
+        }
+        while (count > 0) {
+            ssize_t n = read(sock, buffer, sizeof(buffer));
+            if (n <= 0) {
+                close(sock);
+                return 0;
+            }
+            count -= count_replies(&run, buffer, n, &line_start);
+        }
+    }
+    write_all(sock, "q\n", 2);
+    read(sock, buffer, sizeof(buffer));
+    close(sock);
+    return 1;
+}
+
+
+static int parse_mix(const char *text) {
+    return sscanf(text, "%d:%d:%d:%d", &config.mix[0], &config.mix[1], &config.mix[2], &config.mix[3]) == 4 &&
+           config.mix[0] >= 0 && config.mix[1] >= 0 && config.mix[2] >= 0 && config.mix[3] >= 0 &&
+           config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3] > 0;
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-a accounts] [-z zipf exponent]\n"
+                    "       [-m l:w:d:t weights] [-r total commands per second] [-H histogram file]\n", program);
+}
+
+
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "c:d:a:z:m:r:H:")) != -1) {
+        switch (option) {
+            case 'c': config.connections = atoi(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'a': config.accounts = atoi(optarg); break;
+            case 'z': config.zipf = atof(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'H': config.histogram_path = optarg; break;
+            case 'm':
+                if (!parse_mix(optarg)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.connections < 1 || config.connections > MAX_CONNECTIONS || config.duration <= 0 ||
+        config.accounts < 1 || config.zipf < 0 || config.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct Connection_run *runs = calloc(config.connections, sizeof(struct Connection_run));
+    pthread_t *threads = malloc(config.connections * sizeof(pthread_t));
+    if (!runs || !threads || (config.zipf > 0 && !init_zipf())) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    if (!fill_accounts()) {
+        fprintf(stderr, "Failed to connect to server\n");
+        return 1;
+    }
+
+    bench_start = now_ns();
+    for (int i = 0; i < config.connections; i++) {
+        runs[i].index = i;
+        runs[i].random = UINT64_C(0x9E3779B97F4A7C15) * (i + 1);
+        runs[i].ready_ns = -1;
+        pthread_create(&threads[i], NULL, run_connection, &runs[i]);
+    }
+
+    struct Histogram *latency = calloc(1, sizeof(struct Histogram));
+    struct Histogram *ready = calloc(1, sizeof(struct Histogram));
+    if (!latency || !ready) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    long failures = 0;
+    int broken = 0;
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(threads[i], NULL);
+        histogram_add(latency, &runs[i].latency);
+        failures += runs[i].failures;
+        broken += runs[i].broken;
+        if (runs[i].ready_ns >= 0) {
+            histogram_record(ready, runs[i].ready_ns);
+        }
+    }
+    double elapsed = (now_ns() - bench_start) / 1e9;
+
+    printf("mode %s\n", config.rate > 0 ? "open" : "closed");
+    printf("connections %d\n", config.connections);
+    printf("accounts %d\n", config.accounts);
+    printf("zipf %.2f\n", config.zipf);
+    printf("mix %d:%d:%d:%d\n", config.mix[0], config.mix[1], config.mix[2], config.mix[3]);
+    printf("target_ops_per_s %.0f\n", config.rate);
+    printf("elapsed_s %.3f\n", elapsed);
+    printf("operations %llu\n", (unsigned long long)latency->total);
+    printf("failed_replies %ld\n", failures);
+    printf("broken_connections %d\n", broken);
+    printf("throughput_ops_per_s %.0f\n", latency->total / elapsed);
+    if (latency->total > 0) {
+        printf("latency_us_mean %.1f\n", latency->sum / latency->total / 1e3);
+        printf("latency_us_p50 %.1f\n", histogram_percentile(latency, 50) / 1e3);
+        printf("latency_us_p90 %.1f\n", histogram_percentile(latency, 90) / 1e3);
+        printf("latency_us_p99 %.1f\n", histogram_percentile(latency, 99) / 1e3);
+        printf("latency_us_p999 %.1f\n", histogram_percentile(latency, 99.9) / 1e3);
+        printf("latency_us_max %.1f\n", latency->max / 1e3);
+    }
+    if (ready->total > 0) {
+        printf("ready_us_p50 %.1f\n", histogram_percentile(ready, 50) / 1e3);
+        printf("ready_us_p99 %.1f\n", histogram_percentile(ready, 99) / 1e3);
+        printf("ready_us_max %.1f\n", ready->max / 1e3);
+    }
+
+    // The whole latency histogram, one "highest value in ns, count" line per non-empty bucket
+    if (config.histogram_path) {
+        FILE *file = fopen(config.histogram_path, "w");
+        if (!file) {
+            fprintf(stderr, "Failed to open %s\n", config.histogram_path);
+            return 1;
+        }
+        for (int i = 0; i < HIST_SIZE; i++) {
+            if (latency->counts[i] > 0) {
+                fprintf(file, "%llu %llu\n", (unsigned long long)histogram_value(i), (unsigned long long)latency->counts[i]);
+            }
+        }
+        fclose(file);
+    }
+
+    free(latency);
+    free(ready);
+    free(runs);
+    free(threads);
+    free(zipf_cdf);
+    return 0;
+}
@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Measures how much CPU an idle bank_server uses, and how long a new client
+// waits from connect() until the desk greets it with "ready".
+//
+// Usage: desk_bench <server pid> [idle seconds] [connections]
+
+#define SOCKET_PATH "/tmp/bank-socket"
+#define BUFSIZE 255
+
+
+// User + system CPU time of a process in clock ticks, read from /proc/<pid>/stat.
+static long process_cpu_ticks(int pid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    size_t n = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[n] = '\0';
+
+    // Fields after the command name, which is in parentheses and may contain spaces.
+    char *rest = strrchr(stat, ')');
+    if (!rest) {
+        return -1;
+    }
+    long utime, stime;
+    if (sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) {
+        return -1;
+    }
+    return utime + stime;
+}
+
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+// Connect, wait for "ready", then quit. Returns the connect-to-ready time in microseconds.
+static double time_to_ready(void) {
+    char buffer[BUFSIZE];
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+
+    double start = now_us();
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Failed to connect to server\n");
+        exit(1);
+    }
+    if (read(sock, buffer, sizeof(buffer) - 1) <= 0) {
+        fprintf(stderr, "Server closed the connection before ready\n");
+        exit(1);
+    }
+    double elapsed = now_us() - start;
+
+    if (write(sock, "q\n", 2) == 2) {
+        read(sock, buffer, sizeof(buffer) - 1);
+    }
+    close(sock);
+    return elapsed;
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <server pid> [idle seconds] [connections]\n", argv[0]);
+        return 1;
+    }
+    int pid = atoi(argv[1]);
+    int idle_seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int connections = argc > 3 ? atoi(argv[3]) : 1000;
+
+    // Idle CPU: the server has no clients, so anything it burns here is spinning.
+    long before = process_cpu_ticks(pid);
+    sleep(idle_seconds);
+    long after = process_cpu_ticks(pid);
+    if (before < 0 || after < 0) {
+        fprintf(stderr, "Failed to read CPU time of process %d\n", pid);
+        return 1;
+    }
+    double idle_cpu = 100.0 * (after - before) / sysconf(_SC_CLK_TCK) / idle_seconds;
+
+    // Accept-to-ready latency, one client at a time so every client finds a free desk.
+    double *latencies = malloc(connections * sizeof(double));
+    if (!latencies) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    double total = 0;
+    for (int i = 0; i < connections; i++) {
+        latencies[i] = time_to_ready();
+        total += latencies[i];
+    }
+    qsort(latencies, connections, sizeof(double), compare_doubles);
+
+    printf("idle_cpu_percent %.2f\n", idle_cpu);
+    printf("ready_us_min %.1f\n", latencies[0]);
+    printf("ready_us_avg %.1f\n", total / connections);
+    printf("ready_us_p50 %.1f\n", latencies[connections / 2]);
+    printf("ready_us_p99 %.1f\n", latencies[connections * 99 / 100]);
+    printf("ready_us_max %.1f\n", latencies[connections - 1]);
+
+    free(latencies);
+    return 0;
+}
@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bank_helper.h"
+
+// Compares the account layout of the store against the earlier one, where every account
+// held its id and a pthread_rwlock_t next to the balance. Counts cache misses with perf
+// counters where the kernel allows it, and always measures time.
+//   neighbours: each thread deposits to its own account, the accounts next to each other
+//   scan: one thread sums the balances of every account, as saving does
+// Build as layout_bench_padded to see accounts padded to a cache line each.
+//
+// Usage: layout_bench [threads] [deposits per thread] [accounts to scan]
+
+// glibc only declares it for _DEFAULT_SOURCE, which would lower _POSIX_C_SOURCE
+long syscall(long number, ...);
+
+#define MAX_THREADS 64
+#define SCAN_ROUNDS 20
+
+// Account as it was laid out before the split.
+struct Legacy_account {
+    int id;
+    _Atomic int64_t balance;
+    pthread_rwlock_t lock;
+    atomic_uint_fast64_t epoch;
+    uint64_t previous_epoch;
+    int64_t snapshot_balance;
+};
+
+struct Counters {
+    int fds[2];
+    long long values[2];
+};
+
+struct Neighbour_arg {
+    _Atomic int64_t *balance;
+    long deposits;
+};
+
+static const char *counter_names[2] = { "cache_misses", "l1d_misses" };
+
+
+static int open_counter(unsigned int type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;   // Count the worker threads started while the counter runs
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static void start_counters(struct Counters *counters) {
+    counters->fds[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counters->fds[1] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                    (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    for (int i = 0; i < 2; i++) {
+        if (counters->fds[i] != -1) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+static void stop_counters(struct Counters *counters) {
+    for (int i = 0; i < 2; i++) {
+        counters->values[i] = -1;
+        if (counters->fds[i] == -1) {
+            continue;
+        }
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], &counters->values[i], sizeof(long long)) != sizeof(long long)) {
+            counters->values[i] = -1;
+        }
+        close(counters->fds[i]);
+    }
+}
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void report(const char *test, const char *layout, double elapsed_ns, struct Counters *counters, double operations) {
+    printf("%s_%s_ns_per_op %.2f\n", test, layout, elapsed_ns / operations);
+    for (int i = 0; i < 2; i++) {
+        if (counters->values[i] >= 0) {
+            printf("%s_%s_%s_per_op %.4f\n", test, layout, counter_names[i], counters->values[i] / operations);
+        }
+        else {
+            printf("%s_%s_%s_per_op unavailable\n", test, layout, counter_names[i]);
+        }
+    }
+}
+
+
+static void *deposit_to_neighbour(void *arg) {
+    struct Neighbour_arg *neighbour = arg;
+    // The atomic add deposit does, without the call, so only the layout differs
+    for (long i = 0; i < neighbour->deposits; i++) {
+        atomic_fetch_add(neighbour->balance, 1);
+    }
+    return NULL;
+}
+
+
+static void run_neighbours(const char *layout, struct Legacy_account *legacy, struct Account_store *store,
+                            int threads, long deposits) {
+    pthread_t ids[MAX_THREADS];
+    struct Neighbour_arg args[MAX_THREADS];
+    struct Counters counters;
+
+    for (int i = 0; i < threads; i++) {
+        args[i].balance = legacy ? &legacy[i].balance : &account_at(store, i)->balance;
+        args[i].deposits = deposits;
+    }
+
+    start_counters(&counters);
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, deposit_to_neighbour, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+    stop_counters(&counters);
+
+    report("neighbours", layout, elapsed, &counters, (double)threads * deposits);
+}
+
+
+static void run_scan(const char *layout, struct Legacy_account *legacy, struct Account_store *store, int accounts) {
+    struct Counters counters;
+    int64_t sum = 0;
+
+    start_counters(&counters);
+    double start = now_ns();
+    for (int round = 0; round < SCAN_ROUNDS; round++) {
+        for (int i = 0; i < accounts; i++) {
+            sum += legacy ? atomic_load_explicit(&legacy[i].balance, memory_order_relaxed)
+                          : atomic_load_explicit(&account_at(store, i)->balance, memory_order_relaxed);
+        }
+    }
+    double elapsed = now_ns() - start;
+    stop_counters(&counters);
+
+    report("scan", layout, elapsed, &counters, (double)SCAN_ROUNDS * accounts);
+    if (sum != 0) {
+        printf("scan_%s_sum %lld\n", layout, (long long)sum);   // Keeps the loop from being removed
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    long deposits = argc > 2 ? atol(argv[2]) : 5000000;
+    int accounts = argc > 3 ? atoi(argv[3]) : 1000000;
+    if (threads < 1 || threads > MAX_THREADS || accounts < threads) {
+        fprintf(stderr, "Usage: %s [threads <= %d] [deposits per thread] [accounts to scan]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    struct Legacy_account *legacy = calloc(accounts, sizeof(struct Legacy_account));
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    if (!legacy || !init_account_store(&store, accounts)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < accounts; i++) {
+        legacy[i].id = i;
+        pthread_rwlock_init(&legacy[i].lock, NULL);
+        create_new_account(&store, i, &store_lock);
+    }
+
+    const char *layout = ACCOUNT_ALIGN == CACHE_LINE ? "padded" : "packed";
+    printf("legacy_account_bytes %zu\n", sizeof(struct Legacy_account));
+    printf("%s_account_bytes %zu\n", layout, sizeof(struct Account));
+
+    run_neighbours("legacy", legacy, NULL, threads, deposits);
+    run_neighbours(layout, NULL, &store, threads, deposits);
+    run_scan("legacy", legacy, NULL, accounts);
+    run_scan(layout, NULL, &store, accounts);
+
+    destroy_account_store(&store);
+    free(legacy);
+    return 0;
+}
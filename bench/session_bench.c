@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Measures how long clients wait for a desk when session lengths are skewed: most clients
+// run a few commands and leave, a few stay for a long session. More clients than desks
+// keep connecting, so some always wait; the question is how long, and whether a client
+// that queued behind a long session is stuck there while other desks go idle.
+// Reports connect-to-"ready" and whole-session time of the short sessions.
+//
+// Usage: session_bench [-c clients] [-d seconds] [-p long session percent]
+//                      [-l long session commands] [-s short session commands]
+
+#define SOCKET_PATH "/tmp/bank-socket"
+#define BUFSIZE 255
+#define MAX_CLIENTS 256
+
+struct Samples {
+    double *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct Client_run {
+    int id;
+    uint64_t random;
+    struct Samples ready;           // Connect until "ready", every session
+    struct Samples short_session;   // Connect until the last reply, short sessions only
+    long long_sessions;
+    int broken;
+};
+
+static int clients = 6;
+static double duration = 5;
+static int long_percent = 2;
+static int long_commands = 300;
+static int short_commands = 10;
+static double deadline;
+
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static int add_sample(struct Samples *samples, double value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (!values) {
+            return 0;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return 1;
+}
+
+
+// One reply line; replies are short enough to arrive whole.
+static int read_reply(int sock) {
+    char buffer[BUFSIZE];
+    size_t length = 0;
+    while (length == 0 || buffer[length - 1] != '\n') {
+        ssize_t n = read(sock, buffer + length, sizeof(buffer) - length);
+        if (n <= 0) {
+            return 0;
+        }
+        length += n;
+    }
+    return 1;
+}
+
+
+// Connect, wait for a desk, run the session and leave. Returns 0 if the connection broke.
+static int run_session(struct Client_run *run, int commands) {
+    char command[BUFSIZE];
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+
+    double start = now_us();
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0 || !read_reply(sock)) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return 0;
+    }
+    add_sample(&run->ready, now_us() - start);
+
+    for (int i = 0; i < commands; i++) {
+        int length = snprintf(command, sizeof(command), "d %d 0.01\n", run->id);
+        if (write(sock, command, length) != length || !read_reply(sock)) {
+            close(sock);
+            return 0;
+        }
+    }
+    if (commands == short_commands) {
+        add_sample(&run->short_session, now_us() - start);
+    }
+    if (write(sock, "q\n", 2) == 2) {
+        read_reply(sock);
+    }
+    close(sock);
+    return 1;
+}
+
+
+static void *run_client(void *arg) {
+    struct Client_run *run = arg;
+    while (now_us() < deadline) {
+        run->random = run->random * 6364136223846793005ULL + 1442695040888963407ULL;
+        int is_long = (int)((run->random >> 33) % 100) < long_percent;
+        if (!run_session(run, is_long ? long_commands : short_commands)) {
+            run->broken = 1;
+            break;
+        }
+        run->long_sessions += is_long;
+    }
+    return NULL;
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void report(const char *name, struct Samples *samples) {
+    if (samples->count == 0) {
+        return;
+    }
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    printf("%s_us_avg %.1f\n", name, total / samples->count);
+    printf("%s_us_p50 %.1f\n", name, samples->values[samples->count / 2]);
+    printf("%s_us_p90 %.1f\n", name, samples->values[samples->count * 90 / 100]);
+    printf("%s_us_p99 %.1f\n", name, samples->values[samples->count * 99 / 100]);
+    printf("%s_us_p999 %.1f\n", name, samples->values[samples->count * 999 / 1000]);
+    printf("%s_us_max %.1f\n", name, samples->values[samples->count - 1]);
+}
+
+
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "c:d:p:l:s:")) != -1) {
+        switch (option) {
+            case 'c': clients = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'p': long_percent = atoi(optarg); break;
+            case 'l': long_commands = atoi(optarg); break;
+            case 's': short_commands = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-p long session percent] "
+                                "[-l long session commands] [-s short session commands]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (clients < 1 || clients > MAX_CLIENTS || duration <= 0 || short_commands < 0 ||
+        long_commands <= short_commands || long_percent < 0 || long_percent > 100) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    struct Client_run *runs = calloc(clients, sizeof(struct Client_run));
+    pthread_t *threads = malloc(clients * sizeof(pthread_t));
+    if (!runs || !threads) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+
+    deadline = now_us() + duration * 1e6;
+    for (int i = 0; i < clients; i++) {
+        runs[i].id = i;
+        runs[i].random = i + 1;
+        pthread_create(&threads[i], NULL, run_client, &runs[i]);
+    }
+
+    struct Samples ready = { 0 };
+    struct Samples short_session = { 0 };
+    long long_sessions = 0;
+    int broken = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        for (size_t j = 0; j < runs[i].ready.count; j++) {
+            add_sample(&ready, runs[i].ready.values[j]);
+        }
+        for (size_t j = 0; j < runs[i].short_session.count; j++) {
+            add_sample(&short_session, runs[i].short_session.values[j]);
+        }
+        long_sessions += runs[i].long_sessions;
+        broken += runs[i].broken;
+        free(runs[i].ready.values);
+        free(runs[i].short_session.values);
+    }
+
+    printf("clients %d\n", clients);
+    printf("sessions %zu\n", ready.count);
+    printf("long_sessions %ld\n", long_sessions);
+    printf("broken_clients %d\n", broken);
+    report("ready", &ready);
+    report("short_session", &short_session);
+
+    free(ready.values);
+    free(short_session.values);
+    free(runs);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bank_helper.h"
+
+// Compares the text protocol, the binary one and the shared memory rings. Sends the same
+// deposits over each, WINDOW of them in flight at a time, and reports throughput and the
+// CPU time the server spent per operation; then sends balance checks, which wait for no
+// journal write, one at a time over the binary protocol and the rings, and reports the
+// round trip time. Waiting for ring responses polls
+// for the given microseconds before sleeping; start the server with a ring poll time too.
+//
+// Usage: wire_bench <server pid> [deposits] [accounts] [ring poll us]
+
+#define SOCKET_PATH "/tmp/bank-socket"
+#define BUFSIZE 255
+#define WINDOW 256
+
+enum Protocol { TEXT, BINARY, RING };
+
+
+// User + system CPU time of a process in clock ticks, read from /proc/<pid>/stat.
+static long process_cpu_ticks(int pid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    size_t n = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[n] = '\0';
+
+    char *rest = strrchr(stat, ')');
+    if (!rest) {
+        return -1;
+    }
+    long utime, stime;
+    if (sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) {
+        return -1;
+    }
+    return utime + stime;
+}
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void write_all(int sock, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(sock, data, size);
+        if (n <= 0) {
+            fprintf(stderr, "Failed to send to server\n");
+            exit(1);
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+
+// Read until count bytes, or count lines if lines is set, have arrived.
+static void read_replies(int sock, size_t count, int lines) {
+    char buffer[16384];
+    while (count > 0) {
+        ssize_t n = read(sock, buffer, lines ? sizeof(buffer) : (count < sizeof(buffer) ? count : sizeof(buffer)));
+        if (n <= 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(1);
+        }
+        if (!lines) {
+            count -= n;
+            continue;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            count -= buffer[i] == '\n';
+        }
+    }
+}
+
+
+// Connect and wait for "ready". With binary set, also switch the connection to the binary protocol.
+static int connect_to_server(int binary) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Failed to connect to server\n");
+        exit(1);
+    }
+    read_replies(sock, 1, 1);
+    if (binary) {
+        write_all(sock, "b\n", 2);
+        read_replies(sock, 1, 1);
+    }
+    return sock;
+}
+
+
+// Switch the connection to shared memory and map the rings.
+static struct Ring_segment *attach_rings(int sock) {
+    char reply[BUFSIZE];
+    char name[RING_NAME_SIZE];
+    size_t length = 0;
+    write_all(sock, "m\n", 2);
+    while (length == 0 || reply[length - 1] != '\n') {
+        ssize_t n = read(sock, reply + length, sizeof(reply) - 1 - length);
+        if (n <= 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(1);
+        }
+        length += n;
+    }
+    reply[length] = '\0';
+    struct Ring_segment *ring = NULL;
+    if (sscanf(reply, "ok: Shared memory %63s", name) == 1) {
+        ring = ring_attach(name);
+    }
+    if (!ring) {
+        fprintf(stderr, "Failed to switch to shared memory: %s", reply);
+        exit(1);
+    }
+    return ring;
+}
+
+
+// Push window requests to the request ring and wait for all their responses.
+static void run_ring_window(struct Ring_segment *ring, char operation, long first, long window, int accounts, int poll_us) {
+    for (long i = 0; i < window; i++) {
+        struct Wire_request request = { .operation = operation, .account_id = (first + i) % accounts, .dest_id = -1, .amount = 1 };
+        ring_push(&ring->requests, ring->request_entries, sizeof(request), &request);
+    }
+    ring_wake(&ring->requests);
+    for (long answered = 0; answered < window; ) {
+        struct Wire_response response;
+        if (!ring_wait(&ring->responses, poll_us, 1000)) {
+            continue;
+        }
+        while (ring_pop(&ring->responses, ring->response_entries, sizeof(response), &response)) {
+            answered++;
+        }
+    }
+}
+
+
+// Send deposits of one cent, or balance checks if operation is 'l', over the chosen protocol,
+// at most in_flight at a time, and return the seconds it took. *server_cpu_s is set to the
+// CPU time the server used meanwhile.
+static double run(enum Protocol protocol, char operation, int pid, long deposits, int accounts, long in_flight,
+                  int poll_us, double *server_cpu_s) {
+    int binary = protocol == BINARY;
+    char *batch = malloc(WINDOW * BUFSIZE);
+    if (!batch) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    int sock = connect_to_server(binary);
+    struct Ring_segment *ring = protocol == RING ? attach_rings(sock) : NULL;
+
+    long cpu_before = process_cpu_ticks(pid);
+    double start = now_s();
+    for (long sent = 0; sent < deposits; ) {
+        size_t len = 0;
+        long window = deposits - sent < in_flight ? deposits - sent : in_flight;
+        if (ring) {
+            run_ring_window(ring, operation, sent, window, accounts, poll_us);
+            sent += window;
+            continue;
+        }
+        for (long i = 0; i < window; i++) {
+            int account = (sent + i) % accounts;
+            if (binary) {
+                struct Wire_request request = { .operation = operation, .account_id = account, .dest_id = -1, .amount = 1 };
+                memcpy(batch + len, &request, sizeof(request));
+                len += sizeof(request);
+            }
+            else {
+                len += operation == 'l' ? snprintf(batch + len, BUFSIZE, "l %d\n", account)
+                                        : snprintf(batch + len, BUFSIZE, "d %d 0.01\n", account);
+            }
+        }
+        write_all(sock, batch, len);
+        read_replies(sock, binary ? window * sizeof(struct Wire_response) : (size_t)window, !binary);
+        sent += window;
+    }
+    double elapsed = now_s() - start;
+    long cpu_after = process_cpu_ticks(pid);
+    if (ring) {
+        struct Wire_request quit = { .operation = 'q' };
+        ring_push(&ring->requests, ring->request_entries, sizeof(quit), &quit);
+        ring_wake(&ring->requests);
+        ring_release(ring);
+    }
+    close(sock);
+    free(batch);
+
+    if (cpu_before < 0 || cpu_after < 0) {
+        fprintf(stderr, "Failed to read CPU time of process %d\n", pid);
+        exit(1);
+    }
+    *server_cpu_s = (double)(cpu_after - cpu_before) / sysconf(_SC_CLK_TCK);
+    return elapsed;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <server pid> [deposits] [accounts] [ring poll us]\n", argv[0]);
+        return 1;
+    }
+    int pid = atoi(argv[1]);
+    long deposits = argc > 2 ? atol(argv[2]) : 200000;
+    int accounts = argc > 3 ? atoi(argv[3]) : 1000;
+    int poll_us = argc > 4 ? atoi(argv[4]) : 0;
+    if (deposits < 1 || accounts < 1 || poll_us < 0) {
+        fprintf(stderr, "Usage: %s <server pid> [deposits] [accounts] [ring poll us]\n", argv[0]);
+        return 1;
+    }
+
+    const char *names[] = { "text", "binary", "ring" };
+    double cpu_s;
+    for (enum Protocol protocol = TEXT; protocol <= RING; protocol++) {
+        double elapsed = run(protocol, 'd', pid, deposits, accounts, WINDOW, poll_us, &cpu_s);
+        printf("%s_ops_per_s %.0f\n", names[protocol], deposits / elapsed);
+        printf("%s_server_cpu_us_per_op %.3f\n", names[protocol], cpu_s * 1e6 / deposits);
+    }
+    for (enum Protocol protocol = BINARY; protocol <= RING; protocol++) {
+        long trips = deposits / 10 > 0 ? deposits / 10 : 1;
+        double elapsed = run(protocol, 'l', pid, trips, accounts, 1, poll_us, &cpu_s);
+        printf("%s_round_trip_us %.2f\n", names[protocol], elapsed * 1e6 / trips);
+    }
+    return 0;
+}
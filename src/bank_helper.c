@@ -5,6 +5,15 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <sched.h>
+#include <time.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bank_helper.h" 
 
@@ -12,78 +21,1311 @@
 // Currently, server terminal only prints necessary messages.
 
 
-// Save account from memory do database text file.
-// First row only has account count, other rows contain data of each account.
-int save_accounts(struct Account *accounts, int acc_count, const char *database) {
-    FILE *file = fopen(database, "w");
+// Index tables never go below this many entries.
+#define INDEX_MIN_CAPACITY 64
+
+// Checkpoints are written in epochs. Every change to an account happens inside an epoch,
+// between enter_epoch and leave_epoch. advance_epoch starts a new epoch and waits until
+// nobody works in the old one anymore; from then on the old epoch's balances are fixed,
+// and the checkpointer can read them while desks keep changing accounts in the new epoch.
+static atomic_uint_fast64_t global_epoch = 1;
+static atomic_uint_fast64_t stable_epoch = 0;   // Latest epoch with no changes in progress
+static struct Epoch_slot epoch_slots[MAX_EPOCH_THREADS];
+static atomic_int epoch_slot_count = 0;
+static atomic_int epoch_slots_released[MAX_EPOCH_THREADS];
+static pthread_key_t epoch_slot_owner;
+static pthread_once_t epoch_slot_owner_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct Epoch_slot *thread_slot = NULL;
+static _Thread_local uint64_t thread_epoch = 0;
+
+// Money deposited with deposit, counted like balances: each change by the epoch it was made
+// in, so a total of the deposits matches the balances of the same closed epoch. The two
+// slots are the current epoch and the one before, which may still have deposits under way.
+static _Atomic int64_t epoch_deposits[2];
+static _Atomic int64_t closed_deposits = 0;    // Deposits of every epoch up to stable_epoch
+
+// Hot accounts, see combine. Requests are numbered like epoch slots.
+static struct Combine_request combine_requests[MAX_EPOCH_THREADS];
+static struct Combiner combiners[HOT_MAX_ACCOUNTS];
+static atomic_int hot_contention = HOT_CONTENTION;
+static atomic_int hot_accounts = 0;
+
+
+// Spread account ids over the table, consecutive ids would otherwise form long probe runs.
+static size_t index_hash(int id) {
+    unsigned int h = (unsigned int)id * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+
+// Allocate an empty index table with room for at least capacity entries.
+static struct Index_table *alloc_index_table(size_t capacity) {
+    size_t size = INDEX_MIN_CAPACITY;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    struct Index_table *table = malloc(sizeof(struct Index_table) + size * sizeof(struct Index_entry));
+    if (!table) {
+        return NULL;
+    }
+    table->mask = size - 1;
+    table->retired = NULL;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&table->entries[i].id, 0);
+        atomic_init(&table->entries[i].slot, -1);
+    }
+    return table;
+}
+
+
+// Place an entry in a table nobody else can see yet, used when growing the index.
+static void index_place(struct Index_table *table, int id, int slot) {
+    size_t i = index_hash(id) & table->mask;
+    while (atomic_load_explicit(&table->entries[i].slot, memory_order_relaxed) != -1) {
+        i = (i + 1) & table->mask;
+    }
+    atomic_store_explicit(&table->entries[i].id, id, memory_order_relaxed);
+    atomic_store_explicit(&table->entries[i].slot, slot, memory_order_relaxed);
+}
+
+
+// Init the index with room for capacity accounts before it has to grow.
+int init_account_index(struct Account_index *index, int capacity) {
+    struct Index_table *table = alloc_index_table(capacity > 0 ? (size_t)capacity * 2 : 0);
+    if (!table) {
+        fprintf(stderr, "Failed to allocate account index\n");
+        return 0;
+    }
+    atomic_init(&index->table, table);
+    index->used = 0;
+    return 1;
+}
+
+
+// Free the current table and every table it has replaced.
+void destroy_account_index(struct Account_index *index) {
+    struct Index_table *table = atomic_load(&index->table);
+    while (table) {
+        struct Index_table *retired = table->retired;
+        free(table);
+        table = retired;
+    }
+    atomic_store(&index->table, NULL);
+    index->used = 0;
+}
+
+
+// Find the slot of an account without taking any lock. Returns -1 if the id isn't indexed.
+// The slot is stored with release ordering after the id, so seeing a slot means the id is valid too.
+int index_lookup(const struct Account_index *index, int id) {
+    struct Index_table *table = atomic_load_explicit(&index->table, memory_order_acquire);
+    size_t i = index_hash(id) & table->mask;
+
+    while (1) {
+        int slot = atomic_load_explicit(&table->entries[i].slot, memory_order_acquire);
+        if (slot == -1) {
+            return -1;
+        }
+        if (atomic_load_explicit(&table->entries[i].id, memory_order_relaxed) == id) {
+            return slot;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+
+// Add an id to the index. Only one thread may insert at a time, readers can run concurrently.
+// The table is kept at most half full; when it grows, the new table is filled completely
+// before it is published, and the old one is retired instead of freed.
+int index_insert(struct Account_index *index, int id, int slot) {
+    struct Index_table *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+
+    if ((size_t)(index->used + 1) * 2 > table->mask + 1) {
+        struct Index_table *bigger = alloc_index_table((table->mask + 1) * 2);
+        if (!bigger) {
+            fprintf(stderr, "Failed to grow account index\n");
+            return 0;
+        }
+        for (size_t i = 0; i <= table->mask; i++) {
+            int old_slot = atomic_load_explicit(&table->entries[i].slot, memory_order_relaxed);
+            if (old_slot != -1) {
+                index_place(bigger, atomic_load_explicit(&table->entries[i].id, memory_order_relaxed), old_slot);
+            }
+        }
+        bigger->retired = table;
+        atomic_store_explicit(&index->table, bigger, memory_order_release);
+        table = bigger;
+    }
+
+    size_t i = index_hash(id) & table->mask;
+    while (atomic_load_explicit(&table->entries[i].slot, memory_order_relaxed) != -1) {
+        i = (i + 1) & table->mask;
+    }
+    atomic_store_explicit(&table->entries[i].id, id, memory_order_relaxed);
+    atomic_store_explicit(&table->entries[i].slot, slot, memory_order_release);
+    index->used++;
+    return 1;
+}
+
+
+// Segment holding the given slot. Segment k starts at slot STORE_FIRST_SEGMENT * (2^k - 1).
+static int store_segment(int slot, int *offset) {
+    unsigned int units = (unsigned int)slot / STORE_FIRST_SEGMENT + 1;
+    int segment = 31 - __builtin_clz(units);
+    *offset = slot - STORE_FIRST_SEGMENT * ((1 << segment) - 1);
+    return segment;
+}
+
+
+// Init an empty account store and its index, preallocating room for capacity accounts.
+int init_account_store(struct Account_store *store, int capacity) {
+    for (int i = 0; i < STORE_SEGMENTS; i++) {
+        atomic_init(&store->segments[i], NULL);
+        atomic_init(&store->id_segments[i], NULL);
+        atomic_init(&store->history_segments[i], NULL);
+    }
+    atomic_init(&store->count, 0);
+
+    if (!init_account_index(&store->index, capacity)) {
+        return 0;
+    }
+    if (!reserve_accounts(store, capacity)) {
+        destroy_account_index(&store->index);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Allocate segments until the store can hold capacity accounts without allocating again.
+// Existing accounts are never touched. Callers must serialize this with account creation.
+int reserve_accounts(struct Account_store *store, int capacity) {
+    if (capacity <= 0) {
+        return 1;
+    }
+
+    int offset;
+    int last = store_segment(capacity - 1, &offset);
+    if (last >= STORE_SEGMENTS) {
+        fprintf(stderr, "Account store can't hold %d accounts\n", capacity);
+        return 0;
+    }
+
+    for (int k = 0; k <= last; k++) {
+        if (atomic_load_explicit(&store->segments[k], memory_order_relaxed) != NULL) {
+            continue;
+        }
+        // Segments start on a cache line, so padded accounts each get exactly one
+        size_t accounts = (size_t)STORE_FIRST_SEGMENT << k;
+        struct Account *segment = aligned_alloc(CACHE_LINE, accounts * sizeof(struct Account));
+        int *ids = malloc(accounts * sizeof(int));
+        struct History *_Atomic *histories = calloc(accounts, sizeof(*histories));
+        if (!segment || !ids || !histories) {
+            fprintf(stderr, "Failed to allocate memory for accounts\n");
+            free(segment);
+            free(ids);
+            free(histories);
+            return 0;
+        }
+        atomic_store_explicit(&store->history_segments[k], histories, memory_order_release);
+        atomic_store_explicit(&store->id_segments[k], ids, memory_order_release);
+        atomic_store_explicit(&store->segments[k], segment, memory_order_release);
+    }
+    return 1;
+}
+
+
+// Free all accounts of the store. Nothing may use the store after this.
+void destroy_account_store(struct Account_store *store) {
+    for (int k = 0; k < STORE_SEGMENTS; k++) {
+        struct History *_Atomic *histories = atomic_load(&store->history_segments[k]);
+        for (size_t i = 0; histories && i < (size_t)STORE_FIRST_SEGMENT << k; i++) {
+            free(atomic_load(&histories[i]));
+        }
+        free(histories);
+        free(atomic_load(&store->segments[k]));
+        free(atomic_load(&store->id_segments[k]));
+        atomic_store(&store->segments[k], NULL);
+        atomic_store(&store->id_segments[k], NULL);
+        atomic_store(&store->history_segments[k], NULL);
+    }
+    atomic_store(&store->count, 0);
+    destroy_account_index(&store->index);
+}
+
+
+// Get the account in given slot. The slot must come from the index or be below account_count.
+struct Account* account_at(const struct Account_store *store, int slot) {
+    int offset;
+    int segment = store_segment(slot, &offset);
+    return &atomic_load_explicit(&store->segments[segment], memory_order_acquire)[offset];
+}
+
+
+// Id of the account in given slot.
+int account_id(const struct Account_store *store, int slot) {
+    int offset;
+    int segment = store_segment(slot, &offset);
+    return atomic_load_explicit(&store->id_segments[segment], memory_order_acquire)[offset];
+}
+
+
+// Amount of accounts in the store
+int account_count(const struct Account_store *store) {
+    return atomic_load_explicit(&store->count, memory_order_acquire);
+}
+
+
+// History of the account in given slot, allocated on its first change when create is set.
+// Returns NULL if there is none.
+static struct History *history_at(const struct Account_store *store, int slot, int create) {
+    int offset;
+    int segment = store_segment(slot, &offset);
+    struct History *_Atomic *histories = atomic_load_explicit(&store->history_segments[segment], memory_order_acquire);
+    struct History *history = atomic_load_explicit(&histories[offset], memory_order_acquire);
+    if (history || !create) {
+        return history;
+    }
+
+    history = calloc(1, sizeof(struct History));
+    if (!history) {
+        fprintf(stderr, "Failed to allocate account history\n");
+        return NULL;
+    }
+    // Another thread may have recorded the account's first change meanwhile
+    struct History *installed = NULL;
+    if (!atomic_compare_exchange_strong(&histories[offset], &installed, history)) {
+        free(history);
+        return installed;
+    }
+    return history;
+}
+
+
+// Add a change to the statement of an account. kind is the journal operation that made it
+// ('d', 'w', 't', 'a', 'p', 'c' or 'r'), other_id the other account of a transfer or -1, and
+// lsn the journal slot holding it. Any number of threads may record changes at once, also to
+// the same account; the oldest of its entries makes room. Returns 0 if the account doesn't
+// exist or its history can't be allocated.
+int record_history(const struct Account_store *store, int account_id, int kind, int64_t amount,
+                    int other_id, uint64_t lsn) {
+    int slot = index_lookup(&store->index, account_id);
+    struct History *history = slot == -1 ? NULL : history_at(store, slot, 1);
+    if (!history) {
+        return 0;
+    }
+
+    uint64_t position = atomic_fetch_add_explicit(&history->head, 1, memory_order_relaxed);
+    struct History_entry *entry = &history->entries[position & (HISTORY_ENTRIES - 1)];
+
+    // The writer a lap before this one must be done with the entry first
+    uint64_t previous = position >= HISTORY_ENTRIES ? position - HISTORY_ENTRIES + 1 : 0;
+    uint64_t expected = previous;
+    while (!atomic_compare_exchange_weak_explicit(&entry->stamp, &expected, HISTORY_BUSY,
+                                                    memory_order_relaxed, memory_order_relaxed)) {
+        expected = previous;
+        sched_yield();
+    }
+    // Readers that see any of the new fields see the busy stamp too
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->lsn, lsn, memory_order_relaxed);
+    atomic_store_explicit(&entry->amount, amount, memory_order_relaxed);
+    atomic_store_explicit(&entry->other_id, other_id, memory_order_relaxed);
+    atomic_store_explicit(&entry->kind, kind, memory_order_relaxed);
+    atomic_store_explicit(&entry->stamp, position + 1, memory_order_release);
+    return 1;
+}
+
+
+// Read up to max of the latest changes of an account, at most HISTORY_ENTRIES, newest journal
+// record first. Takes no lock and only looks at the entries it returns; an entry a writer is
+// replacing just then is left out. Returns how many were read, or -1 if there's no such account.
+int read_history(const struct Account_store *store, int account_id, struct Statement_entry *entries, int max) {
+    int slot = index_lookup(&store->index, account_id);
+    if (slot == -1) {
+        return -1;
+    }
+    struct History *history = history_at(store, slot, 0);
+    if (!history) {
+        return 0;
+    }
+
+    uint64_t head = atomic_load_explicit(&history->head, memory_order_acquire);
+    int count = 0;
+    for (uint64_t position = head; position > 0 && head - position < HISTORY_ENTRIES && count < max; position--) {
+        struct History_entry *entry = &history->entries[(position - 1) & (HISTORY_ENTRIES - 1)];
+        uint64_t stamp = atomic_load_explicit(&entry->stamp, memory_order_acquire);
+        if (stamp != position) {
+            if (stamp != HISTORY_BUSY && stamp > position) {
+                break;  // Replaced by a newer change, and so are the ones before it
+            }
+            continue;
+        }
+
+        struct Statement_entry *read = &entries[count];
+        read->lsn = atomic_load_explicit(&entry->lsn, memory_order_relaxed);
+        read->amount = atomic_load_explicit(&entry->amount, memory_order_relaxed);
+        read->other_id = atomic_load_explicit(&entry->other_id, memory_order_relaxed);
+        read->kind = atomic_load_explicit(&entry->kind, memory_order_relaxed);
+        read->account_id = account_id;
+        read->pad = 0;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->stamp, memory_order_relaxed) == stamp) {
+            count++;
+        }
+    }
+
+    // Changes are recorded after they are journaled, which two desks may do in either order
+    for (int i = 1; i < count; i++) {
+        struct Statement_entry moved = entries[i];
+        int j = i;
+        for (; j > 0 && entries[j - 1].lsn < moved.lsn; j--) {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = moved;
+    }
+    return count;
+}
+
+
+// Add an account to the next free slot and publish it in the index.
+// Callers must serialize this, either by holding accounts_lock or by being the only thread.
+static int append_account(struct Account_store *store, int account_id, int64_t balance) {
+    int slot = atomic_load_explicit(&store->count, memory_order_relaxed);
+
+    // Grow geometrically, the next segment is as big as all the previous ones together
+    if (!reserve_accounts(store, slot + 1)) {
+        return -1;
+    }
+
+    int offset;
+    int segment = store_segment(slot, &offset);
+    atomic_load_explicit(&store->id_segments[segment], memory_order_relaxed)[offset] = account_id;
+
+    struct Account *account = account_at(store, slot);
+    atomic_init(&account->balance, balance);
+    atomic_init(&account->changes, 0);
+    atomic_init(&account->lock, 0);
+    atomic_init(&account->contention, 0);
+    atomic_init(&account->hot, 0);
+    atomic_init(&account->epoch, 0);
+    account->previous_epoch = 0;
+    account->snapshot_balance = 0;
+
+    // Publish the account in the index only after it's initialized
+    if (!index_insert(&store->index, account_id, slot)) {
+        return -1;
+    }
+    atomic_store_explicit(&store->count, slot + 1, memory_order_release);
+    return slot;
+}
+
+
+// Epoch that changes made now belong to
+uint64_t current_epoch(void) {
+    return atomic_load(&global_epoch);
+}
+
+
+// Add amount to counter, stopping at INT64_MAX, which stands for a total too large to keep.
+static void add_capped(_Atomic int64_t *counter, int64_t amount) {
+    int64_t value = atomic_load(counter);
+    while (!atomic_compare_exchange_weak(counter, &value, value > INT64_MAX - amount ? INT64_MAX : value + amount)) {
+    }
+}
+
+
+// Continue the epoch numbering of a loaded snapshot, at startup or when a replica is
+// promoted, while no thread is in an epoch.
+void set_epoch(uint64_t epoch) {
+    add_capped(&closed_deposits, atomic_exchange(&epoch_deposits[0], 0));
+    add_capped(&closed_deposits, atomic_exchange(&epoch_deposits[1], 0));
+    atomic_store(&global_epoch, epoch);
+    atomic_store(&stable_epoch, epoch - 1);
+}
+
+
+// Called when a thread that had a number exits, outside any epoch and with no combine
+// request waiting. The key holds the number plus one.
+static void release_thread_number(void *owner) {
+    atomic_store(&epoch_slots_released[(intptr_t)owner - 1], 1);
+}
+
+
+static void create_epoch_slot_owner(void) {
+    pthread_key_create(&epoch_slot_owner, release_thread_number);
+}
+
+
+// Number of the calling thread's epoch slot and combine request, taken on first use: one
+// released by an exited thread, or a new one. Desks come and go as their count adapts.
+static int thread_number(void) {
+    static _Thread_local int number = -1;
+    if (number != -1) {
+        return number;
+    }
+    int count = atomic_load(&epoch_slot_count);
+    for (int i = 0; number == -1 && i < count && i < MAX_EPOCH_THREADS; i++) {
+        int released = 1;
+        if (atomic_compare_exchange_strong(&epoch_slots_released[i], &released, 0)) {
+            number = i;
+        }
+    }
+    if (number == -1) {
+        number = atomic_fetch_add(&epoch_slot_count, 1);
+        if (number >= MAX_EPOCH_THREADS) {
+            fprintf(stderr, "Too many threads changing accounts\n");
+            abort();
+        }
+    }
+    pthread_once(&epoch_slot_owner_once, create_epoch_slot_owner);
+    pthread_setspecific(epoch_slot_owner, (void *)(intptr_t)(number + 1));
+    return number;
+}
+
+
+// Announce that this thread is about to change accounts and return the epoch it works in.
+// If a new epoch just started, wait for the changes of the previous one to finish first,
+// so that no change of the old epoch lands on an account after its snapshot was taken.
+uint64_t enter_epoch(void) {
+    if (!thread_slot) {
+        thread_slot = &epoch_slots[thread_number()];
+    }
+
+    // Announce before checking the epoch again, so advance_epoch either sees this thread or
+    // this thread sees the new epoch.
+    uint64_t epoch;
+    do {
+        epoch = atomic_load(&global_epoch);
+        atomic_store(&thread_slot->active, epoch);
+    } while (atomic_load(&global_epoch) != epoch);
+
+    while (atomic_load(&stable_epoch) + 1 < epoch) {
+        sched_yield();
+    }
+    thread_epoch = epoch;
+    return epoch;
+}
+
+
+void leave_epoch(void) {
+    thread_epoch = 0;
+    atomic_store(&thread_slot->active, 0);
+}
+
+
+// Start a new epoch and wait until every thread still working in the old one has left.
+// Returns the old epoch, whose balances can no longer change. Changes only wait for this
+// while the last changes of the old epoch finish, which takes microseconds.
+uint64_t advance_epoch(void) {
+    pthread_mutex_lock(&epoch_mutex);
+    uint64_t old = atomic_load(&global_epoch);
+    atomic_store(&global_epoch, old + 1);
+
+    int count = atomic_load(&epoch_slot_count);
+    for (int i = 0; i < count && i < MAX_EPOCH_THREADS; i++) {
+        uint64_t active;
+        while ((active = atomic_load(&epoch_slots[i].active)) != 0 && active <= old) {
+            sched_yield();
+        }
+    }
+    add_capped(&closed_deposits, atomic_exchange(&epoch_deposits[old & 1], 0));
+    atomic_store(&stable_epoch, old);
+    pthread_mutex_unlock(&epoch_mutex);
+    return old;
+}
+
+
+// Count a deposit in the calling thread's epoch; deposit does this itself, journal replay
+// calls it for the deposits it redoes. Outside of an epoch, as while the journal is replayed
+// at startup, it counts as closed right away.
+void count_deposit(int64_t amount) {
+    add_capped(thread_epoch != 0 ? &epoch_deposits[thread_epoch & 1] : &closed_deposits, amount);
+}
+
+
+// Money deposited up to the end of the epoch advance_epoch returned last. Returns 0 if the
+// total is too large to keep. Only valid until the next advance_epoch.
+int stable_deposits(int64_t *total) {
+    *total = atomic_load(&closed_deposits);
+    return *total != INT64_MAX;
+}
+
+
+// Continue the deposit total of a loaded snapshot, while no thread is in an epoch.
+void set_deposits(int64_t total) {
+    atomic_store(&epoch_deposits[0], 0);
+    atomic_store(&epoch_deposits[1], 0);
+    atomic_store(&closed_deposits, total);
+}
+
+
+// Called after every account lock acquisition with the nanoseconds it waited, see set_lock_observer
+static void (*lock_observer)(uint64_t wait_ns);
+
+
+// Have observer called after every account lock acquisition, with how long it had to wait;
+// 0 if the lock was free. The clock is only read when the lock was taken.
+void set_lock_observer(void (*observer)(uint64_t wait_ns)) {
+    lock_observer = observer;
+}
+
+
+// Account locks are a single atomic int. They are held for a few instructions at a time,
+// so waiters spin, yielding the CPU in case the holder was preempted.
+static void lock_account(struct Account *account) {
+    if (!atomic_exchange_explicit(&account->lock, 1, memory_order_acquire)) {
+        if (lock_observer) {
+            lock_observer(0);
+        }
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        while (atomic_load_explicit(&account->lock, memory_order_relaxed)) {
+            sched_yield();
+        }
+    } while (atomic_exchange_explicit(&account->lock, 1, memory_order_acquire));
+    if (lock_observer) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        lock_observer((end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+    }
+}
+
+
+static void unlock_account(struct Account *account) {
+    atomic_store_explicit(&account->lock, 0, memory_order_release);
+}
+
+
+// Before the first change to an account in a new epoch, keep its balance and the epoch of
+// its last change for the checkpointer. Called with the account locked, or by the only
+// thread that changes it, see apply_changes.
+static void preserve_snapshot(struct Account *account) {
+    uint64_t latest = atomic_load_explicit(&account->epoch, memory_order_relaxed);
+    if (thread_epoch != 0 && latest != thread_epoch) {
+        account->snapshot_balance = atomic_load_explicit(&account->balance, memory_order_relaxed);
+        account->previous_epoch = latest;
+        atomic_store_explicit(&account->epoch, thread_epoch, memory_order_release);
+        // The change that follows must not be seen before the new epoch, see stable_balance
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+
+// Balance of an account at the end of given epoch, and the epoch it last changed in by then.
+// The epoch must be stable, or the current one while nothing changes accounts. Holding the
+// lock keeps a change in the next epoch from replacing the snapshot meanwhile; lock-free
+// changes only happen once the snapshot is kept, see touch_account.
+static int64_t balance_at_epoch(struct Account *account, uint64_t epoch, uint64_t *changed) {
+    int64_t balance;
+
+    lock_account(account);
+    uint64_t latest = atomic_load_explicit(&account->epoch, memory_order_relaxed);
+    if (latest > epoch) {
+        balance = account->snapshot_balance;
+        *changed = account->previous_epoch;
+    }
+    else {
+        balance = atomic_load(&account->balance);
+        *changed = latest;
+    }
+    unlock_account(account);
+
+    return balance;
+}
+
+
+// Balance of an account at the end of epoch, without the lock balance_at_epoch takes. A
+// change in a later epoch keeps the balance first and publishes that with the account's
+// epoch before it changes the balance, see preserve_snapshot, so if the epoch is still the
+// same after reading the balance, no such change came in between.
+static inline int64_t stable_balance(struct Account *account, uint64_t epoch) {
+    uint64_t latest = atomic_load_explicit(&account->epoch, memory_order_acquire);
+    if (latest <= epoch) {
+        int64_t balance = atomic_load_explicit(&account->balance, memory_order_acquire);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&account->epoch, memory_order_acquire) == latest) {
+            return balance;
+        }
+    }
+    return account->snapshot_balance;
+}
+
+
+// Sum of the balances of all accounts in the store as they were at the end of epoch into
+// *total, and in *count how many accounts there were. The epoch must be stable, and no later
+// one may start until this returns. Takes no lock and holds up no change, so it goes through
+// the packed segments at memory speed. Returns 0 if the sum doesn't fit in an int64_t.
+int sum_balances_at_epoch(const struct Account_store *store, uint64_t epoch, int64_t *total, int *count) {
+    int64_t sum = 0;
+    int fits = 1;
+    int slots = account_count(store);
+    int first = 0;
+
+    for (int k = 0; first < slots; k++) {
+        struct Account *segment = atomic_load_explicit(&store->segments[k], memory_order_acquire);
+        int size = STORE_FIRST_SEGMENT << k;
+        int end = slots - first < size ? slots - first : size;
+        for (int i = 0; i < end; i++) {
+            int64_t balance = stable_balance(&segment[i], epoch);
+            fits &= balance >= 0 ? sum <= INT64_MAX - balance : sum >= INT64_MIN - balance;
+            sum += fits ? balance : 0;
+        }
+        first += size;
+    }
+    *total = sum;
+    *count = slots;
+    return fits;
+}
+
+
+// Make a rename or unlink in the directory of path durable.
+void sync_parent_dir(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+    else {
+        strcpy(dir, ".");
+    }
+
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+
+// Read an amount of money written with at most two decimals, like "12", "-0.5" or "100.25",
+// into minor units. Returns 0 if the text isn't such an amount or is bigger than MAX_AMOUNT.
+int parse_amount(const char *text, int64_t *amount) {
+    int negative = *text == '-';
+    if (negative) {
+        text++;
+    }
+
+    int64_t units = 0;
+    int digits = 0;
+    for (; *text >= '0' && *text <= '9'; text++, digits++) {
+        units = units * 10 + (*text - '0');
+        if (units > MAX_AMOUNT / MINOR_UNITS) {
+            return 0;
+        }
+    }
+
+    int64_t minor = 0;
+    if (*text == '.') {
+        text++;
+        for (int scale = MINOR_UNITS / 10; *text >= '0' && *text <= '9'; text++, digits++, scale /= 10) {
+            if (scale == 0) {
+                return 0;   // More decimals than there are minor units
+            }
+            minor += (*text - '0') * scale;
+        }
+    }
+    if (*text != '\0' || digits == 0) {
+        return 0;
+    }
+
+    *amount = units * MINOR_UNITS + minor;
+    if (negative) {
+        *amount = -*amount;
+    }
+    return 1;
+}
+
+
+// Write an amount in minor units as text with two decimals. buffer must hold AMOUNT_TEXT
+// characters; it is returned so the call can go straight into a printf argument list.
+const char *format_amount(int64_t amount, char *buffer) {
+    uint64_t magnitude = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+    snprintf(buffer, AMOUNT_TEXT, "%s%" PRIu64 ".%02" PRIu64, amount < 0 ? "-" : "",
+                magnitude / MINOR_UNITS, magnitude % MINOR_UNITS);
+    return buffer;
+}
+
+
+// Split a line of a configuration file, "key = value", in place. Whitespace around the key
+// and the value is dropped, and lines that are empty or start with '#' hold no setting.
+// Returns 1 with *key and *value pointing into line, 0 for a line without a setting and
+// -1 for a line that isn't of that form.
+int parse_config_line(char *line, char **key, char **value) {
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+    if (*line == '\0' || *line == '#') {
+        return 0;
+    }
+
+    char *equals = strchr(line, '=');
+    if (!equals || equals == line) {
+        return -1;
+    }
+    char *end = equals;
+    while (end > line && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (end == line) {
+        return -1;
+    }
+    *end = '\0';
+
+    char *start = equals + 1;
+    while (isspace((unsigned char)*start)) {
+        start++;
+    }
+    end = start + strlen(start);
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+
+    *key = line;
+    *value = start;
+    return 1;
+}
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+
+// CRC-32 (the one zlib and gzip use) of data, continuing from the CRC of the data before it.
+// Start with crc 0.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    pthread_once(&crc_table_once, init_crc_table);
+
+    crc ^= 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+
+// Get a database file written under a temporary name to disk and rename it over the
+// database, so a crash while saving leaves the previous snapshot intact. Closes the file.
+static int replace_database(FILE *file, const char *temp_path, const char *database) {
+    if (fflush(file) != 0 || fsync(fileno(file)) == -1) {
+        fprintf(stderr, "Failed to write database file: %s\n", temp_path);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+
+    if (rename(temp_path, database) == -1) {
+        fprintf(stderr, "Failed to replace database file: %s\n", database);
+        return 0;
+    }
+    sync_parent_dir(database);
+    return 1;
+}
+
+
+// Save accounts from memory to the binary database file, see struct Database_header.
+// Balances are saved as they were at the end of epoch. With since_epoch 0 every account is
+// saved; otherwise only the accounts changed after since_epoch, which makes an incremental
+// checkpoint on top of the previous one. snapshot_lsn is the last journal record included,
+// journal_epoch the epoch of the journal records it ends with, and deposits the money
+// deposited up to the end of epoch, see stable_deposits. journal_epoch is epoch, except on a
+// replica, whose epochs don't match the ones in the journal it copies from its primary.
+// The file is written under a temporary name and renamed over the database once it is on disk.
+int save_accounts(struct Account_store *store, const char *database, uint64_t snapshot_lsn,
+                    uint64_t epoch, uint64_t journal_epoch, int64_t deposits, uint64_t since_epoch) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", database);
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open database file to save accounts: %s\n", temp_path);
+        return 0;
+    }
+
+    // The header is written again at the end, when the count and checksum are known
+    struct Database_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATABASE_MAGIC, sizeof(header.magic));
+    header.version = DATABASE_VERSION;
+    header.record_size = sizeof(struct Database_record);
+    header.snapshot_lsn = snapshot_lsn;
+    header.epoch = journal_epoch;
+    header.deposits = deposits;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Failed to write database header: %s\n", temp_path);
+        fclose(file);
+        return 0;
+    }
+
+    int slots = account_count(store);
+    uint64_t changed;
+    for (int i = 0; i < slots; i++) {
+        struct Account *account = account_at(store, i);
+        struct Database_record record;
+        memset(&record, 0, sizeof(record));
+        record.balance = balance_at_epoch(account, epoch, &changed);
+        if (changed <= since_epoch && since_epoch != 0) {
+            continue;
+        }
+        record.id = account_id(store, i);
+
+        if (fwrite(&record, sizeof(record), 1, file) != 1) {
+            fprintf(stderr, "Failed to write account %d\n", i);
+            fclose(file);
+            return 0;
+        }
+        header.records_checksum = crc32_update(header.records_checksum, &record, sizeof(record));
+        header.count++;
+    }
+
+    header.header_checksum = crc32_update(0, &header, offsetof(struct Database_header, header_checksum));
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Failed to write database header: %s\n", temp_path);
+        fclose(file);
+        return 0;
+    }
+    return replace_database(file, temp_path, database);
+}
+
+
+// Map a binary file with a struct Database_header, the given magic and version, and records
+// of record_size bytes, and check its checksums. On success header points to the start of
+// the mapping and records right after it; unmap size bytes from header.
+static int map_records(const char *path, const char *magic, uint32_t version, size_t record_size,
+                        const struct Database_header **header, const void **records, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open database file: %s\n", path);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct Database_header)) {
+        fprintf(stderr, "Database file is too short: %s\n", path);
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map database file: %s\n", path);
+        return 0;
+    }
+    *header = map;
+    *records = (const char *)map + sizeof(struct Database_header);
+    *size = st.st_size;
+
+    const struct Database_header *h = *header;
+    if (memcmp(h->magic, magic, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "Not a binary %s file: %s\n", memcmp(magic, HISTORY_MAGIC, 8) == 0 ? "history" : "account database", path);
+    }
+    else if (h->header_checksum != crc32_update(0, h, offsetof(struct Database_header, header_checksum)) ||
+             h->version != version || h->record_size != record_size ||
+             h->count != (st.st_size - sizeof(struct Database_header)) / record_size ||
+             (st.st_size - sizeof(struct Database_header)) % record_size != 0) {
+        fprintf(stderr, "Database file has an unknown format or a damaged header: %s\n", path);
+    }
+    else if (h->records_checksum != crc32_update(0, *records, h->count * record_size)) {
+        fprintf(stderr, "Database file is damaged: %s\n", path);
+    }
+    else {
+        return 1;
+    }
+    munmap(map, st.st_size);
+    return 0;
+}
+
+
+// Map a binary account database file, see map_records.
+static int map_database(const char *path, const struct Database_header **header,
+                        const struct Database_record **records, size_t *size) {
+    const void *start;
+    if (!map_records(path, DATABASE_MAGIC, DATABASE_VERSION, sizeof(struct Database_record), header, &start, size)) {
+        return 0;
+    }
+    *records = start;
+    return 1;
+}
+
+
+// Load accounts from the binary database file to server memory. The file is mapped and
+// its records copied to the store as they are, with nothing to parse.
+// The store is initialized here, with capacity for every account in the file. An empty file
+// is a database without accounts. snapshot_lsn is set to the last journal record already
+// included in the file, epoch to the epoch it was taken at and deposits to the money
+// deposited until then.
+int load_accounts(struct Account_store *store, const char *database, uint64_t *snapshot_lsn, uint64_t *epoch,
+                    int64_t *deposits) {
+    const struct Database_header *header;
+    const struct Database_record *records;
+    size_t size;
+    struct stat st;
+
+    *snapshot_lsn = 0;
+    *epoch = 0;
+    *deposits = 0;
+    if (stat(database, &st) == 0 && st.st_size == 0) {
+        return init_account_store(store, 0) ? 0 : -1;
+    }
+
+    if (!map_database(database, &header, &records, &size)) {
+        return -1;
+    }
+    if (header->count > INT32_MAX || !init_account_store(store, header->count)) {
+        munmap((void *)header, size);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (index_lookup(&store->index, records[i].id) != -1) {
+            fprintf(stderr, "Duplicate account %d in database\n", records[i].id);
+        }
+        else if (append_account(store, records[i].id, records[i].balance) == -1) {
+            destroy_account_store(store);
+            munmap((void *)header, size);
+            return -1;
+        }
+    }
+
+    *snapshot_lsn = header->snapshot_lsn;
+    *epoch = header->epoch;
+    *deposits = header->deposits;
+    munmap((void *)header, size);
+    return account_count(store);
+}
+
+
+// Save the statements of every account to a binary history file, see struct Statement_entry,
+// while changes keep being recorded. Only changes up to snapshot_lsn are saved; the journal
+// after it has the rest. Written atomically like save_accounts.
+int save_history(const struct Account_store *store, const char *path, uint64_t snapshot_lsn) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open history file: %s\n", temp_path);
+        return 0;
+    }
+
+    struct Database_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.record_size = sizeof(struct Statement_entry);
+    header.snapshot_lsn = snapshot_lsn;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Failed to write history header: %s\n", temp_path);
+        fclose(file);
+        return 0;
+    }
+
+    struct Statement_entry entries[HISTORY_ENTRIES];
+    int slots = account_count(store);
+    for (int i = 0; i < slots; i++) {
+        if (!history_at(store, i, 0)) {
+            continue;
+        }
+        int count = read_history(store, account_id(store, i), entries, HISTORY_ENTRIES);
+        for (int j = count - 1; j >= 0; j--) {
+            if (entries[j].lsn > snapshot_lsn) {
+                continue;
+            }
+            if (fwrite(&entries[j], sizeof(entries[j]), 1, file) != 1) {
+                fprintf(stderr, "Failed to write history of account %d\n", entries[j].account_id);
+                fclose(file);
+                return 0;
+            }
+            header.records_checksum = crc32_update(header.records_checksum, &entries[j], sizeof(entries[j]));
+            header.count++;
+        }
+    }
+
+    header.header_checksum = crc32_update(0, &header, offsetof(struct Database_header, header_checksum));
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Failed to write history header: %s\n", temp_path);
+        fclose(file);
+        return 0;
+    }
+    return replace_database(file, temp_path, path);
+}
+
+
+// Record the changes of a history file again, to accounts already in the store. snapshot_lsn
+// is set to the last journal record the file covers, or 0 if there is no file.
+// Returns the amount of changes loaded, or -1 if the file can't be read.
+int load_history(const struct Account_store *store, const char *path, uint64_t *snapshot_lsn) {
+    const struct Database_header *header;
+    const void *start;
+    size_t size;
+
+    *snapshot_lsn = 0;
+    if (access(path, F_OK) == -1) {
+        return 0;
+    }
+    if (!map_records(path, HISTORY_MAGIC, HISTORY_VERSION, sizeof(struct Statement_entry), &header, &start, &size)) {
+        return -1;
+    }
+
+    const struct Statement_entry *entries = start;
+    int loaded = 0;
+    for (uint64_t i = 0; i < header->count; i++) {
+        loaded += record_history(store, entries[i].account_id, entries[i].kind, entries[i].amount,
+                                    entries[i].other_id, entries[i].lsn);
+    }
+    *snapshot_lsn = header->snapshot_lsn;
+    munmap((void *)header, size);
+    return loaded;
+}
+
+
+// Save accounts from memory to a text database file, the format used before the binary one.
+// First row has account count, snapshot LSN, epoch and deposits, other rows the id and
+// balance of each account. Written atomically like save_accounts.
+int save_accounts_text(struct Account_store *store, const char *database, uint64_t snapshot_lsn, uint64_t epoch,
+                        int64_t deposits) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", database);
+
+    FILE *file = fopen(temp_path, "w");
     if (!file) {
-        fprintf(stderr, "Failed to open database file to save accounts: %s\n", database);
+        fprintf(stderr, "Failed to open database file to save accounts: %s\n", temp_path);
         return 0;
     }
 
-    // Write account count to the first line of database file
-    fprintf(file, "%d\n", acc_count);
+    int acc_count = account_count(store);
+    fprintf(file, "%d %" PRIu64 " %" PRIu64 " %" PRId64 "\n", acc_count, snapshot_lsn, epoch, deposits);
 
     // Write account data to one row per customer
-    // Format : <account id>, <balance> 
+    // Format : <account id>, <balance>
     for (int i = 0; i < acc_count; i++) {
-        if (fprintf(file, "%d %.2f\n", accounts[i].id, accounts[i].balance) < 0) {
+        struct Account *account = account_at(store, i);
+        char balance[AMOUNT_TEXT];
+        if (fprintf(file, "%d %s\n", account_id(store, i), format_amount(atomic_load(&account->balance), balance)) < 0) {
             fprintf(stderr, "Failed to write account %d\n", i);
             fclose(file);
-            return 0;
+            return 0;
+        }
+    }
+    return replace_database(file, temp_path, database);
+}
+
+
+// Load accounts from a text database file to memory, see save_accounts_text.
+// The store is initialized here, with capacity for the account count in the file header.
+// Snapshot LSN and epoch are 0 for files saved before the journal and checkpoints existed,
+// and deposits for files saved before they were counted.
+int load_accounts_text(struct Account_store *store, const char *database, uint64_t *snapshot_lsn, uint64_t *epoch,
+                        int64_t *deposits) {
+    FILE *file = fopen(database, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open database file: %s\n", database);
+        return -1;
+    }
+
+    int acc_count = 0;  // Read account count from the first line
+    char header[96];
+    *snapshot_lsn = 0;
+    *epoch = 0;
+    *deposits = 0;
+
+    // Read account count, snapshot LSN, epoch and deposits from first row. Missing ones will be 0.
+    if (fgets(header, sizeof(header), file) != NULL) {
+        sscanf(header, "%d %" SCNu64 " %" SCNu64 " %" SCNd64, &acc_count, snapshot_lsn, epoch, deposits);
+    }
+
+    if ( acc_count < 0) {
+        fprintf(stderr, "Failed to load account count");
+        fclose(file);
+        return -1;
+    }
+
+    if (!init_account_store(store, acc_count)) {
+        fclose(file);
+        return -1;
+    }
+
+    // Read each row with account data to load the account to the account store.
+    for (int i = 0; i < acc_count; i++) {
+        int id;
+        char balance_text[AMOUNT_TEXT];
+        int64_t balance;
+        if (fscanf(file, "%d %31s\n", &id, balance_text) != 2 || !parse_amount(balance_text, &balance)) {
+            fprintf(stderr, "Failed to read account %d\n", i);
+            destroy_account_store(store);
+            fclose(file);
+            return -1;
+        }
+
+        if (index_lookup(&store->index, id) != -1) {
+            fprintf(stderr, "Duplicate account %d in database\n", id);
+        }
+        else if (append_account(store, id, balance) == -1) {
+            destroy_account_store(store);
+            fclose(file);
+            return -1;
         }
-        printf("Saved Account %d: ID = %d, Balance = %.2f\n", i + 1, accounts[i].id, accounts[i].balance);
     }
-
     fclose(file);
-    return 1;
+    return account_count(store);
 }
 
 
-// Load accounts from the database text file to server memory.
-int load_accounts(struct Account **accounts, const char *database) {
-    FILE *file = fopen(database, "r");
-    if (!file) {
-        fprintf(stderr, "Failed to open database file: %s\n", database);
+// Numbers of the files named <prefix>.<number in hex>, in ascending order. Used for
+// checkpoints, numbered by epoch, and journal segments, numbered by their first LSN.
+// Returns the amount found, or -1 if the directory can't be read.
+int list_numbered_files(const char *prefix, uint64_t **numbers) {
+    char dir[4096];
+    const char *base = strrchr(prefix, '/');
+    if (base) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - prefix), prefix);
+        base++;
+    }
+    else {
+        strcpy(dir, ".");
+        base = prefix;
+    }
+
+    DIR *directory = opendir(dir);
+    if (!directory) {
         return -1;
     }
 
-    int acc_count = 0;  // Read account count from the first line
+    int count = 0;
+    int capacity = 0;
+    *numbers = NULL;
+    struct dirent *entry;
+    size_t base_len = strlen(base);
 
-    // Read account count from first row. If file is empty, will be 0.
-    int read_count = fscanf(file, "%d\n", &acc_count);
-    if (read_count == 0){
-        printf("Database file initially empty.");
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, base, base_len) != 0 || entry->d_name[base_len] != '.') {
+            continue;
+        }
+        // Temporary files of an unfinished write don't parse as a plain number
+        char *end;
+        uint64_t number = strtoull(entry->d_name + base_len + 1, &end, 16);
+        if (*end != '\0' || end == entry->d_name + base_len + 1) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *grown = realloc(*numbers, capacity * sizeof(uint64_t));
+            if (!grown) {
+                free(*numbers);
+                closedir(directory);
+                return -1;
+            }
+            *numbers = grown;
+        }
+        (*numbers)[count++] = number;
     }
+    closedir(directory);
 
-    if ( acc_count < 0) {
-        fprintf(stderr, "Failed to load account count");
-        fclose(file);
-        *accounts = NULL;
-        return -1;
+    // Insertion sort, there are only a handful of files
+    for (int i = 1; i < count; i++) {
+        uint64_t number = (*numbers)[i];
+        int j = i - 1;
+        while (j >= 0 && (*numbers)[j] > number) {
+            (*numbers)[j + 1] = (*numbers)[j];
+            j--;
+        }
+        (*numbers)[j + 1] = number;
     }
+    return count;
+}
 
-    *accounts = (struct Account *)malloc(acc_count * sizeof(struct Account));
-    if (!*accounts) {
-        fprintf(stderr, "Failed to allocate memory for accounts\n");
-        fclose(file);
+
+// Apply the incremental checkpoints taken after the loaded snapshot, oldest first.
+// Each one holds the accounts changed since the one before, so afterwards the accounts are
+// as they were at the end of the newest checkpoint's epoch. snapshot_lsn, epoch and deposits
+// are moved forward to that checkpoint. Returns the amount of checkpoints applied, or -1.
+int load_checkpoints(struct Account_store *store, const char *prefix, uint64_t *snapshot_lsn, uint64_t *epoch,
+                        int64_t *deposits) {
+    uint64_t *epochs;
+    int count = list_numbered_files(prefix, &epochs);
+    if (count == -1) {
+        fprintf(stderr, "Failed to list checkpoints: %s\n", prefix);
         return -1;
     }
 
-    // Read each row with account data to load the account to the accounts array.
-    for (int i = 0; i < acc_count; i++) {
-        if (fscanf(file, "%d %lf\n", &(*accounts)[i].id, &(*accounts)[i].balance) != 2) {
-            fprintf(stderr, "Failed to read account %d\n", i);
-            free(*accounts);
-            fclose(file);
-            return 0;
+    int applied = 0;
+    for (int c = 0; c < count; c++) {
+        if (epochs[c] <= *epoch) {
+            continue;
+        }
+
+        char path[4096];
+        const struct Database_header *header;
+        const struct Database_record *records;
+        size_t size;
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, prefix, epochs[c]);
+        if (!map_database(path, &header, &records, &size)) {
+            free(epochs);
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < header->count; i++) {
+            int slot = index_lookup(&store->index, records[i].id);
+            if (slot != -1) {
+                atomic_store(&account_at(store, slot)->balance, records[i].balance);
+            }
+            else if (append_account(store, records[i].id, records[i].balance) == -1) {
+                munmap((void *)header, size);
+                free(epochs);
+                return -1;
+            }
         }
-        printf("Loaded Account %d: ID = %d, Balance = %.2f\n", i + 1, (*accounts)[i].id, (*accounts)[i].balance);
-        // Initialize rw locks for each account
-        pthread_rwlock_init(&(*accounts)[i].lock, NULL);
+        uint64_t checkpoint_lsn = header->snapshot_lsn;
+        uint64_t checkpoint_epoch = header->epoch;
+        int64_t checkpoint_deposits = header->deposits;
+        munmap((void *)header, size);
+
+        *snapshot_lsn = checkpoint_lsn;
+        *epoch = checkpoint_epoch;
+        *deposits = checkpoint_deposits;
+        applied++;
     }
-    fclose(file);
-    return acc_count;
+
+    free(epochs);
+    return applied;
+}
+
+
+// Delete the incremental checkpoints up to given epoch, once a full snapshot covers them.
+int remove_checkpoints(const char *prefix, uint64_t up_to_epoch) {
+    uint64_t *epochs;
+    int count = list_numbered_files(prefix, &epochs);
+    if (count == -1) {
+        return 0;
+    }
+
+    for (int c = 0; c < count && epochs[c] <= up_to_epoch; c++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, prefix, epochs[c]);
+        unlink(path);
+    }
+    free(epochs);
+    sync_parent_dir(prefix);
+    return 1;
 }
 
 
@@ -93,132 +1335,287 @@ int load_accounts(struct Account **accounts, const char *database) {
 // way that accounts need to be created by for example depositing first, but this way seemed handier,
 // since the bank still functions correctly with empty accounts.
 
-int create_new_account(struct Account **accounts, int *acc_count, int account_id, pthread_rwlock_t *accounts_lock) {
+int create_new_account(struct Account_store *store, int account_id, pthread_rwlock_t *accounts_lock) {
+    // Most requests concern existing accounts, those are found from the index without locking.
+    if (index_lookup(&store->index, account_id) != -1) {
+        return 1;
+    }
+
     // Lock the whole accounts list to make sure two accounts aren't created on top of each other in parallel
     pthread_rwlock_wrlock(accounts_lock);
 
-    // Check if the account already exists
-    for (int i = 0; i < *acc_count; i++) {
-        if ((*accounts)[i].id == account_id) {
-            pthread_rwlock_unlock(accounts_lock);
-            return 1;
-        }
+    // Check again, another desk may have created the account while waiting for the lock
+    if (index_lookup(&store->index, account_id) != -1) {
+        pthread_rwlock_unlock(accounts_lock);
+        return 1;
     }
 
-    // If the account doesn't exist, create a new account
-    *accounts = realloc(*accounts, (*acc_count + 1) * sizeof(struct Account));
-    if (*accounts == NULL) {
+    // If the account doesn't exist, create a new account. Existing accounts stay where they are.
+    if (append_account(store, account_id, 0) == -1) {
         fprintf(stderr, "Memory allocation for new account failed\n");
         pthread_rwlock_unlock(accounts_lock);
         return 0;
     }
-    // Initialize the new account struct
-    (*accounts)[*acc_count].id = account_id;
-    (*accounts)[*acc_count].balance = 0.0;
-    pthread_rwlock_init(&(*accounts)[*acc_count].lock, NULL);
-
-    // Update the account count
-    (*acc_count)++;
 
-    // Unlock the accounts list after reallocating and adding the new account
     pthread_rwlock_unlock(accounts_lock);
     return 1;
 }
 
 
 // Get an account given its ID
-struct Account* get_account_by_id(struct Account* accounts, int acc_count, int id) {
-    for (int i = 0; i < acc_count; i++) {
-        if (accounts[i].id == id) {
-            return &accounts[i];
-        }
+struct Account* get_account_by_id(const struct Account_store *store, int id) {
+    int slot = index_lookup(&store->index, id);
+    if (slot == -1) {
+        return NULL;
     }
-    return NULL;
+    return account_at(store, slot);
 }
 
 
-// Write operations to log file
-int write_log(FILE *log_file, char operation, int account_id, int dest_id, double amount, pthread_rwlock_t *log_lock) {
-    if (log_file == NULL) {
-        fprintf(stderr, "Log file isn't open\n");
-        return 0;
+// Get balance of given account
+int64_t get_balance(struct Account *account) {
+    return atomic_load(&account->balance);
+}
+
+
+// Before the first lock-free change to an account in this thread's epoch, keep its balance
+// for the checkpointer under the account lock. Later changes in the same epoch see the epoch
+// already set and skip the lock.
+static void touch_account(struct Account *account) {
+    if (thread_epoch != 0 && atomic_load_explicit(&account->epoch, memory_order_acquire) != thread_epoch) {
+        lock_account(account);
+        preserve_snapshot(account);
+        unlock_account(account);
     }
+}
 
-    pthread_rwlock_wrlock(log_lock);
 
-    if (dest_id == -1) {
-        if (fprintf(log_file, "%c: Account %d, Amount %.2f\n", operation, account_id, amount) < 0) {
-            fprintf(stderr, "Failed to write to log file");
-            pthread_rwlock_unlock(log_lock);
-            return 0;
+// Every change to a balance happens between begin_change and end_change, which count it in
+// the account's changes: one added to the low half when it begins, and moved to the high half
+// when it ends. Changes don't wait for each other or for readers; read_balances uses the
+// count to tell whether a balance changed while it was reading. A change to several accounts
+// begins on all of them before it touches any, so it is never seen half done.
+// A change that finds another one under way counts as contention on the account, which
+// costs nothing while changes don't overlap.
+static void begin_change(struct Account *account) {
+    if ((uint32_t)atomic_fetch_add(&account->changes, 1) != 0) {
+        int threshold = atomic_load_explicit(&hot_contention, memory_order_relaxed);
+        if (threshold > 0 && atomic_fetch_add_explicit(&account->contention, 1, memory_order_relaxed) + 1 >= threshold) {
+            make_hot(account);
         }
     }
-    else {
-        if (fprintf(log_file, "%c: Account %d, Destination %d, Amount %.2f\n", operation, account_id, dest_id, amount) < 0) {
-            fprintf(stderr, "Failed to write to log file");
-            pthread_rwlock_unlock(log_lock);
+}
+
+
+static void end_change(struct Account *account) {
+    atomic_fetch_add(&account->changes, (UINT64_C(1) << 32) - 1);
+}
+
+
+// Take amount from the balance unless that would make it negative.
+static int take_funds(struct Account *account, int64_t amount) {
+    int64_t balance = atomic_load_explicit(&account->balance, memory_order_relaxed);
+    do {
+        if (balance < amount) {
             return 0;
         }
-    }
-    pthread_rwlock_unlock(log_lock);
+    } while (!atomic_compare_exchange_weak(&account->balance, &balance, balance - amount));
     return 1;
 }
 
 
-// Get balance of given account
-double get_balance(struct Account *account) {
-    double balance;
+// Add amount to the balance unless that would take it over MAX_BALANCE.
+static int add_funds(struct Account *account, int64_t amount) {
+    int64_t balance = atomic_load_explicit(&account->balance, memory_order_relaxed);
+    do {
+        if (balance > MAX_BALANCE - amount) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&account->balance, &balance, balance + amount));
+    return 1;
+}
 
-    // Get write lock for given account, only then get the balance
-    pthread_rwlock_rdlock(&account->lock);
-    balance = account->balance;
-    pthread_rwlock_unlock(&account->lock);
 
-    return balance;
+// Whether a credit of amount fits under MAX_BALANCE, for changes made with the account
+// locked. A deposit may still come in before the credit is added, so a balance can go over
+// MAX_BALANCE by one credit, which is still far from overflowing.
+static int has_room(struct Account *account, int64_t amount) {
+    return atomic_load_explicit(&account->balance, memory_order_relaxed) <= MAX_BALANCE - amount;
 }
 
 
-// Deposit amount to given account
-int deposit(struct Account *account, double amount) {
-    if (amount <= 0) {
-        fprintf(stderr, "Deposit amount should be positive\n");
-        return 0;
+// Make account hot after hot_contention overlapping changes; 0 never makes one hot.
+// Only accounts that get hot from now on are affected.
+void set_hot_contention(int threshold) {
+    atomic_store(&hot_contention, threshold);
+}
+
+
+// Give account a combiner, so its deposits and withdrawals are combined from now on.
+// Returns 1 if the account is hot, 0 if every combiner is taken.
+int make_hot(struct Account *account) {
+    if (atomic_load(&account->hot) != 0) {
+        return 1;
+    }
+    for (int i = 0; i < HOT_MAX_ACCOUNTS; i++) {
+        struct Account *free_combiner = NULL;
+        if (atomic_load(&combiners[i].account) == NULL &&
+            atomic_compare_exchange_strong(&combiners[i].account, &free_combiner, account)) {
+            unsigned short cold = 0;
+            if (!atomic_compare_exchange_strong(&account->hot, &cold, i + 1)) {
+                atomic_store(&combiners[i].account, NULL);      // Another thread was first
+                return 1;
+            }
+            atomic_fetch_add(&hot_accounts, 1);
+            return 1;
+        }
     }
-    // Get the lock for the account, only then increase the balance.
-    pthread_rwlock_wrlock(&account->lock);
-    account->balance += amount;
-    pthread_rwlock_unlock(&account->lock);
+    return 0;
+}
 
-    return 1;
+
+// Number of accounts that are hot now
+int hot_account_count(void) {
+    return atomic_load(&hot_accounts);
+}
+
+
+// Answer every request to change account that waits in this thread's epoch, starting from
+// one balance and replacing it once, so the account's cache line moves once for all of them.
+// Requests of another epoch are left for their own threads, which combine in that epoch.
+// Called with the combiner lock held.
+static void combine_pass(struct Account *account, struct Combiner *combiner) {
+    struct Combine_request *picked[MAX_EPOCH_THREADS];
+    int results[MAX_EPOCH_THREADS];
+    int count = 0;
+
+    int threads = atomic_load(&epoch_slot_count);
+    for (int i = 0; i < threads && i < MAX_EPOCH_THREADS; i++) {
+        struct Combine_request *request = &combine_requests[i];
+        if (atomic_load_explicit(&request->state, memory_order_acquire) == COMBINE_PENDING &&
+            request->account == account && request->epoch == thread_epoch) {
+            picked[count++] = request;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    // Transfers and batches still change the balance directly, so replace it with a CAS,
+    // and work out the results again if one of them got in between
+    touch_account(account);
+    begin_change(account);
+    int64_t balance = atomic_load_explicit(&account->balance, memory_order_relaxed);
+    int64_t next;
+    do {
+        next = balance;
+        for (int i = 0; i < count; i++) {
+            int64_t amount = picked[i]->amount;
+            results[i] = amount > 0 ? next <= MAX_BALANCE - amount : next >= -amount;
+            if (results[i]) {
+                next += amount;
+            }
+        }
+    } while (!atomic_compare_exchange_weak(&account->balance, &balance, next));
+    end_change(account);
+
+    for (int i = 0; i < count; i++) {
+        picked[i]->result = results[i];
+        atomic_store_explicit(&picked[i]->state, COMBINE_DONE, memory_order_release);
+    }
+
+    // An account that only its combiner changes is not hot anymore. Late requests of an
+    // account that cooled down already leave the combiner's next account alone.
+    if (atomic_load(&combiner->account) != account) {
+        return;
+    }
+    combiner->quiet_passes = count == 1 ? combiner->quiet_passes + 1 : 0;
+    if (combiner->quiet_passes >= HOT_COOL_PASSES) {
+        combiner->quiet_passes = 0;
+        atomic_store(&account->contention, 0);
+        atomic_store(&account->hot, 0);
+        atomic_store(&combiner->account, NULL);
+        atomic_fetch_sub(&hot_accounts, 1);
+    }
+}
+
+
+// Change a hot account by flat combining: publish the change in this thread's request, and
+// either find it answered by the thread holding the combiner lock, or take the lock and
+// answer every waiting request at once. Waiters never hold a lock another thread needs,
+// so a preempted combiner only delays them. Returns the change's result.
+static int combine(struct Account *account, int hot, int64_t amount) {
+    struct Combiner *combiner = &combiners[hot - 1];
+    struct Combine_request *request = &combine_requests[thread_number()];
+    request->account = account;
+    request->epoch = thread_epoch;
+    request->amount = amount;
+    atomic_store_explicit(&request->state, COMBINE_PENDING, memory_order_release);
+
+    for (int spins = 0; atomic_load_explicit(&request->state, memory_order_acquire) == COMBINE_PENDING; spins++) {
+        if (!atomic_load_explicit(&combiner->lock, memory_order_relaxed) &&
+            !atomic_exchange_explicit(&combiner->lock, 1, memory_order_acquire)) {
+            combine_pass(account, combiner);
+            atomic_store_explicit(&combiner->lock, 0, memory_order_release);
+        }
+        else if (spins >= 64) {
+            sched_yield();
+        }
+    }
+    atomic_store_explicit(&request->state, COMBINE_EMPTY, memory_order_relaxed);
+    return request->result;
 }
 
 
-// Withdraw amount from given account
-int withdraw(struct Account *account, double amount) {
+// Deposit amount (in minor units) to given account, or through its combiner while the
+// account is hot, and count it in the deposit total, see stable_deposits. Returns 0 if the
+// balance would go over MAX_BALANCE.
+int deposit(struct Account *account, int64_t amount) {
     if (amount <= 0) {
-        fprintf(stderr, "Withdraw amount should be positive\n");
+        fprintf(stderr, "Deposit amount should be positive\n");
         return 0;
     }
+    int hot = atomic_load_explicit(&account->hot, memory_order_relaxed);
+    int added;
+    if (hot != 0) {
+        added = combine(account, hot, amount);
+    }
+    else {
+        touch_account(account);
+        begin_change(account);
+        added = add_funds(account, amount);
+        end_change(account);
+    }
+    if (added) {
+        count_deposit(amount);
+    }
+    return added;
+}
 
-    // Get the lock for the account, or block until you get it
-    pthread_rwlock_wrlock(&account->lock);
 
-    // Check the account balance AFTER getting the lock
-    if (amount > account->balance) {
-        //fprintf(stderr, "Account has insufficient funds\n");
-        pthread_rwlock_unlock(&account->lock);
+// Withdraw amount (in minor units) from given account. Retries until the balance it checked
+// is still the balance it replaces, so concurrent withdrawals can't overdraw the account.
+int withdraw(struct Account *account, int64_t amount) {
+    if (amount <= 0) {
+        fprintf(stderr, "Withdraw amount should be positive\n");
         return 0;
     }
-    // Decrease the amount and unlock the write lock
-    account->balance -= amount;
-    pthread_rwlock_unlock(&account->lock);
+    int hot = atomic_load_explicit(&account->hot, memory_order_relaxed);
+    if (hot != 0) {
+        return combine(account, hot, -amount);
+    }
+    touch_account(account);
+    begin_change(account);
+    int taken = take_funds(account, amount);
+    end_change(account);
 
-    return 1;
+    return taken;
 }
 
 
-// Transfer money between source and destination account
-int transfer(struct Account *accounts, int acc_count, int source_id, int dest_id, double amount) {
+// Transfer money between source and destination account. Returns 1, 0 if the source can't
+// cover it or an account is missing, or -1 if the destination would go over MAX_BALANCE.
+int transfer(const struct Account_store *store, int source_id, int dest_id, int64_t amount) {
 
     // If source same as destination, let server take action and just return with 1 early
     // This case should never be reached due to server code handling it.
@@ -227,8 +1624,8 @@ int transfer(struct Account *accounts, int acc_count, int source_id, int dest_id
     }
 
     // Find the source and destination accounts
-    struct Account *source_account = get_account_by_id(accounts, acc_count, source_id);
-    struct Account *dest_account = get_account_by_id(accounts, acc_count, dest_id);
+    struct Account *source_account = get_account_by_id(store, source_id);
+    struct Account *dest_account = get_account_by_id(store, dest_id);
 
     if (source_account == NULL) {
         //fprintf(stderr, "Source account not found.\n");
@@ -244,31 +1641,228 @@ int transfer(struct Account *accounts, int acc_count, int source_id, int dest_id
     // accounts transfer money to both directions concurrently.
     // This way the locks are always taken in same order, preventing deadlock possibility.
     if (source_id < dest_id) {
-        pthread_rwlock_wrlock(&source_account->lock);
-        pthread_rwlock_wrlock(&dest_account->lock);
+        lock_account(source_account);
+        lock_account(dest_account);
     } else {
-        pthread_rwlock_wrlock(&dest_account->lock);
-        pthread_rwlock_wrlock(&source_account->lock);
+        lock_account(dest_account);
+        lock_account(source_account);
+    }
+
+    // Move the money, or actually just decrease it from source and add to destination.
+    // Deposits and withdrawals don't take the locks, so the source is still checked atomically.
+    preserve_snapshot(source_account);
+    preserve_snapshot(dest_account);
+    begin_change(source_account);
+    begin_change(dest_account);
+    int moved = has_room(dest_account, amount) ? take_funds(source_account, amount) : -1;
+    if (moved == 1) {
+        atomic_fetch_add(&dest_account->balance, amount);
+    }
+    end_change(source_account);
+    end_change(dest_account);
+
+    unlock_account(source_account);
+    unlock_account(dest_account);
+
+    return moved;
+}
+
+
+
+static int compare_legs(const void *a, const void *b) {
+    const struct Batch_leg *x = a;
+    const struct Batch_leg *y = b;
+    return (x->account_id > y->account_id) - (x->account_id < y->account_id);
+}
+
+
+// Read the legs "<account_id> <amount> [<account_id> <amount> ...]" of a batch or transaction.
+// Negative amounts are debits. Returns 0 unless there is at least one leg and nothing else.
+int parse_legs(const char *arguments, struct Batch_leg *legs, int *count) {
+    char amount_text[AMOUNT_TEXT];
+    int valid = 1;
+    *count = 0;
+
+    // Scanned by hand: sscanf would measure the whole rest of a long line for every leg.
+    // Anything left after the last leg, including a leg too many, makes the command invalid.
+    const char *next = arguments + strspn(arguments, " \t");
+    while (valid && *next != '\0') {
+        char *end;
+        long id = strtol(next, &end, 10);
+        size_t skip = strspn(end, " \t");
+        size_t length = strcspn(end + skip, " \t");
+        valid = *count < BATCH_MAX_LEGS && end != next && skip > 0 && id >= 0 && id <= INT32_MAX &&
+                length > 0 && length < AMOUNT_TEXT;
+        if (valid) {
+            memcpy(amount_text, end + skip, length);
+            amount_text[length] = '\0';
+            legs[*count].account_id = id;
+            valid = parse_amount(amount_text, &legs[*count].amount) && legs[*count].amount != 0;
+            (*count)++;
+            next = end + skip + length;
+            next += strspn(next, " \t");
+        }
     }
+    return valid && *count > 0;
+}
 
-    if (source_account->balance < amount) {
-        //fprintf(stderr, "Insufficient funds in source account.\n");
-        pthread_rwlock_unlock(&source_account->lock);
-        pthread_rwlock_unlock(&dest_account->lock);
+
+// Apply every leg of a batch, or none of them, see apply_batch. Credits are only checked
+// against MAX_BALANCE if check_room is set.
+static int change_batch(const struct Account_store *store, struct Batch_leg *legs, int *count, int check_room) {
+    struct Account *accounts[BATCH_MAX_LEGS];
+
+    if (*count < 1 || *count > BATCH_MAX_LEGS) {
         return 0;
     }
+    for (int i = 0; i < *count; i++) {
+        if (legs[i].amount == 0 || legs[i].amount > MAX_AMOUNT || legs[i].amount < -MAX_AMOUNT ||
+            get_account_by_id(store, legs[i].account_id) == NULL) {
+            return 0;
+        }
+    }
+    qsort(legs, *count, sizeof(struct Batch_leg), compare_legs);
 
-    // Move the money, or actually just decrease it from source and add to destination.
-    source_account->balance -= amount;
-    dest_account->balance += amount;
+    int unique = 0;
+    for (int i = 0; i < *count; i++) {
+        if (unique > 0 && legs[unique - 1].account_id == legs[i].account_id) {
+            legs[unique - 1].amount += legs[i].amount;
+            continue;
+        }
+        if (unique > 0 && legs[unique - 1].amount == 0) {
+            unique--;
+        }
+        legs[unique++] = legs[i];
+    }
+    if (unique > 0 && legs[unique - 1].amount == 0) {
+        unique--;
+    }
+    *count = unique;
 
-    pthread_rwlock_unlock(&source_account->lock);
-    pthread_rwlock_unlock(&dest_account->lock);
+    for (int i = 0; i < unique; i++) {
+        accounts[i] = get_account_by_id(store, legs[i].account_id);
+    }
 
-    return 1;
+    for (int i = 0; i < unique; i++) {
+        lock_account(accounts[i]);
+        preserve_snapshot(accounts[i]);
+    }
+    int full = 0;
+    for (int i = 0; check_room && i < unique; i++) {
+        full = full || (legs[i].amount > 0 && !has_room(accounts[i], legs[i].amount));
+    }
+    if (full) {
+        for (int i = 0; i < unique; i++) {
+            unlock_account(accounts[i]);
+        }
+        return -1;
+    }
+    for (int i = 0; i < unique; i++) {
+        begin_change(accounts[i]);
+    }
+
+    // Deposits and withdrawals don't take the locks, so debits are still taken atomically,
+    // and given back if a later one can't be covered.
+    int taken = 0;
+    while (taken < unique && (legs[taken].amount >= 0 || take_funds(accounts[taken], -legs[taken].amount))) {
+        taken++;
+    }
+    int applied = taken == unique;
+    for (int i = 0; i < taken; i++) {
+        if (applied && legs[i].amount > 0) {
+            atomic_fetch_add(&accounts[i]->balance, legs[i].amount);
+        }
+        else if (!applied && legs[i].amount < 0) {
+            atomic_fetch_add(&accounts[i]->balance, -legs[i].amount);
+        }
+    }
+
+    for (int i = 0; i < unique; i++) {
+        end_change(accounts[i]);
+        unlock_account(accounts[i]);
+    }
+    return applied;
+}
+
+
+// Apply every leg of a batch, or none of them. The legs are sorted by account and netted in
+// place first, so an account only needs its net debit, and *count is set to the legs left;
+// accounts whose legs cancel out are dropped. The accounts are locked in ascending id order,
+// the same order transfer uses, and stay locked until the whole batch is applied.
+// Returns 1 on success, 0 if an account is missing, a leg is invalid or a debit can't be
+// covered, or -1 if a credit would take a balance over MAX_BALANCE.
+int apply_batch(const struct Account_store *store, struct Batch_leg *legs, int *count) {
+    return change_batch(store, legs, count, 1);
+}
+
+
+// Apply a batch of credits already promised, like the ones a prepared transaction pays when
+// it is committed or gives back when it is aborted. They can't fail for lack of room, so they
+// may take a balance over MAX_BALANCE, by at most what the prepared transactions hold.
+// Returns like apply_batch.
+int pay_batch(const struct Account_store *store, struct Batch_leg *legs, int *count) {
+    return change_batch(store, legs, count, 0);
+}
+
+
+// Add amounts[i] to the balance of accounts[i], for changes already made and checked
+// elsewhere, like the records a replica takes from its primary. Nothing is checked and
+// no lock is taken, so only one thread may apply changes to these accounts, but like any
+// change to several accounts, read_balances sees all of them or none. Inside an epoch the
+// balances it ended with are kept, as for any other change.
+void apply_changes(struct Account *const *accounts, const int64_t *amounts, int count) {
+    for (int i = 0; i < count; i++) {
+        preserve_snapshot(accounts[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        begin_change(accounts[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        atomic_fetch_add(&accounts[i]->balance, amounts[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        end_change(accounts[i]);
+    }
 }
 
 
+// Read the balances of count accounts as they all were at one instant, without stopping
+// changes to them. Reads every change count, then every balance, then every count again; if
+// no count moved and no change was under way, no balance changed between the first and the
+// second round. Otherwise it tries again, yielding after a few tries in case a change was
+// preempted halfway. Returns 1, or 0 if changes kept coming for READ_RETRIES tries.
+int read_balances(struct Account *const *accounts, int count, int64_t *balances) {
+    uint64_t before[READ_MAX_ACCOUNTS];
+
+    if (count < 1 || count > READ_MAX_ACCOUNTS) {
+        return 0;
+    }
+    for (int attempt = 0; attempt < READ_RETRIES; attempt++) {
+        if (attempt >= 8) {
+            sched_yield();
+        }
+
+        int settled = 1;
+        for (int i = 0; settled && i < count; i++) {
+            before[i] = atomic_load(&accounts[i]->changes);
+            settled = (uint32_t)before[i] == 0;
+        }
+        if (!settled) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            balances[i] = atomic_load(&accounts[i]->balance);
+        }
+        for (int i = 0; settled && i < count; i++) {
+            settled = atomic_load(&accounts[i]->changes) == before[i];
+        }
+        if (settled) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Send responses to the client trough the  socket.
 void send_response(int client_socket, const char *response) {
     write(client_socket, response, strlen(response));
@@ -287,4 +1881,203 @@ int shortest_queue(const int *queue_lengths, int num_queues) {
         }
     }
     return shortest_index;
-}
\ No newline at end of file
+}
+
+
+void init_client_deque(struct Client_deque *deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    for (int i = 0; i < CLIENT_DEQUE_SIZE; i++) {
+        atomic_init(&deque->items[i], NULL);
+    }
+}
+
+
+// Add a client at the bottom. Only one thread may push to a deque.
+// Returns 0 if the deque is full.
+int deque_push(struct Client_deque *deque, struct Client_message *client) {
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    if (bottom - atomic_load_explicit(&deque->top, memory_order_acquire) >= CLIENT_DEQUE_SIZE) {
+        return 0;
+    }
+    atomic_store_explicit(&deque->items[bottom & (CLIENT_DEQUE_SIZE - 1)], client, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return 1;
+}
+
+
+// Take the client at the top. Returns NULL if the deque is empty, or if another thread
+// took the same client first; the caller may simply try again.
+struct Client_message *deque_take(struct Client_deque *deque) {
+    size_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    // The slot can't be reused before top moves past it, and then the exchange fails
+    struct Client_message *client = atomic_load_explicit(&deque->items[top & (CLIENT_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) {
+        return NULL;
+    }
+    return client;
+}
+
+
+// Clients waiting in the deque. Only a hint while other threads use it.
+int deque_length(struct Client_deque *deque) {
+    size_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return bottom > top ? bottom - top : 0;
+}
+
+
+// Create the shared memory segment of a client's rings under name, mapped and with both rings
+// empty. Only the server's user may open it. Returns NULL if it can't be created.
+struct Ring_segment *ring_create(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct Ring_segment)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    struct Ring_segment *segment = mmap(NULL, sizeof(struct Ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    struct Ring *rings[] = { &segment->requests, &segment->responses };
+    for (int i = 0; i < 2; i++) {
+        atomic_init(&rings[i]->head, 0);
+        atomic_init(&rings[i]->tail, 0);
+        atomic_init(&rings[i]->sleeping, 0);
+        if (sem_init(&rings[i]->wakeup, 1, 0) != 0) {
+            ring_release(segment);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+    segment->size = sizeof(struct Ring_segment);
+    segment->magic = RING_MAGIC;
+    return segment;
+}
+
+
+// Map the segment the server created under name. Returns NULL if it can't be mapped or was
+// made by a build with another layout.
+struct Ring_segment *ring_attach(const char *name) {
+    struct stat info;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size != sizeof(struct Ring_segment)) {
+        close(fd);
+        return NULL;
+    }
+    struct Ring_segment *segment = mmap(NULL, sizeof(struct Ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+    if (segment->magic != RING_MAGIC || segment->size != sizeof(struct Ring_segment)) {
+        ring_release(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+
+void ring_release(struct Ring_segment *segment) {
+    munmap(segment, sizeof(struct Ring_segment));
+}
+
+
+// Add a copy of entry, size bytes, to the ring whose entries are at entries. Only the
+// ring's producer may push. The consumer sees it at once, but is only woken by ring_wake.
+// Returns 0 if the ring is full.
+int ring_push(struct Ring *ring, void *entries, size_t size, const void *entry) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= RING_SIZE) {
+        return 0;
+    }
+    memcpy((char *)entries + (head & (RING_SIZE - 1)) * size, entry, size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+
+// Take the oldest entry into entry. Only the ring's consumer may pop.
+// Returns 0 if the ring is empty.
+int ring_pop(struct Ring *ring, const void *entries, size_t size, void *entry) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        return 0;
+    }
+    memcpy(entry, (const char *)entries + (tail & (RING_SIZE - 1)) * size, size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+
+// Entries waiting in the ring. Exact for its consumer, a hint for anyone else.
+int ring_length(struct Ring *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+
+// Wake the consumer if it went to sleep. Called by the producer after pushing entries.
+// The fences here and in ring_wait make sure that either the producer sees the consumer
+// sleeping or the consumer sees the new entries before it sleeps.
+void ring_wake(struct Ring *ring) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed) && atomic_exchange(&ring->sleeping, 0)) {
+        sem_post(&ring->wakeup);
+    }
+}
+
+
+// Wait until the ring has an entry to take. Polls it for poll_us first, which saves the
+// system calls of sleeping and waking when entries follow each other closely, then sleeps
+// until the producer wakes it or timeout_ms pass. Returns 1 if there is an entry.
+int ring_wait(struct Ring *ring, int poll_us, int timeout_ms) {
+    if (ring_length(ring) > 0) {
+        return 1;
+    }
+    if (poll_us > 0) {
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (int i = 0; i < 64; i++) {
+                if (ring_length(ring) > 0) {
+                    return 1;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < poll_us);
+    }
+
+    // Wakeups left over from entries taken without sleeping would end the sleep at once
+    while (sem_trywait(&ring->wakeup) == 0) {
+    }
+    atomic_store_explicit(&ring->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_length(ring) == 0) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&ring->wakeup, &until) == -1 && errno == EINTR) {
+        }
+    }
+    atomic_store(&ring->sleeping, 0);
+    return ring_length(ring) > 0;
+}
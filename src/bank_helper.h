@@ -5,39 +5,389 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <semaphore.h>
 
+// Money is counted in minor units (cents), MINOR_UNITS to one unit, so sums are exact.
+// Amounts are read and printed with two decimals, see parse_amount and format_amount.
+#define MINOR_UNITS 100
+#define MAX_AMOUNT INT64_C(100000000000000)    // Largest amount a single operation may move
+#define MAX_BALANCE INT64_C(1000000000000000000) // Largest balance a deposit or transfer may leave
+#define AMOUNT_TEXT 32                          // Buffer size for format_amount
+
+// Build with -DPAD_ACCOUNTS to give every account a cache line of its own, so desks working
+// on neighbouring accounts never invalidate each other's lines. Without it accounts are
+// packed, which keeps scans over all of them short.
+#define CACHE_LINE 64
+#ifdef PAD_ACCOUNTS
+#define ACCOUNT_ALIGN CACHE_LINE
+#else
+#define ACCOUNT_ALIGN 8
+#endif
+
+// The part of an account that operations touch. Account ids are kept apart in the store,
+// see account_id, since lookups go through the index and only saving needs them.
 struct Account {
-    int id;
-    double balance;
-    pthread_rwlock_t lock;
+    _Alignas(ACCOUNT_ALIGN) _Atomic int64_t balance;   // Changed with atomic operations, see deposit
+    atomic_uint_fast64_t changes;   // Changes begun in the low 32 bits, finished in the high, see read_balances
+    atomic_int lock;    // Only taken by operations on two accounts and checkpoints, see lock_account
+    atomic_ushort contention;   // Changes that overlapped another change, see begin_change
+    atomic_ushort hot;          // Combiner number plus one while deposits and withdrawals are combined
+
+    // Checkpoint support, see enter_epoch. epoch is the epoch of the latest change. The first
+    // change in a new epoch keeps the old balance and epoch, which the checkpointer still needs.
+    atomic_uint_fast64_t epoch;
+    uint64_t previous_epoch;
+    int64_t snapshot_balance;
+};
+
+// Threads changing accounts announce the epoch they work in, so that the checkpointer
+// can wait for every change of an epoch to finish before it reads that epoch's balances.
+#define MAX_EPOCH_THREADS 256
+
+struct Epoch_slot {
+    atomic_uint_fast64_t active;    // Epoch the thread works in, 0 when outside
+    char pad[64 - sizeof(atomic_uint_fast64_t)];
+};
+
+// One entry of the account index. slot stays -1 until the entry is published,
+// so lock-free readers never see an id without its slot.
+struct Index_entry {
+    atomic_int id;
+    atomic_int slot;
+};
+
+// Open addressing table with linear probing. Tables replaced by a resize are kept
+// in the retired list, because readers may still be probing them without a lock.
+struct Index_table {
+    size_t mask;
+    struct Index_table *retired;
+    struct Index_entry entries[];
+};
+
+// Hash index from account id to its slot in the account store.
+// Lookups take no lock, inserts must be serialized by the caller.
+struct Account_index {
+    struct Index_table *_Atomic table;
+    int used;
+};
+
+// Accounts live in segments that double in size: segment k holds
+// STORE_FIRST_SEGMENT << k accounts. Segments are never moved or freed while
+// the server runs, so a struct Account* stays valid for the life of the process.
+// Each segment has a matching array of account ids.
+#define STORE_FIRST_SEGMENT 64
+#define STORE_SEGMENTS 25
+
+struct Account_store {
+    struct Account *_Atomic segments[STORE_SEGMENTS];
+    int *_Atomic id_segments[STORE_SEGMENTS];
+    struct History *_Atomic *_Atomic history_segments[STORE_SEGMENTS];    // See record_history
+    atomic_int count;
+    struct Account_index index;
+};
+
+// Binary account database: a header and then one fixed-size record per account, in the
+// order of the store. The records can be used from a mapping of the file as they are.
+#define DATABASE_MAGIC "BANKACCT"
+#define DATABASE_VERSION 3
+
+struct Database_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t snapshot_lsn;      // Last journal record included
+    uint64_t epoch;             // Epoch of the journal records the balances include last
+    int64_t deposits;           // Money deposited up to the end of epoch, see stable_deposits
+    uint32_t records_checksum;  // CRC-32 of all records
+    uint32_t header_checksum;   // CRC-32 of the header bytes before this field
+};
+
+struct Database_record {
+    int32_t id;
+    uint32_t pad;
+    int64_t balance;            // Minor units
+};
+
+// Account statements. Every account keeps its latest HISTORY_ENTRIES changes in a ring,
+// allocated with its first change, and each change points to the journal slot it was
+// written to by its LSN. The rings are saved next to full snapshots, see save_history.
+#define HISTORY_ENTRIES 16          // Must be a power of two
+#define HISTORY_BUSY UINT64_MAX     // Stamp of an entry while it is written
+#define HISTORY_MAGIC "BANKHIST"
+#define HISTORY_VERSION 2
+
+struct History_entry {
+    atomic_uint_fast64_t stamp;     // Position in the ring plus one, 0 before the first write
+    atomic_uint_fast64_t lsn;
+    _Atomic int64_t amount;         // Minor units, negative for a debit
+    atomic_int other_id;            // The other account of a transfer, otherwise -1
+    atomic_int kind;                // Journal operation of the change, see record_history
+};
+
+struct History {
+    atomic_uint_fast64_t head;      // Entries recorded so far
+    struct History_entry entries[HISTORY_ENTRIES];
+};
+
+// One change as read_history returns it. A history file has a struct Database_header with
+// HISTORY_MAGIC, and then these records, each account's oldest first.
+struct Statement_entry {
+    uint64_t lsn;
+    int64_t amount;
+    int32_t account_id;
+    int32_t other_id;
+    int32_t kind;
+    uint32_t pad;
 };
 
 struct Client_message {
-    long mtype;
     int client_socket;
+    uint64_t accepted_ns;       // When the server accepted the client, for the admin metrics
+};
+
+// Clients waiting for a service desk, in a bounded FIFO queue per desk. Only the main thread
+// pushes, at the bottom, and desks take from the top with a compare-and-swap: their own queue
+// first, then the others'. There is no owner end as in a work-stealing deque, every desk
+// takes alike, so clients leave in the order they came whichever desk takes them.
+#define CLIENT_DEQUE_SIZE 1024      // Must be a power of two
+
+struct Client_deque {
+    _Alignas(CACHE_LINE) atomic_size_t top;         // Next client to take
+    _Alignas(CACHE_LINE) atomic_size_t bottom;      // Where the next client is pushed
+    struct Client_message *_Atomic items[CLIENT_DEQUE_SIZE];
+};
+
+// Flat combining for hot accounts, see combine. An account whose changes overlapped
+// hot_contention times gets one of HOT_MAX_ACCOUNTS combiners, and it goes back to plain
+// atomic changes after HOT_COOL_PASSES combining passes in a row that found no other request.
+#define HOT_CONTENTION 64
+#define HOT_MAX_ACCOUNTS 16
+#define HOT_COOL_PASSES 1000
+
+#define COMBINE_EMPTY 0
+#define COMBINE_PENDING 1
+#define COMBINE_DONE 2
+
+// A deposit or withdrawal waiting for the combiner of a hot account. Every thread has one,
+// next to its epoch slot, and only the thread holding the combiner lock answers it.
+struct Combine_request {
+    _Alignas(CACHE_LINE) atomic_int state;  // COMBINE_EMPTY, COMBINE_PENDING or COMBINE_DONE
+    struct Account *account;
+    uint64_t epoch;         // Epoch of the thread that asked
+    int64_t amount;         // Minor units, negative for a withdrawal
+    int result;             // 1 if applied, set before state becomes COMBINE_DONE
+};
+
+struct Combiner {
+    _Alignas(CACHE_LINE) atomic_int lock;
+    struct Account *_Atomic account;        // NULL while the combiner is free
+    int quiet_passes;       // Passes in a row that found only the combining thread's own request
+};
+
+// Balances read at one instant, see read_balances
+#define READ_MAX_ACCOUNTS 32
+#define READ_RETRIES 1000
+
+// One debit or credit of a batch, see apply_batch.
+#define BATCH_MAX_LEGS 64
+struct Batch_leg {
+    int account_id;
+    int64_t amount;             // Minor units, negative for a debit
 };
 
-int save_accounts(struct Account *accounts, int acc_count, const char *database);
+// Binary protocol, which a client switches to by sending the line "b". After the "ok" reply
+// every request is a struct Wire_request and every response a struct Wire_response, in order.
+// Fields are in host byte order, as are the journal and database files; only little-endian
+// hosts are supported, so they are little-endian on every host that builds this.
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the wire and file formats are little-endian");
+#define WIRE_OK 0
+#define WIRE_INVALID 1          // Bad account id or amount
+#define WIRE_NO_ACCOUNT 2       // Account couldn't be created or found
+#define WIRE_NO_DEST 3          // Destination account couldn't be created
+#define WIRE_INSUFFICIENT 4     // Not enough funds
+#define WIRE_UNKNOWN 5          // Unknown operation
+#define WIRE_WRONG_SHARD 6      // Account belongs to another shard of a sharded bank
+#define WIRE_READ_ONLY 7        // Server is a replica, which only answers balance checks
+#define WIRE_BALANCE_LIMIT 8    // Deposit would take the balance over MAX_BALANCE
+
+struct Wire_request {
+    uint8_t operation;      // 'l', 'w', 'd', 't' or 'q', as in the text commands
+    uint8_t pad[3];
+    int32_t account_id;
+    int32_t dest_id;        // Only used by 't'
+    int32_t pad2;
+    int64_t amount;         // Minor units, unused by 'l' and 'q'
+};
+
+struct Wire_response {
+    uint8_t status;         // WIRE_OK or one of the failures
+    uint8_t operation;      // Copied from the request
+    uint8_t pad[2];
+    int32_t account_id;     // Copied from the request
+    int64_t value;          // Balance for 'l', otherwise the request's amount
+};
+
+// Shared memory transport for clients on the same host, which a client asks for with the line
+// "m". The server replies with the name of a POSIX shared memory segment holding a ring of
+// binary protocol requests and a ring of their responses. The client maps it, and from then
+// on the socket only tells either side that the other one is gone. Every ring has one producer
+// and one consumer. A consumer with nothing to take sleeps on the ring's semaphore, which the
+// producer only posts once the consumer said it sleeps, so while both sides keep busy an
+// operation makes no system call. A client may have at most RING_SIZE requests unanswered.
+#define RING_SIZE 256           // Entries per ring, must be a power of two
+#define RING_NAME_SIZE 64
+#define RING_MAGIC 0x474e4952
+
+struct Ring {
+    _Alignas(CACHE_LINE) atomic_uint head;      // Next entry the producer fills
+    _Alignas(CACHE_LINE) atomic_uint tail;      // Next entry the consumer takes
+    _Alignas(CACHE_LINE) atomic_int sleeping;   // The consumer waits on wakeup, see ring_wait
+    sem_t wakeup;                               // Shared by both processes
+};
+
+struct Ring_segment {
+    uint32_t magic;
+    uint32_t size;          // sizeof(struct Ring_segment), so both sides agree on the layout
+    struct Ring requests;   // Client to server
+    struct Ring responses;  // Server to client, in the order of the requests
+    struct Wire_request request_entries[RING_SIZE];
+    struct Wire_response response_entries[RING_SIZE];
+};
+
+int init_account_index(struct Account_index *index, int capacity);
+
+void destroy_account_index(struct Account_index *index);
+
+int index_lookup(const struct Account_index *index, int id);
 
-int load_accounts(struct Account **accounts, const char *database);
+int index_insert(struct Account_index *index, int id, int slot);
 
-int create_new_account(struct Account **accounts, int *acc_count, int account_id, 
-                        pthread_rwlock_t *accounts_lock);
+int init_account_store(struct Account_store *store, int capacity);
 
-struct Account* get_account_by_id(struct Account* accounts, int acc_count, int id);
+int reserve_accounts(struct Account_store *store, int capacity);
 
-int write_log(FILE *log_file, char operation, int account_id, int dest_id, 
-                double amount, pthread_rwlock_t *log_lock);
+void destroy_account_store(struct Account_store *store);
 
-double get_balance(struct Account *account);
+struct Account* account_at(const struct Account_store *store, int slot);
 
-int deposit(struct Account *account, double amount);
+int account_id(const struct Account_store *store, int slot);
 
-int withdraw(struct Account *account, double amount);
+int account_count(const struct Account_store *store);
 
-int transfer(struct Account *accounts, int acc_count, int source_id, int dest_id,
-                double amount);
+int record_history(const struct Account_store *store, int account_id, int kind, int64_t amount,
+                    int other_id, uint64_t lsn);
+
+int read_history(const struct Account_store *store, int account_id, struct Statement_entry *entries, int max);
+
+int save_history(const struct Account_store *store, const char *path, uint64_t snapshot_lsn);
+
+int load_history(const struct Account_store *store, const char *path, uint64_t *snapshot_lsn);
+
+uint64_t current_epoch(void);
+
+void set_epoch(uint64_t epoch);
+
+uint64_t enter_epoch(void);
+
+void leave_epoch(void);
+
+uint64_t advance_epoch(void);
+
+void count_deposit(int64_t amount);
+
+int stable_deposits(int64_t *total);
+
+void set_deposits(int64_t total);
+
+int parse_amount(const char *text, int64_t *amount);
+
+const char *format_amount(int64_t amount, char *buffer);
+
+int parse_config_line(char *line, char **key, char **value);
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+
+int save_accounts(struct Account_store *store, const char *database, uint64_t snapshot_lsn,
+                    uint64_t epoch, uint64_t journal_epoch, int64_t deposits, uint64_t since_epoch);
+
+int load_accounts(struct Account_store *store, const char *database, uint64_t *snapshot_lsn, uint64_t *epoch,
+                    int64_t *deposits);
+
+int save_accounts_text(struct Account_store *store, const char *database, uint64_t snapshot_lsn, uint64_t epoch,
+                        int64_t deposits);
+
+int load_accounts_text(struct Account_store *store, const char *database, uint64_t *snapshot_lsn, uint64_t *epoch,
+                        int64_t *deposits);
+
+int list_numbered_files(const char *prefix, uint64_t **numbers);
+
+void sync_parent_dir(const char *path);
+
+int load_checkpoints(struct Account_store *store, const char *prefix, uint64_t *snapshot_lsn, uint64_t *epoch,
+                        int64_t *deposits);
+
+int remove_checkpoints(const char *prefix, uint64_t up_to_epoch);
+
+int create_new_account(struct Account_store *store, int account_id, pthread_rwlock_t *accounts_lock);
+
+struct Account* get_account_by_id(const struct Account_store *store, int id);
+
+int64_t get_balance(struct Account *account);
+
+int deposit(struct Account *account, int64_t amount);
+
+int withdraw(struct Account *account, int64_t amount);
+
+int transfer(const struct Account_store *store, int source_id, int dest_id,
+                int64_t amount);
+
+void set_lock_observer(void (*observer)(uint64_t wait_ns));
+
+void set_hot_contention(int threshold);
+
+int make_hot(struct Account *account);
+
+int hot_account_count(void);
+
+int parse_legs(const char *arguments, struct Batch_leg *legs, int *count);
+
+int apply_batch(const struct Account_store *store, struct Batch_leg *legs, int *count);
+
+int pay_batch(const struct Account_store *store, struct Batch_leg *legs, int *count);
+
+void apply_changes(struct Account *const *accounts, const int64_t *amounts, int count);
+
+int read_balances(struct Account *const *accounts, int count, int64_t *balances);
+
+int sum_balances_at_epoch(const struct Account_store *store, uint64_t epoch, int64_t *total, int *count);
 
 void send_response(int client_socket, const char *response);
 
-int shortest_queue(const int *queue_lengths, int num_queues);
\ No newline at end of file
+int shortest_queue(const int *queue_lengths, int num_queues);
+
+void init_client_deque(struct Client_deque *deque);
+
+int deque_push(struct Client_deque *deque, struct Client_message *client);
+
+struct Client_message *deque_take(struct Client_deque *deque);
+
+int deque_length(struct Client_deque *deque);
+
+struct Ring_segment *ring_create(const char *name);
+
+struct Ring_segment *ring_attach(const char *name);
+
+void ring_release(struct Ring_segment *segment);
+
+int ring_push(struct Ring *ring, void *entries, size_t size, const void *entry);
+
+int ring_pop(struct Ring *ring, const void *entries, size_t size, void *entry);
+
+int ring_length(struct Ring *ring);
+
+void ring_wake(struct Ring *ring);
+
+int ring_wait(struct Ring *ring, int poll_us, int timeout_ms);
\ No newline at end of file
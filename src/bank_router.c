@@ -0,0 +1,831 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "bank_helper.h"
+#include "log.h"
+
+// Router in front of a sharded bank: several bank_servers, each started with -S <index>/<count>
+// and holding the accounts whose id divided by count leaves index. Clients talk to the router
+// as they would to a server. It forwards every command to the shard of its accounts, and runs
+// transfers and batches between accounts on different shards as transactions: it prepares
+// them on every shard involved, which takes and holds the debits, and commits them once all
+// shards prepared, or else aborts them.
+//
+// The decision to commit is written to the decision log and synced before any shard hears
+// it, so a commit survives the router crashing in the middle. A transaction without a logged
+// commit is presumed aborted. Shards keep prepared transactions across their own crashes, and
+// the router asks them for the transactions still prepared at startup and every
+// RESOLVE_INTERVAL_S, finishing those no client thread is working on.
+//
+// Usage: bank_router [-s socket] [-j decision log] [-l level] [-o log file] <shard socket> ...
+// The shard sockets are given in shard index order.
+
+#define SOCKET_PATH "/tmp/bank-socket"
+#define DECISION_LOG "decisions"
+#define SOCKET_PATH_SIZE 108    // Size of sun_path in struct sockaddr_un
+#define MAX_SHARDS 64
+#define LINE_SIZE 4096          // Longest command or reply, the same as a server's input buffer
+#define LISTEN_BACKLOG 64
+#define RESOLVE_INTERVAL_S 1
+
+// Connection to one shard, opened when first needed. Replies are read a line at a time.
+struct Shard_link {
+    int fd;                 // -1 while not connected
+    size_t length;
+    char data[LINE_SIZE];
+};
+
+// Transaction ids, few enough at a time to look through one by one
+struct Id_set {
+    uint64_t *ids;
+    int count;
+    int capacity;
+};
+
+char shard_paths[MAX_SHARDS][SOCKET_PATH_SIZE];
+int shard_count = 0;
+
+// Transactions some client thread is running, which the resolver leaves alone, and
+// transactions decided to commit that some shard may not have committed yet. Both are
+// guarded by decision_mutex, which also orders the writes to the decision log.
+struct Id_set running;
+struct Id_set committing;
+pthread_mutex_t decision_mutex = PTHREAD_MUTEX_INITIALIZER;
+int decision_fd = -1;
+
+atomic_uint_fast64_t next_transaction;
+
+
+static int set_contains(const struct Id_set *set, uint64_t id) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->ids[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int set_add(struct Id_set *set, uint64_t id) {
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 64;
+        uint64_t *ids = realloc(set->ids, capacity * sizeof(uint64_t));
+        if (!ids) {
+            return 0;
+        }
+        set->ids = ids;
+        set->capacity = capacity;
+    }
+    set->ids[set->count++] = id;
+    return 1;
+}
+
+
+static void set_remove(struct Id_set *set, uint64_t id) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->ids[i] == id) {
+            set->ids[i] = set->ids[--set->count];
+            return;
+        }
+    }
+}
+
+
+// Make sure ids handed out from now on come after transaction.
+static void skip_transaction(uint64_t transaction) {
+    uint64_t next = atomic_load(&next_transaction);
+    while (next <= transaction && !atomic_compare_exchange_weak(&next_transaction, &next, transaction + 1)) {
+    }
+}
+
+
+static int shard_of(int acc_id) {
+    return acc_id >= 0 ? acc_id % shard_count : 0;
+}
+
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+
+// Read one line from the connection of link, without its newline, into line.
+// Returns 0 if the connection closed or the line doesn't fit.
+static int read_line(struct Shard_link *link, char *line, size_t size) {
+    char *newline;
+    while (!(newline = memchr(link->data, '\n', link->length))) {
+        if (link->length == sizeof(link->data)) {
+            return 0;
+        }
+        ssize_t n = read(link->fd, link->data + link->length, sizeof(link->data) - link->length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        link->length += n;
+    }
+    size_t length = newline - link->data;
+    if (length >= size) {
+        return 0;
+    }
+    memcpy(line, link->data, length);
+    line[length] = '\0';
+    link->length -= length + 1;
+    memmove(link->data, newline + 1, link->length);
+    return 1;
+}
+
+
+static void close_link(struct Shard_link *link) {
+    if (link->fd != -1) {
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+
+// Connect to a shard and wait for its "ready". Returns 0 if the shard can't be reached.
+static int open_link(struct Shard_link *link, int shard) {
+    struct sockaddr_un address;
+    char greeting[64];
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, shard_paths[shard]);
+    link->length = 0;
+    link->fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (link->fd < 0) {
+        return 0;
+    }
+    if (connect(link->fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        !read_line(link, greeting, sizeof(greeting))) {
+        close_link(link);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Send a command line to a shard, connecting first if needed. Returns 0 if that failed.
+static int send_command(struct Shard_link *links, int shard, const char *command) {
+    struct Shard_link *link = &links[shard];
+    if (link->fd == -1 && !open_link(link, shard)) {
+        LOG(LOG_WARNING, "Shard %d at %s can't be reached", shard, shard_paths[shard]);
+        return 0;
+    }
+    if (!write_all(link->fd, command, strlen(command))) {
+        close_link(link);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Read a shard's reply to a command sent before. Returns 0 if the connection broke.
+static int read_reply(struct Shard_link *links, int shard, char *reply, size_t size) {
+    if (links[shard].fd == -1 || !read_line(&links[shard], reply, size)) {
+        close_link(&links[shard]);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Send one command to a shard and read the reply, which keeps its newline.
+static int ask_shard(struct Shard_link *links, int shard, const char *command, char *reply, size_t size) {
+    if (!send_command(links, shard, command) || !read_reply(links, shard, reply, size - 1)) {
+        return 0;
+    }
+    strcat(reply, "\n");
+    return 1;
+}
+
+
+// Write a line to the decision log, synced if sync is set. Called with decision_mutex held.
+static int log_decision(char kind, uint64_t transaction, int sync) {
+    char line[32];
+    int length = snprintf(line, sizeof(line), "%c %" PRIu64 "\n", kind, transaction);
+    return write_all(decision_fd, line, length) && (!sync || fdatasync(decision_fd) == 0);
+}
+
+
+// Send "C" or "R" for a transaction to its shards. Returns the amount of shards that
+// confirmed it.
+static int finish_on_shards(struct Shard_link *links, const int *shards, int count, char operation, uint64_t transaction) {
+    char command[32];
+    char reply[LINE_SIZE];
+    int confirmed = 0;
+
+    snprintf(command, sizeof(command), "%c %" PRIu64 "\n", operation, transaction);
+    for (int i = 0; i < count; i++) {
+        if (!send_command(links, shards[i], command)) {
+            continue;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (read_reply(links, shards[i], reply, sizeof(reply)) && strncmp(reply, "ok", 2) == 0) {
+            confirmed++;
+        }
+    }
+    return confirmed;
+}
+
+
+// Run the legs of a transfer or batch that span shards as one transaction. Returns 1 if it
+// committed; otherwise writes the reason to failure: the failure reply of the first shard
+// that couldn't prepare its legs, or why the transaction couldn't be run.
+static int run_transaction(struct Shard_link *links, const struct Batch_leg *legs, int count,
+                            char *failure, size_t size) {
+    char commands[MAX_SHARDS][LINE_SIZE];
+    size_t lengths[MAX_SHARDS] = { 0 };
+    int shards[MAX_SHARDS];
+    int prepared[MAX_SHARDS];
+    char amount[AMOUNT_TEXT];
+    char reply[LINE_SIZE];
+    int participants = 0;
+
+    uint64_t transaction = atomic_fetch_add(&next_transaction, 1);
+    pthread_mutex_lock(&decision_mutex);
+    int tracked = set_add(&running, transaction);
+    pthread_mutex_unlock(&decision_mutex);
+    if (!tracked) {
+        snprintf(failure, size, "fail: Router is out of memory\n");
+        return 0;
+    }
+
+    // "P <transaction> <account_id> <amount> ..." for every shard with legs
+    for (int i = 0; i < count; i++) {
+        int shard = shard_of(legs[i].account_id);
+        if (lengths[shard] == 0) {
+            shards[participants++] = shard;
+            lengths[shard] = snprintf(commands[shard], LINE_SIZE, "P %" PRIu64, transaction);
+        }
+        lengths[shard] += snprintf(commands[shard] + lengths[shard], LINE_SIZE - lengths[shard], " %d %s",
+                                    legs[i].account_id, format_amount(legs[i].amount, amount));
+    }
+
+    // Every shard prepares at once; the router only waits for the slowest
+    for (int i = 0; i < participants; i++) {
+        strcat(commands[shards[i]], "\n");
+        prepared[i] = send_command(links, shards[i], commands[shards[i]]);
+    }
+    int all_prepared = 1;
+    failure[0] = '\0';
+    for (int i = 0; i < participants; i++) {
+        if (prepared[i]) {
+            prepared[i] = read_reply(links, shards[i], reply, sizeof(reply) - 1) && strncmp(reply, "ok", 2) == 0;
+            if (!prepared[i] && failure[0] == '\0' && strncmp(reply, "fail", 4) == 0) {
+                snprintf(failure, size, "%s\n", reply);
+            }
+        }
+        all_prepared &= prepared[i];
+    }
+
+    int committed = 0;
+    if (all_prepared) {
+        pthread_mutex_lock(&decision_mutex);
+        committed = set_add(&committing, transaction) && log_decision('c', transaction, 1);
+        if (!committed) {
+            set_remove(&committing, transaction);
+            LOG(LOG_ERROR, "Failed to log the commit of transaction %" PRIu64 ": %s", transaction, strerror(errno));
+        }
+        pthread_mutex_unlock(&decision_mutex);
+    }
+
+    if (committed) {
+        int confirmed = finish_on_shards(links, shards, participants, 'C', transaction);
+        pthread_mutex_lock(&decision_mutex);
+        if (confirmed == participants) {
+            set_remove(&committing, transaction);
+            log_decision('d', transaction, 0);
+        }
+        set_remove(&running, transaction);
+        pthread_mutex_unlock(&decision_mutex);
+        return 1;
+    }
+
+    // Shards that didn't answer may still have prepared it; the resolver aborts it there
+    int aborting[MAX_SHARDS];
+    int abort_count = 0;
+    for (int i = 0; i < participants; i++) {
+        if (prepared[i]) {
+            aborting[abort_count++] = shards[i];
+        }
+    }
+    finish_on_shards(links, aborting, abort_count, 'R', transaction);
+    pthread_mutex_lock(&decision_mutex);
+    set_remove(&running, transaction);
+    pthread_mutex_unlock(&decision_mutex);
+    if (failure[0] == '\0') {
+        snprintf(failure, size, all_prepared ? "fail: Router failed to log the transaction\n"
+                                             : "fail: A shard is unavailable, try again\n");
+    }
+    return 0;
+}
+
+
+// Run a transfer between accounts on different shards.
+static void route_transfer(struct Shard_link *links, int source, int dest, int64_t amount, char *reply, size_t size) {
+    struct Batch_leg legs[2] = { { source, -amount }, { dest, amount } };
+    char formatted[AMOUNT_TEXT];
+    if (run_transaction(links, legs, 2, reply, size)) {
+        snprintf(reply, size, "ok: Transfer of %s from account %d to account %d successful\n",
+                    format_amount(amount, formatted), source, dest);
+    }
+}
+
+
+static int compare_legs(const void *a, const void *b) {
+    const struct Batch_leg *x = a;
+    const struct Batch_leg *y = b;
+    return (x->account_id > y->account_id) - (x->account_id < y->account_id);
+}
+
+
+// Run a batch with legs on different shards. The legs of an account are netted first, so
+// a shard only holds an account's net debit, the way a server's batch does.
+static void route_batch(struct Shard_link *links, struct Batch_leg *legs, int count, char *reply, size_t size) {
+    int legs_given = count;
+    int unique = 0;
+    qsort(legs, count, sizeof(struct Batch_leg), compare_legs);
+    for (int i = 0; i < count; i++) {
+        if (unique > 0 && legs[unique - 1].account_id == legs[i].account_id) {
+            legs[unique - 1].amount += legs[i].amount;
+        }
+        else {
+            unique -= unique > 0 && legs[unique - 1].amount == 0;
+            legs[unique++] = legs[i];
+        }
+    }
+    unique -= unique > 0 && legs[unique - 1].amount == 0;
+
+    if (unique == 0 || run_transaction(links, legs, unique, reply, size)) {
+        snprintf(reply, size, "ok: Batch of %d legs applied\n", legs_given);
+    }
+    else if (strcmp(reply, "fail: Insufficient funds\n") == 0) {
+        snprintf(reply, size, "fail: Batch failed (insufficient funds)\n");
+    }
+}
+
+
+// Read a total as format_amount writes it. Unlike parse_amount it takes sums of any size.
+static int parse_total(const char *text, int64_t *total) {
+    char *end;
+    int64_t units = strtoll(text, &end, 10);
+    if (end == text || end[0] != '.' || end[1] < '0' || end[1] > '9' || end[2] < '0' || end[2] > '9' ||
+        end[3] != '\0') {
+        return 0;
+    }
+    int64_t minor = (end[1] - '0') * 10 + (end[2] - '0');
+    *total = units * MINOR_UNITS + (text[0] == '-' ? -minor : minor);
+    return 1;
+}
+
+
+// Add amount to a total of shard replies. Returns 0, leaving the total as it is, if the sum
+// doesn't fit.
+static int add_total(int64_t *total, int64_t amount) {
+    if (amount >= 0 ? *total > INT64_MAX - amount : *total < INT64_MIN - amount) {
+        return 0;
+    }
+    *total += amount;
+    return 1;
+}
+
+
+// Add up the totals and the deposits of every shard. Each shard sums its accounts at one
+// instant, but the shards don't share one, so money of a transfer between shards that is
+// still in flight may be missing from the sum: it leaves the source when prepared. The
+// command goes to all shards before any reply is read, to keep the instants close together.
+static void route_total(struct Shard_link *links, char *reply, size_t size) {
+    char text[AMOUNT_TEXT];
+    char deposits_text[AMOUNT_TEXT];
+    int64_t total = 0;
+    int64_t deposits = 0;
+    int accounts = 0;
+
+    int sent = 1;
+    int fits = 1;
+    for (int shard = 0; shard < shard_count; shard++) {
+        sent = send_command(links, shard, "T\n") && sent;
+    }
+    for (int shard = 0; shard < shard_count; shard++) {
+        int64_t shard_total;
+        int64_t shard_deposits;
+        int count;
+        if (!read_reply(links, shard, reply, size)) {
+            sent = 0;
+        }
+        else if (strncmp(reply, "fail: Total of", 14) == 0) {
+            fits = 0;   // The shard's own total doesn't fit
+        }
+        else if (sscanf(reply, "ok: Total of %d accounts: %31[^,], total deposits %31s", &count, text,
+                        deposits_text) != 3 || !parse_total(text, &shard_total) ||
+                 !parse_total(deposits_text, &shard_deposits)) {
+            sent = 0;
+        }
+        else {
+            fits = add_total(&total, shard_total) && add_total(&deposits, shard_deposits) && fits;
+            accounts += count;
+        }
+    }
+    if (!sent) {
+        snprintf(reply, size, "fail: A shard is unavailable, try again\n");
+        return;
+    }
+    if (!fits) {
+        snprintf(reply, size, "fail: Total is too large to give\n");
+        return;
+    }
+    snprintf(reply, size, "ok: Total of %d accounts: %s, total deposits %s\n", accounts,
+                format_amount(total, text), format_amount(deposits, deposits_text));
+}
+
+
+// Answer one command line of a client. Commands whose accounts are on one shard go there
+// as they are; so do lines the router can't make sense of, to the first shard, which
+// answers them the way any server would.
+static void route_command(struct Shard_link *links, const char *line, char *reply, size_t size) {
+    struct Batch_leg legs[BATCH_MAX_LEGS];
+    char amount_text[AMOUNT_TEXT];
+    char command[LINE_SIZE + 1];
+    int acc_id = -1;
+    int dest_id = -1;
+    int64_t amount;
+    int count;
+    int shard = 0;
+
+    switch (line[0]) {
+        case 'l': {
+            const char *next = line + 1;
+            char *end;
+            for (int i = 0; (acc_id = strtol(next, &end, 10)), end != next; i++, next = end) {
+                if (i == 0) {
+                    shard = shard_of(acc_id);
+                }
+                else if (shard_of(acc_id) != shard) {
+                    snprintf(reply, size, "fail: Accounts on different shards can't be read together\n");
+                    return;
+                }
+            }
+            break;
+        }
+        case 'w':
+        case 'd':
+        case 's':
+            if (sscanf(line + 1, "%d", &acc_id) == 1) {
+                shard = shard_of(acc_id);
+            }
+            break;
+        case 't':
+            if (sscanf(line + 1, "%d %d %31s", &acc_id, &dest_id, amount_text) == 3 && acc_id >= 0 && dest_id >= 0) {
+                shard = shard_of(acc_id);
+                if (shard_of(dest_id) != shard && parse_amount(amount_text, &amount) && amount > 0 && amount <= MAX_AMOUNT) {
+                    route_transfer(links, acc_id, dest_id, amount, reply, size);
+                    return;
+                }
+            }
+            break;
+        case 'a':
+            if (parse_legs(line + 1, legs, &count)) {
+                shard = shard_of(legs[0].account_id);
+                for (int i = 1; i < count; i++) {
+                    if (shard_of(legs[i].account_id) != shard) {
+                        route_batch(links, legs, count, reply, size);
+                        return;
+                    }
+                }
+            }
+            break;
+        case 'b':
+        case 'm':
+        case 'P':
+        case 'C':
+        case 'R':
+        case 'I':
+            snprintf(reply, size, "fail: Not available through the router\n");
+            return;
+        case 'T':
+            if (line[1 + strspn(line + 1, " \t")] == '\0') {
+                route_total(links, reply, size);
+                return;
+            }
+            break;
+    }
+
+    snprintf(command, sizeof(command), "%s\n", line);
+    if (!ask_shard(links, shard, command, reply, size)) {
+        snprintf(reply, size, "fail: A shard is unavailable, try again\n");
+    }
+}
+
+
+// Serve one client until it quits or leaves. Every client has connections of its own to
+// the shards, so its commands reach them in order.
+static void *handle_client(void *arg) {
+    int client = (int)(intptr_t)arg;
+    struct Shard_link *links = malloc(shard_count * sizeof(struct Shard_link));
+    struct Shard_link *input = malloc(sizeof(struct Shard_link));
+    char line[LINE_SIZE];
+    char reply[LINE_SIZE];
+
+    if (!links || !input) {
+        LOG(LOG_ERROR, "Failed to allocate client");
+        free(links);
+        free(input);
+        close(client);
+        return NULL;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        links[i].fd = -1;
+    }
+    input->fd = client;
+    input->length = 0;
+
+    LOG(LOG_INFO, "Client connected");
+    int serving = write_all(client, "ready\n", 6);
+    while (serving && read_line(input, line, sizeof(line))) {
+        if (line[0] == 'q') {
+            write_all(client, "ok: Closing connection...\n", 26);
+            break;
+        }
+        route_command(links, line, reply, sizeof(reply));
+        serving = write_all(client, reply, strlen(reply));
+    }
+    LOG(LOG_INFO, "Client disconnected");
+
+    for (int i = 0; i < shard_count; i++) {
+        if (links[i].fd != -1) {
+            write_all(links[i].fd, "q\n", 2);
+            close_link(&links[i]);
+        }
+    }
+    close(client);
+    free(links);
+    free(input);
+    return NULL;
+}
+
+
+// Finish the transactions prepared on the shards that no client thread is running: commit
+// those whose commit is logged and abort the rest. A logged commit that no shard still has
+// prepared is finished everywhere and leaves committing. Returns 1 if every shard answered,
+// 0 if one didn't and -1 if one isn't the shard its place in the shard list says.
+static int resolve_transactions(struct Shard_link *links) {
+    char reply[LINE_SIZE];
+    int complete = 1;
+
+    // Commits logged before the shards are asked, to tell which are no longer prepared anywhere;
+    // later ones may not be prepared yet
+    pthread_mutex_lock(&decision_mutex);
+    int logged = committing.count;
+    uint64_t *ids = malloc((logged + 1) * sizeof(uint64_t));
+    int *found = calloc(logged + 1, sizeof(int));
+    if (ids && found) {
+        memcpy(ids, committing.ids, logged * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&decision_mutex);
+    if (!ids || !found) {
+        free(ids);
+        free(found);
+        return 0;
+    }
+
+    for (int shard = 0; shard < shard_count; shard++) {
+        int index, count, prepared, offset;
+        if (!ask_shard(links, shard, "I\n", reply, sizeof(reply)) ||
+            sscanf(reply, "ok: Shard %d/%d has %d prepared:%n", &index, &count, &prepared, &offset) != 3) {
+            complete = 0;
+            continue;
+        }
+        if (index != shard || count != shard_count) {
+            LOG(LOG_ERROR, "Shard %d at %s is shard %d/%d", shard, shard_paths[shard], index, count);
+            complete = -1;
+            break;
+        }
+
+        const char *next = reply + offset;
+        char *end;
+        uint64_t transaction;
+        int listed = 0;
+        for (; (transaction = strtoull(next, &end, 10)), end != next; next = end, listed++) {
+            skip_transaction(transaction);
+            for (int i = 0; i < logged; i++) {
+                if (ids[i] == transaction) {
+                    found[i] = 1;
+                }
+            }
+            // Decided on the live set: a client thread may have logged the commit since ids was taken
+            pthread_mutex_lock(&decision_mutex);
+            int busy = set_contains(&running, transaction);
+            int commit = set_contains(&committing, transaction);
+            pthread_mutex_unlock(&decision_mutex);
+            if (!busy) {
+                LOG(LOG_INFO, "%s transaction %" PRIu64 " left prepared on shard %d", commit ? "Committing" : "Aborting",
+                        transaction, shard);
+                finish_on_shards(links, &shard, 1, commit ? 'C' : 'R', transaction);
+            }
+        }
+        // Transactions that didn't fit in the reply are left for the next round
+        if (listed < prepared && complete == 1) {
+            complete = 0;
+        }
+    }
+
+    pthread_mutex_lock(&decision_mutex);
+    for (int i = 0; complete == 1 && i < logged; i++) {
+        if (!found[i] && set_contains(&committing, ids[i]) && !set_contains(&running, ids[i])) {
+            set_remove(&committing, ids[i]);
+            log_decision('d', ids[i], 0);
+        }
+    }
+    // Once no commit is pending, nothing in the log is needed any more
+    if (committing.count == 0 && ftruncate(decision_fd, 0) == -1) {
+        LOG(LOG_WARNING, "Failed to empty the decision log: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&decision_mutex);
+    free(ids);
+    free(found);
+    return complete;
+}
+
+
+static void *resolver(void *arg) {
+    struct Shard_link *links = arg;
+    while (1) {
+        sleep(RESOLVE_INTERVAL_S);
+        resolve_transactions(links);
+    }
+    return NULL;
+}
+
+
+// Read the decision log: every transaction with a commit but no line saying all its shards
+// committed it goes to committing. A torn last line, which lacks its newline, was never
+// synced and so was never a decision.
+static int load_decisions(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT;
+    }
+    char line[64];
+    while (fgets(line, sizeof(line), file)) {
+        char *end;
+        uint64_t transaction = strtoull(line + 1, &end, 10);
+        if (*end != '\n' || (line[0] != 'c' && line[0] != 'd')) {
+            continue;
+        }
+        if (line[0] == 'c' && !set_add(&committing, transaction)) {
+            fclose(file);
+            return 0;
+        }
+        if (line[0] == 'd') {
+            set_remove(&committing, transaction);
+        }
+        skip_transaction(transaction);
+    }
+    fclose(file);
+    return 1;
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s socket] [-j decision log] [-l error|warning|info|debug] [-o log file]\n"
+                    "       <shard socket> [<shard socket> ...]\n", program);
+}
+
+
+int main(int argc, char **argv) {
+    char socket_path[SOCKET_PATH_SIZE] = SOCKET_PATH;
+    char decision_path[256] = DECISION_LOG;
+    char *log_file = NULL;
+    int level = LOG_INFO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:j:l:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                snprintf(socket_path, sizeof(socket_path), "%s", optarg);
+                break;
+            case 'j':
+                snprintf(decision_path, sizeof(decision_path), "%s", optarg);
+                break;
+            case 'l':
+                level = log_parse_level(optarg);
+                break;
+            case 'o':
+                log_file = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 0;
+        }
+    }
+    if (optind == argc || argc - optind > MAX_SHARDS || level == -1) {
+        usage(argv[0]);
+        return 0;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (strlen(argv[i]) >= SOCKET_PATH_SIZE) {
+            fprintf(stderr, "Socket path too long: %s\n", argv[i]);
+            return 0;
+        }
+        strcpy(shard_paths[shard_count++], argv[i]);
+    }
+    if (!log_open(log_file, level)) {
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Ids start from the time, so they keep growing across restarts that lost track of
+    // them; the decision log and the shards only hold ids still in use
+    atomic_init(&next_transaction, (uint64_t)time(NULL) << 20);
+    if (!load_decisions(decision_path)) {
+        LOG(LOG_ERROR, "Failed to read decision log %s", decision_path);
+        return 0;
+    }
+    decision_fd = open(decision_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (decision_fd < 0) {
+        LOG(LOG_ERROR, "Failed to open decision log %s", decision_path);
+        return 0;
+    }
+
+    // Transactions left over from before are finished before any client comes in. Until
+    // then nothing can be run, so every shard has to be up.
+    struct Shard_link *links = malloc(shard_count * sizeof(struct Shard_link));
+    if (!links) {
+        LOG(LOG_ERROR, "Failed to allocate shard connections");
+        return 0;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        links[i].fd = -1;
+    }
+    if (committing.count > 0) {
+        LOG(LOG_INFO, "%d logged commits may not have reached every shard.", committing.count);
+    }
+    int resolved;
+    while ((resolved = resolve_transactions(links)) == 0) {
+        LOG(LOG_WARNING, "Waiting for every shard to answer");
+        sleep(RESOLVE_INTERVAL_S);
+    }
+    if (resolved == -1) {
+        LOG(LOG_ERROR, "Shard sockets must be given in shard index order, one for every shard");
+        return 0;
+    }
+
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(sock, LISTEN_BACKLOG) < 0) {
+        LOG(LOG_ERROR, "Failed to listen on %s", socket_path);
+        return 0;
+    }
+    LOG(LOG_INFO, "Router listening on %s for %d shards", socket_path, shard_count);
+
+    pthread_t resolver_thread;
+    pthread_create(&resolver_thread, NULL, resolver, links);
+    pthread_detach(resolver_thread);
+
+    while (1) {
+        int client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        pthread_t client_thread;
+        if (pthread_create(&client_thread, NULL, handle_client, (void *)(intptr_t)client) != 0) {
+            LOG(LOG_ERROR, "Failed to start client thread");
+            close(client);
+            continue;
+        }
+        pthread_detach(client_thread);
+    }
+    return 0;
+}
@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 202009L
+#define _GNU_SOURCE     // pthread_setaffinity_np, see pin_thread
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,399 +9,2984 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <signal.h>
-#include <sys/msg.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
 
+// With _GNU_SOURCE the system headers set _POSIX_C_SOURCE themselves; let the project headers
+// define it again
+#undef _POSIX_C_SOURCE
 #include "bank_helper.h"
+#include "journal.h"
+#include "metrics.h"
+#include "log.h"
 
-// Socket and database file paths.
+// Default socket and database file paths, see the options in main. The other files are
+// kept in the directory of the database file, see set_data_paths.
 #define SOCKET_PATH "/tmp/bank-socket"
-#define DATABASE_FILE "database.txt"
+#define ADMIN_SOCKET_PATH "/tmp/bank-admin-socket"     // Metrics, see admin_server
+#define DATABASE_FILE "database.bin"
+#define TEXT_DATABASE_FILE "database.txt"   // Format before the binary one, see db_convert
+#define JOURNAL_PREFIX "journal"
+#define CHECKPOINT_PREFIX "checkpoint"
+#define HISTORY_FILE "history.bin"    // Account statements, saved with full checkpoints
+
+// Checkpoint defaults, see checkpointer
+#define CHECKPOINT_INTERVAL 30  // Seconds between checkpoints, 0 turns them off
+#define CHECKPOINT_MAX_DELTAS 8 // Incremental checkpoints between two full snapshots
+#define TOTAL_EPOCH_REUSE_MS 100    // Totals sum an epoch closed this recently again, see handle_total
+
+// Journal group commit defaults, see journal_open
+#define GROUP_SIZE 256
+#define GROUP_DELAY_US 0
+
+#define REPLY_SIZE 1024         // Room left in the reply buffer for each text command
+#define SOCKET_PATH_SIZE 108    // Size of sun_path in struct sockaddr_un
+
+// Service desks
+#define DESKS 4                     // Amount of counters serving customers
+#define MAX_DESKS 1024
+#define LISTEN_BACKLOG 5            // Connections the kernel holds until they are accepted
+#define DESK_WAIT_TARGET_MS 10      // Adaptive desk count, see desk_manager
+#define DESK_SCAN_PASSES 1000       // Passes over the queues before a desk gives up, see next_client
+#define ADAPT_TICK_MS 100
+#define ADAPT_IDLE_TICKS 50
+#define MAX_CPUS 256
+
+// Event loop mode, see event_worker
+#define MAX_EVENT_WORKERS 64
+#define EVENTS_PER_WAIT 64
+#define CONN_INBUF 4096
+#define CONN_OUTBUF 16384
+
+// Shared memory clients, see serve_ring
+#define RING_CHECK_MS 100       // How often the socket of a ring client that sends nothing is checked
+
+// Transactions between shards, see handle_prepare
+#define MAX_PREPARED 1024       // Transactions prepared and not yet committed or aborted
+
+// Replication, see serve_replica and replicator
+#define MAX_REPLICAS 8
+#define REPLICA_RETRY_MS 1000   // Pause before a replica that lost its primary connects again
+
+// Settings read from the command line and the configuration file, see set_option
+struct Settings {
+    char socket_path[SOCKET_PATH_SIZE];
+    char admin_socket_path[SOCKET_PATH_SIZE];
+    char database_file[256];
+    char log_file[256];         // Empty logs to stdout
+    int log_level;
+    int backlog;                // 0 picks LISTEN_BACKLOG for desks and SOMAXCONN for workers
+    int desks;                  // Desks open at startup
+    int min_desks;              // With max_desks above min_desks, desk_manager adapts the count
+    int max_desks;
+    int desk_wait_target_ms;
+    int cpus[MAX_CPUS];         // Desks and workers are pinned to these in turns
+    int cpu_count;              // 0 pins nothing
+    int group_size;
+    int group_delay_us;
+    int hot_contention;         // Overlapping changes that make an account hot, 0 never does
+    int ring_poll_us;           // Time a desk polls an empty ring before it sleeps
+    int shard_index;            // This server owns the accounts whose id % shard_count is shard_index
+    int shard_count;
+    char replication_socket[SOCKET_PATH_SIZE];  // Empty streams the journal to no replicas
+    char primary_socket[SOCKET_PATH_SIZE];      // Replication socket of the primary; set makes this a replica
+};
+
+struct Settings settings = {
+    .socket_path = SOCKET_PATH,
+    .admin_socket_path = ADMIN_SOCKET_PATH,
+    .database_file = DATABASE_FILE,
+    .log_level = LOG_INFO,
+    .desks = DESKS,
+    .desk_wait_target_ms = DESK_WAIT_TARGET_MS,
+    .group_size = GROUP_SIZE,
+    .group_delay_us = GROUP_DELAY_US,
+    .hot_contention = HOT_CONTENTION,
+    .shard_count = 1,
+};
+
+// Paths of the files next to the database, see set_data_paths
+char text_database_file[300];
+char journal_prefix[256];
+char checkpoint_prefix[300];
+char history_file[300];
+
+// Init accounts, journal, database and rwlocks for accounts
+struct Account_store accounts;
+struct Journal journal;
+FILE *database = NULL;
+pthread_rwlock_t accounts_lock;
+int sock = -1;
+
+// Checkpoints and the final save at shutdown take turns
+pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+int checkpoint_interval = CHECKPOINT_INTERVAL;
+uint64_t history_saved_lsn;     // Statements are saved up to this LSN, see take_checkpoint
+
+// Totals read the balances kept for the last closed epoch, so no epoch may close while one is
+// summed. Held around every advance of the epoch and every sum; unlike checkpoint_mutex,
+// never while a checkpoint is saved.
+pthread_mutex_t sum_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t epoch_closed_ns;       // When the last epoch was closed, see handle_total
+
+// Clients waiting for the desks: one deque per desk slot, which only the accepting thread
+// pushes to. clients_waiting counts the clients in all of them plus the desks asked to close,
+// and idle desks sleep on it. Every array has settings.max_desks slots.
+struct Client_deque *desk_queues;
+sem_t clients_waiting;
+atomic_int *desk_busy;
+atomic_int *desk_open;              // The slot has a desk thread
+atomic_int open_desks;              // Desks not asked to close
+atomic_int closing_desks;           // Desks asked to close that haven't yet, see close_desk
+
+// Time clients waited for a desk, since desk_manager last looked
+atomic_uint_fast64_t desk_wait_ns;
+atomic_uint_fast64_t desk_waits;
+
+// State of one client connection, served by an event loop worker or a desk.
+// Only the thread serving the connection touches it.
+struct Connection {
+    int fd;
+    uint32_t events;    // Events currently registered to epoll
+    uint64_t wait_lsn;  // Journal record the buffered replies depend on
+    int waiting;        // Whether the connection is in its worker's waiting list
+    int discarding;     // Dropping the rest of a line that was too long
+    int binary;         // Switched to struct Wire_request commands, see process_binary_input
+    struct Ring_segment *ring;      // Switched to shared memory, see serve_ring
+    char ring_name[RING_NAME_SIZE];
+    struct Connection *next_waiting;
+    size_t in_len;
+    size_t out_len;
+    size_t out_sent;
+    char in[CONN_INBUF];
+    char out[CONN_OUTBUF];
+};
+
+struct Worker {
+    int epoll_fd;
+    int event_fd;                   // Signaled by the journal after every commit
+    struct Connection *waiting;     // Connections whose replies wait for the journal
+};
+
+// Amount of event loop workers and their state. 0 workers means desk mode.
+int event_workers = 0;
+struct Worker workers[MAX_EVENT_WORKERS];
+
+atomic_uint rings_opened;       // Numbers the shared memory segments
+
+// A transaction between shards prepared here: its debits are taken and held, its credits
+// wait for the commit. Every leg is on this shard.
+struct Prepared {
+    uint64_t transaction;
+    uint64_t lsn;           // On a replica, the record it was last prepared or held in
+    int count;
+    struct Batch_leg legs[BATCH_MAX_LEGS];
+};
+
+// Prepared transactions in no particular order. Steps of transactions hold prepared_mutex
+// from their change until their journal record is appended, so hold_prepared never journals
+// a transaction as held after its commit or abort.
+struct Prepared *prepared[MAX_PREPARED];
+int prepared_count = 0;
+pthread_mutex_t prepared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Primary side of replication: the first LSN each connected replica still needs, 0 for a
+// free slot. Checkpoints keep the journal segments that hold it.
+atomic_uint_fast64_t replica_needs[MAX_REPLICAS];
+
+// Replica side: while following, the server applies its primary's journal and only reads,
+// until promote. The rest is for the lag gauges.
+atomic_int following;
+atomic_int promoting;
+pthread_t replicator_thread;
+int primary_connection = -1;                // Made by start_following, then the replicator's
+atomic_uint_fast64_t primary_durable_lsn;   // As of the primary's last frame
+atomic_uint_fast64_t replicated_lsn;        // Last record applied here
+atomic_uint_fast64_t primary_heard_ns;
+
+// Set by the SIGINT and SIGTERM handler; the main thread shuts down once its accept returns
+volatile sig_atomic_t shutdown_requested;
+
+
+// Whether operation changes balances while this server is a replica, which only reads.
+static int refused_on_replica(char operation) {
+    return (operation == 'w' || operation == 'd' || operation == 't' || operation == 'a' ||
+            operation == 'P' || operation == 'C' || operation == 'R') && atomic_load(&following);
+}
+
+
+// Account a balance is read from, or NULL if there is none. A replica only has the accounts
+// its primary made, since its accounts must stay a copy of the primary's; elsewhere reading
+// an account creates it, like any other operation.
+static struct Account *account_to_read(int acc_id) {
+    if (atomic_load(&following)) {
+        return get_account_by_id(&accounts, acc_id);
+    }
+    if (create_new_account(&accounts, acc_id, &accounts_lock) != 1) {
+        return NULL;
+    }
+    return get_account_by_id(&accounts, acc_id);
+}
+
+
+// Whether this server holds the account. A server that isn't a shard holds every account.
+static int owns_account(int acc_id) {
+    return acc_id % settings.shard_count == settings.shard_index;
+}
+
+
+// Run one operation for either protocol. For a balance check *value is set to the balance.
+// Returns one of the WIRE_ statuses, and sets *lsn to the journal record the operation wrote,
+// or 0 if it wrote none. A successful reply must not reach the client before that record
+// is durable.
+static int run_operation(char operation, int acc_id, int dest_id, int64_t amount, int64_t *value, uint64_t *lsn) {
+    *lsn = 0;
+    *value = amount;
+    if (refused_on_replica(operation)) {
+        return WIRE_READ_ONLY;
+    }
+
+    // Handle different operations requested by the customer.
+    // Mostly just error checking and calling the helper funtions.
+    switch (operation) {
+        case 'l': { // Check balance
+            if (acc_id < 0) {
+                return WIRE_INVALID;
+            }
+            if (!owns_account(acc_id)) {
+                return WIRE_WRONG_SHARD;
+            }
+            struct Account *acc = account_to_read(acc_id);
+            if (!acc) {
+                return WIRE_NO_ACCOUNT;
+            }
+            *value = get_balance(acc);
+            return WIRE_OK;
+        }
+
+        case 'w':   // Withdraw money from chosen account
+        case 'd': { // Deposit money to chosen account
+            if (acc_id < 0 || amount <= 0 || amount > MAX_AMOUNT) {
+                return WIRE_INVALID;
+            }
+            if (!owns_account(acc_id)) {
+                return WIRE_WRONG_SHARD;
+            }
+            if (create_new_account(&accounts, acc_id, &accounts_lock) != 1) {
+                return WIRE_NO_ACCOUNT;
+            }
+            struct Account* acc = get_account_by_id(&accounts, acc_id);
+
+            // The change and its journal record belong to the same epoch, see checkpointer
+            uint64_t epoch = enter_epoch();
+            int done = operation == 'w' ? withdraw(acc, amount) : deposit(acc, amount);
+            if (done) {
+                *lsn = journal_append(&journal, epoch, operation, acc_id, -1, amount);
+                record_history(&accounts, acc_id, operation, operation == 'w' ? -amount : amount, -1, *lsn);
+            }
+            leave_epoch();
+            return done ? WIRE_OK : operation == 'w' ? WIRE_INSUFFICIENT : WIRE_BALANCE_LIMIT;
+        }
+
+        case 't': { // Transfer money between source and destination account
+            if (acc_id < 0 || dest_id < 0 || amount <= 0 || amount > MAX_AMOUNT) {
+                return WIRE_INVALID;
+            }
+            if (!owns_account(acc_id) || !owns_account(dest_id)) {
+                return WIRE_WRONG_SHARD;
+            }
+            if (acc_id == dest_id) {
+                // Nothing really happens, but a transfer to the same account doesn't cause problems
+                return WIRE_OK;
+            }
+            if (create_new_account(&accounts, acc_id, &accounts_lock) != 1) {
+                return WIRE_NO_ACCOUNT;
+            }
+            if (create_new_account(&accounts, dest_id, &accounts_lock) != 1) {
+                return WIRE_NO_DEST;
+            }
+
+            uint64_t epoch = enter_epoch();
+            int done = transfer(&accounts, acc_id, dest_id, amount);
+            if (done == 1) {
+                *lsn = journal_append(&journal, epoch, operation, acc_id, dest_id, amount);
+                record_history(&accounts, acc_id, operation, -amount, dest_id, *lsn);
+                record_history(&accounts, dest_id, operation, amount, acc_id, *lsn);
+            }
+            leave_epoch();
+            return done == 1 ? WIRE_OK : done == 0 ? WIRE_INSUFFICIENT : WIRE_BALANCE_LIMIT;
+        }
+
+        case 'q': { // Quit
+            LOG(LOG_INFO, "Client disconnected");
+            return WIRE_OK;
+        }
+
+        default:
+            return WIRE_UNKNOWN;
+    }
+}
+
+
+// Add the legs of a batch or transaction journaled as a record ending at lsn to the statements
+// of their accounts. The legs are the record's last slots, in order.
+static void record_legs(char operation, const struct Batch_leg *legs, int count, uint64_t lsn) {
+    for (int i = 0; i < count; i++) {
+        record_history(&accounts, legs[i].account_id, operation, legs[i].amount, -1, lsn - count + 1 + i);
+    }
+}
+
+
+// Check that every leg is on this shard and create its account. Returns 0 after writing the
+// failure reply otherwise.
+static int find_leg_accounts(const struct Batch_leg *legs, int count, char *response, size_t size) {
+    for (int i = 0; i < count; i++) {
+        if (!owns_account(legs[i].account_id)) {
+            snprintf(response, size, "fail: Account %d belongs to another shard\n", legs[i].account_id);
+            return 0;
+        }
+        if (create_new_account(&accounts, legs[i].account_id, &accounts_lock) != 1) {
+            snprintf(response, size, "fail: Failed to create or find account\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// Run the batch command "a <account_id> <amount> [<account_id> <amount> ...]". Negative
+// amounts are debits. Either every leg is applied or none is, and the batch is journaled as
+// one record holding its net change to each account. Returns the LSN like handle_command.
+static uint64_t handle_batch(const char *arguments, char *response, size_t size) {
+    struct Batch_leg legs[BATCH_MAX_LEGS];
+    int count;
+
+    if (!parse_legs(arguments, legs, &count)) {
+        snprintf(response, size, "fail: Invalid input for batch\n");
+        return 0;
+    }
+    if (!find_leg_accounts(legs, count, response, size)) {
+        return 0;
+    }
+
+    uint64_t lsn = 0;
+    uint64_t epoch = enter_epoch();
+    int net_legs = count;
+    int applied = apply_batch(&accounts, legs, &net_legs);
+    if (applied == 1 && net_legs > 0) {
+        lsn = journal_append_batch(&journal, epoch, legs, net_legs);
+        record_legs('a', legs, net_legs, lsn);
+    }
+    leave_epoch();
+
+    if (applied != 1) {
+        snprintf(response, size, applied == 0 ? "fail: Batch failed (insufficient funds)\n"
+                                              : "fail: Batch failed (balance limit reached)\n");
+        return 0;
+    }
+    snprintf(response, size, "ok: Batch of %d legs applied\n", count);
+    return lsn;
+}
+
+
+// Run the balance check "l <account_id> <account_id> [...]" of several accounts, which reads
+// their balances as they were at one instant without holding up changes to them. Writes no
+// journal record, so returns 0.
+static uint64_t handle_balances(const char *arguments, char *response, size_t size) {
+    struct Account *read[READ_MAX_ACCOUNTS];
+    int64_t balances[READ_MAX_ACCOUNTS];
+    int ids[READ_MAX_ACCOUNTS];
+    char formatted[AMOUNT_TEXT];
+    int count = 0;
+
+    const char *next = arguments + strspn(arguments, " \t");
+    while (*next != '\0') {
+        char *end;
+        long id = strtol(next, &end, 10);
+        if (count == READ_MAX_ACCOUNTS || end == next || id < 0 || id > INT32_MAX || (*end != '\0' && *end != ' ' && *end != '\t')) {
+            snprintf(response, size, "fail: Invalid input for balance check\n");
+            return 0;
+        }
+        ids[count++] = id;
+        next = end + strspn(end, " \t");
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!owns_account(ids[i])) {
+            snprintf(response, size, "fail: Account %d belongs to another shard\n", ids[i]);
+            return 0;
+        }
+        read[i] = account_to_read(ids[i]);
+        if (!read[i]) {
+            snprintf(response, size, "fail: Failed to create or find account\n");
+            return 0;
+        }
+    }
+    if (!read_balances(read, count, balances)) {
+        snprintf(response, size, "fail: Balances kept changing, try again\n");
+        return 0;
+    }
+
+    // At most READ_MAX_ACCOUNTS of the longest ids and amounts still fit in REPLY_SIZE
+    size_t length = snprintf(response, size, "ok: Balances");
+    for (int i = 0; i < count && length < size; i++) {
+        length += snprintf(response + length, size - length, "%s %d: %s", i > 0 ? "," : "", ids[i],
+                            format_amount(balances[i], formatted));
+    }
+    if (length < size) {
+        snprintf(response + length, size - length, "\n");
+    }
+    return 0;
+}
+
+
+// Describe a change of a statement, see record_history, e.g. "transfer to 7".
+static const char *describe_change(const struct Statement_entry *entry, char *buffer, size_t size) {
+    switch (entry->kind) {
+        case 'd': return "deposit";
+        case 'w': return "withdrawal";
+        case 't':
+            snprintf(buffer, size, "transfer %s %d", entry->amount < 0 ? "to" : "from", entry->other_id);
+            return buffer;
+        case 'a': return "batch";
+        case JOURNAL_PREPARE: return "transaction debit";
+        case JOURNAL_COMMIT: return "transaction credit";
+        case JOURNAL_ABORT: return "transaction refund";
+        default: return "change";
+    }
+}
+
+
+// Run the statement "s <account_id> [<count>]", which lists the latest changes of an account,
+// up to count and at most HISTORY_ENTRIES, newest first. Each names the LSN of its journal
+// record. Answered from the account's history alone, so it takes as long for a new account
+// as for one with years of changes. Writes no journal record, so returns 0.
+static uint64_t handle_statement(const char *arguments, char *response, size_t size) {
+    struct Statement_entry entries[HISTORY_ENTRIES];
+    char formatted[AMOUNT_TEXT];
+    char described[32];
+    int acc_id;
+    int max = HISTORY_ENTRIES;
+    char extra;
+
+    int parsed = sscanf(arguments, "%d %d %c", &acc_id, &max, &extra);
+    if (parsed < 1 || parsed > 2 || acc_id < 0 || max < 1) {
+        snprintf(response, size, "fail: Invalid input for statement\n");
+        return 0;
+    }
+    if (!owns_account(acc_id)) {
+        snprintf(response, size, "fail: Account belongs to another shard\n");
+        return 0;
+    }
+    int count = read_history(&accounts, acc_id, entries, max);
+    if (count == -1) {
+        snprintf(response, size, "fail: No such account\n");
+        return 0;
+    }
+
+    size_t length = snprintf(response, size, "ok: Statement of account %d:%s", acc_id, count == 0 ? " no changes" : "");
+    for (int i = 0; i < count && length + 80 < size; i++) {
+        length += snprintf(response + length, size - length, "%s LSN %" PRIu64 " %s %s", i > 0 ? "," : "",
+                            entries[i].lsn, describe_change(&entries[i], described, sizeof(described)),
+                            format_amount(entries[i].amount, formatted));
+    }
+    snprintf(response + length, size - length, "\n");
+    return 0;
+}
+
+
+// Answer "T" with the sum of all balances at one instant, which an audit can take while
+// clients keep changing them, and the money deposited until then. Like a checkpoint it
+// closes the current epoch and reads the balances as of its end; only changes of that epoch
+// still under way are waited for. Writes no journal record, so returns 0.
+static uint64_t handle_total(const char *arguments, char *response, size_t size) {
+    char formatted[AMOUNT_TEXT];
+    char deposits_text[AMOUNT_TEXT];
+    int count;
+
+    if (arguments[strspn(arguments, " \t")] != '\0') {
+        snprintf(response, size, "fail: Invalid input for total\n");
+        return 0;
+    }
+    // Every closed epoch sends the next change of each account through its lock once, see
+    // touch_account, so a total sums the last closed epoch again if that is recent, or if a
+    // checkpoint being saved closed it. Otherwise it closes the current one.
+    pthread_mutex_lock(&sum_mutex);
+    uint64_t epoch = current_epoch() - 1;
+    if (metrics_now() - epoch_closed_ns >= TOTAL_EPOCH_REUSE_MS * 1000000ULL &&
+        pthread_mutex_trylock(&checkpoint_mutex) == 0) {
+        epoch = advance_epoch();
+        epoch_closed_ns = metrics_now();
+        pthread_mutex_unlock(&checkpoint_mutex);
+    }
+    int64_t total;
+    int64_t deposits;
+    int fits = sum_balances_at_epoch(&accounts, epoch, &total, &count);
+    int deposits_fit = stable_deposits(&deposits);
+    pthread_mutex_unlock(&sum_mutex);
+
+    if (!fits) {
+        snprintf(response, size, "fail: Total of %d accounts is too large to give\n", count);
+        return 0;
+    }
+    if (!deposits_fit) {
+        snprintf(response, size, "fail: Total of deposits is too large to give\n");
+        return 0;
+    }
+    snprintf(response, size, "ok: Total of %d accounts: %s, total deposits %s\n", count,
+                format_amount(total, formatted), format_amount(deposits, deposits_text));
+    return 0;
+}
+
+
+// Index of a prepared transaction in prepared, or -1. Called with prepared_mutex held, or
+// during replay.
+static int find_prepared(uint64_t transaction) {
+    for (int i = 0; i < prepared_count; i++) {
+        if (prepared[i]->transaction == transaction) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Add a prepared transaction with the given legs. Returns it, or NULL if the table is full.
+static struct Prepared *add_prepared(uint64_t transaction, const struct Batch_leg *legs, int count) {
+    if (prepared_count == MAX_PREPARED) {
+        return NULL;
+    }
+    struct Prepared *entry = malloc(sizeof(struct Prepared));
+    if (!entry) {
+        return NULL;
+    }
+    entry->transaction = transaction;
+    entry->lsn = 0;
+    entry->count = count;
+    if (count > 0) {
+        memcpy(entry->legs, legs, count * sizeof(struct Batch_leg));
+    }
+    prepared[prepared_count++] = entry;
+    return entry;
+}
+
+
+static void remove_prepared(int index) {
+    free(prepared[index]);
+    prepared[index] = prepared[--prepared_count];
+}
+
+
+// Read the transaction id at the start of a transaction command. Ids start from 1.
+static int parse_transaction(const char *arguments, uint64_t *transaction, const char **rest) {
+    char *end;
+    const char *start = arguments + strspn(arguments, " \t");
+    errno = 0;
+    unsigned long long value = strtoull(start, &end, 10);
+    if (errno != 0 || end == start || *start == '-' || value == 0 || (*end != '\0' && *end != ' ' && *end != '\t')) {
+        return 0;
+    }
+    *transaction = value;
+    *rest = end;
+    return 1;
+}
+
+
+// Run "P <transaction> <account_id> <amount> [...]", the first phase of a transaction
+// between shards, for its legs on this shard. Every debit is taken and held, or none is;
+// the credits are only paid by the commit. Once the reply is sent, the transaction survives
+// a crash until the coordinator commits or aborts it. Returns the LSN like handle_command.
+static uint64_t handle_prepare(const char *arguments, char *response, size_t size) {
+    struct Batch_leg legs[BATCH_MAX_LEGS];
+    struct Batch_leg debits[BATCH_MAX_LEGS];
+    uint64_t transaction;
+    const char *rest;
+    int count;
+
+    if (!parse_transaction(arguments, &transaction, &rest) || !parse_legs(rest, legs, &count)) {
+        snprintf(response, size, "fail: Invalid input for prepare\n");
+        return 0;
+    }
+    if (!find_leg_accounts(legs, count, response, size)) {
+        return 0;
+    }
+    int debit_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (legs[i].amount < 0) {
+            debits[debit_count++] = legs[i];
+        }
+    }
+
+    uint64_t lsn = 0;
+    const char *failure = NULL;
+    pthread_mutex_lock(&prepared_mutex);
+    if (find_prepared(transaction) != -1) {
+        failure = "Transaction is already prepared";
+    }
+    else if (prepared_count == MAX_PREPARED) {
+        failure = "Too many transactions prepared";
+    }
+    else {
+        uint64_t epoch = enter_epoch();
+        if (debit_count > 0 && !apply_batch(&accounts, debits, &debit_count)) {
+            failure = "Insufficient funds";
+        }
+        else if (!add_prepared(transaction, legs, count)) {
+            // Only a failed allocation gets here; give the debits back the way an abort would
+            for (int i = 0; i < debit_count; i++) {
+                debits[i].amount = -debits[i].amount;
+            }
+            pay_batch(&accounts, debits, &debit_count);
+            failure = "Failed to allocate transaction";
+        }
+        else {
+            lsn = journal_append_transaction(&journal, epoch, JOURNAL_PREPARE, transaction, legs, count);
+            // Only the debits are taken now, the credits go to the statements when paid
+            for (int i = 0; i < count; i++) {
+                if (legs[i].amount < 0) {
+                    record_history(&accounts, legs[i].account_id, JOURNAL_PREPARE, legs[i].amount, -1, lsn - count + 1 + i);
+                }
+            }
+        }
+        leave_epoch();
+    }
+    pthread_mutex_unlock(&prepared_mutex);
+
+    if (failure) {
+        snprintf(response, size, "fail: %s\n", failure);
+        return 0;
+    }
+    snprintf(response, size, "ok: Prepared transaction %" PRIu64 "\n", transaction);
+    return lsn;
+}
+
+
+// Run "C <transaction>", which pays the credits of a prepared transaction, or "R <transaction>",
+// which gives its held debits back. A transaction that isn't prepared here was finished
+// already or never prepared, and either way there is nothing left to do: the coordinator
+// repeats these until they get through. Returns the LSN like handle_command.
+static uint64_t finish_transaction(char operation, const char *arguments, char *response, size_t size) {
+    struct Batch_leg paid[BATCH_MAX_LEGS];
+    uint64_t transaction;
+    const char *rest;
+
+    if (!parse_transaction(arguments, &transaction, &rest) || rest[strspn(rest, " \t")] != '\0') {
+        snprintf(response, size, "fail: Invalid input for %s\n", operation == JOURNAL_COMMIT ? "commit" : "abort");
+        return 0;
+    }
+
+    uint64_t lsn = 0;
+    pthread_mutex_lock(&prepared_mutex);
+    int index = find_prepared(transaction);
+    if (index != -1) {
+        struct Prepared *entry = prepared[index];
+        int count = 0;
+        for (int i = 0; i < entry->count; i++) {
+            if (operation == JOURNAL_COMMIT && entry->legs[i].amount > 0) {
+                paid[count++] = entry->legs[i];
+            }
+            else if (operation == JOURNAL_ABORT && entry->legs[i].amount < 0) {
+                paid[count].account_id = entry->legs[i].account_id;
+                paid[count++].amount = -entry->legs[i].amount;
+            }
+        }
+
+        // Promised credits can't fail, so neither can this
+        uint64_t epoch = enter_epoch();
+        if (count > 0) {
+            pay_batch(&accounts, paid, &count);
+        }
+        lsn = journal_append_transaction(&journal, epoch, operation, transaction, paid, count);
+        record_legs(operation, paid, count, lsn);
+        leave_epoch();
+        remove_prepared(index);
+    }
+    pthread_mutex_unlock(&prepared_mutex);
+
+    if (index == -1) {
+        snprintf(response, size, "ok: Transaction %" PRIu64 " isn't prepared here\n", transaction);
+    }
+    else {
+        snprintf(response, size, "ok: %s transaction %" PRIu64 "\n", operation == JOURNAL_COMMIT ? "Committed" : "Aborted", transaction);
+    }
+    return lsn;
+}
+
+
+// Answer "I" with the shard this server is and the transactions prepared here, as many as
+// fit the reply: "ok: Shard <index>/<count> has <n> prepared: <transaction> ...". The
+// coordinator finishes the ones it isn't running itself, and asks again for the rest.
+static uint64_t list_prepared(char *response, size_t size) {
+    pthread_mutex_lock(&prepared_mutex);
+    size_t length = snprintf(response, size, "ok: Shard %d/%d has %d prepared:", settings.shard_index,
+                                settings.shard_count, prepared_count);
+    for (int i = 0; i < prepared_count && length + 24 < size; i++) {
+        length += snprintf(response + length, size - length, " %" PRIu64, prepared[i]->transaction);
+    }
+    pthread_mutex_unlock(&prepared_mutex);
+    snprintf(response + length, size - length, "\n");
+    return 0;
+}
+
+
+// Journal every prepared transaction again, as held, and wait until that is durable. Replay
+// after a checkpoint only reads the journal from the checkpoint's LSN on, which may come after
+// the prepare record of a transaction that is still waiting for its coordinator.
+static void hold_prepared(uint64_t epoch) {
+    uint64_t lsn = 0;
+    pthread_mutex_lock(&prepared_mutex);
+    for (int i = 0; i < prepared_count; i++) {
+        lsn = journal_append_transaction(&journal, epoch, JOURNAL_HELD, prepared[i]->transaction,
+                                            prepared[i]->legs, prepared[i]->count);
+    }
+    pthread_mutex_unlock(&prepared_mutex);
+    if (lsn > 0) {
+        journal_wait(&journal, lsn);
+    }
+}
+
+
+// Execute one text command and write the reply to response.
+// Shared by the service desks and the event loop workers.
+// If operation succeeds, the reply begins with "ok: ...", in case of failure, "fail: ..." instead.
+// Returns the LSN of the journal record the command wrote, or 0 if it wrote none.
+uint64_t handle_command(const char *buffer, char *response, size_t size) {
+    char operation = buffer[0];
+    int acc_id = -1;
+    int dest_id = -1;
+    int64_t amount = 0;
+    int64_t value;
+    uint64_t lsn;
+    char amount_text[AMOUNT_TEXT];
+    char formatted[AMOUNT_TEXT];
+
+    if (refused_on_replica(operation)) {
+        snprintf(response, size, "fail: Replica is read-only, send changes to the primary\n");
+        return 0;
+    }
+
+    // Parse the arguments the operation takes
+    int status = WIRE_OK;
+    switch (operation) {
+        case 'l':
+            if (sscanf(buffer + 1, "%d %d", &acc_id, &dest_id) == 2) {
+                return handle_balances(buffer + 1, response, size);
+            }
+            if (sscanf(buffer + 1, "%d", &acc_id) != 1) {
+                status = WIRE_INVALID;
+            }
+            break;
+        case 'w':
+        case 'd':
+            if (sscanf(buffer + 1, "%d %31s", &acc_id, amount_text) != 2 || !parse_amount(amount_text, &amount)) {
+                status = WIRE_INVALID;
+            }
+            break;
+        case 't':
+            if (sscanf(buffer + 1, "%d %d %31s", &acc_id, &dest_id, amount_text) != 3 || !parse_amount(amount_text, &amount)) {
+                status = WIRE_INVALID;
+            }
+            break;
+        case 'a':
+            return handle_batch(buffer + 1, response, size);
+        case 'P':
+            return handle_prepare(buffer + 1, response, size);
+        case 'C':
+            return finish_transaction(JOURNAL_COMMIT, buffer + 1, response, size);
+        case 'R':
+            return finish_transaction(JOURNAL_ABORT, buffer + 1, response, size);
+        case 'I':
+            return list_prepared(response, size);
+        case 's':
+            return handle_statement(buffer + 1, response, size);
+        case 'T':
+            return handle_total(buffer + 1, response, size);
+        case '\0':
+            snprintf(response, size, "fail: Invalid command\n");
+            return 0;
+    }
+    if (status == WIRE_OK) {
+        status = run_operation(operation, acc_id, dest_id, amount, &value, &lsn);
+    }
+    else {
+        lsn = 0;
+    }
+
+    switch (status) {
+        case WIRE_OK:
+            switch (operation) {
+                case 'l':
+                    snprintf(response, size, "ok: Account %d balance: %s\n", acc_id, format_amount(value, formatted));
+                    break;
+                case 'w':
+                    snprintf(response, size, "ok: Withdraw of %s from account %d successful\n", format_amount(amount, formatted), acc_id);
+                    break;
+                case 'd':
+                    snprintf(response, size, "ok: Deposit of %s to account %d successful\n", format_amount(amount, formatted), acc_id);
+                    break;
+                case 't':
+                    if (acc_id == dest_id) {
+                        snprintf(response, size, "ok: Nothing really happened, but transfer to same account doesn't cause problems\n");
+                    }
+                    else {
+                        snprintf(response, size, "ok: Transfer of %s from account %d to account %d successful\n", format_amount(amount, formatted), acc_id, dest_id);
+                    }
+                    break;
+                case 'q':
+                    snprintf(response, size, "ok: Closing connection...\n");
+                    break;
+            }
+            break;
+        case WIRE_INVALID:
+            snprintf(response, size, "fail: Invalid input for %s\n", operation == 'l' ? "balance check" :
+                        operation == 'w' ? "withdrawal" : operation == 'd' ? "deposit" : "transfer");
+            break;
+        case WIRE_NO_ACCOUNT:
+            snprintf(response, size, "fail: Failed to create or find account\n");
+            break;
+        case WIRE_NO_DEST:
+            snprintf(response, size, "fail: Failed to create destination account\n");
+            break;
+        case WIRE_INSUFFICIENT:
+            snprintf(response, size, operation == 'w' ? "fail: Withdraw failed (insufficient funds or invalid account)\n"
+                                                      : "fail: Insufficient funds\n");
+            break;
+        case WIRE_WRONG_SHARD:
+            snprintf(response, size, "fail: Account belongs to another shard\n");
+            break;
+        case WIRE_BALANCE_LIMIT:
+            snprintf(response, size, "fail: Balance limit reached\n");
+            break;
+        default:
+            snprintf(response, size, "fail: Unknown operation\n");
+            break;
+    }
+    return lsn;
+}
+
+
+// Execute one binary request, see struct Wire_request. Returns the LSN like handle_command.
+uint64_t handle_request(const struct Wire_request *request, struct Wire_response *response) {
+    uint64_t lsn;
+    int64_t value;
+
+    memset(response, 0, sizeof(*response));
+    response->operation = request->operation;
+    response->account_id = request->account_id;
+    response->status = run_operation(request->operation, request->account_id, request->dest_id,
+                                        request->amount, &value, &lsn);
+    response->value = value;
+    return lsn;
+}
+
+
+// Whether the input buffer holds a whole command.
+static int command_ready(const struct Connection *conn) {
+    if (conn->binary) {
+        return conn->in_len >= sizeof(struct Wire_request);
+    }
+    return memchr(conn->in, '\n', conn->in_len) != NULL;
+}
+
+
+// Run every whole binary request in the input buffer, appending the responses to the output buffer.
+static void process_binary_input(struct Connection *conn) {
+    size_t start = 0;
+
+    while (CONN_OUTBUF - conn->out_len >= sizeof(struct Wire_response) &&
+           conn->in_len - start >= sizeof(struct Wire_request)) {
+        struct Wire_request request;
+        struct Wire_response response;
+        memcpy(&request, conn->in + start, sizeof(request));
+        uint64_t started = metrics_now();
+        uint64_t lsn = handle_request(&request, &response);
+        metrics_operation(request.operation, response.status == WIRE_OK, metrics_now() - started);
+        if (lsn > conn->wait_lsn) {
+            conn->wait_lsn = lsn;
+        }
+        memcpy(conn->out + conn->out_len, &response, sizeof(response));
+        conn->out_len += sizeof(response);
+        start += sizeof(request);
+    }
+
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+}
+
+
+// Answer the line "m" by creating the client's shared memory rings, see serve_ring. Only
+// desks serve rings: a desk serves one client at a time, so it can wait on the client's ring.
+static void open_ring(struct Connection *conn) {
+    char *reply = conn->out + conn->out_len;
+    if (event_workers > 0) {
+        conn->out_len += snprintf(reply, REPLY_SIZE, "fail: Shared memory needs desks\n");
+        return;
+    }
+    snprintf(conn->ring_name, sizeof(conn->ring_name), "/bank-ring-%d-%u", (int)getpid(), atomic_fetch_add(&rings_opened, 1));
+    conn->ring = ring_create(conn->ring_name);
+    if (!conn->ring) {
+        LOG(LOG_WARNING, "Failed to create shared memory %s: %s", conn->ring_name, strerror(errno));
+        conn->out_len += snprintf(reply, REPLY_SIZE, "fail: Failed to create shared memory\n");
+        return;
+    }
+    conn->out_len += snprintf(reply, REPLY_SIZE, "ok: Shared memory %s\n", conn->ring_name);
+}
+
+
+// Run every complete line in the input buffer, appending the replies to the output buffer.
+// Stops early when the output buffer can't fit another reply; the rest waits for the flush.
+// The line "b" switches the connection to the binary protocol for everything after it, and
+// the line "m" to shared memory rings, after which nothing more is read from the socket.
+static void process_connection_input(struct Connection *conn) {
+    size_t start = 0;
+    char *newline;
+
+    if (conn->binary) {
+        process_binary_input(conn);
+        return;
+    }
+
+    // The rest of a line that was too long is dropped up to its end
+    if (conn->discarding) {
+        newline = memchr(conn->in, '\n', conn->in_len);
+        if (!newline) {
+            conn->in_len = 0;
+            return;
+        }
+        start = newline - conn->in + 1;
+        conn->discarding = 0;
+    }
+
+    while (CONN_OUTBUF - conn->out_len >= REPLY_SIZE &&
+           (newline = memchr(conn->in + start, '\n', conn->in_len - start)) != NULL) {
+        *newline = '\0';
+        if (strcmp(conn->in + start, "b") == 0) {
+            conn->out_len += snprintf(conn->out + conn->out_len, REPLY_SIZE, "ok: Binary protocol\n");
+            conn->binary = 1;
+            start = newline - conn->in + 1;
+            memmove(conn->in, conn->in + start, conn->in_len - start);
+            conn->in_len -= start;
+            process_binary_input(conn);
+            return;
+        }
+        if (strcmp(conn->in + start, "m") == 0) {
+            open_ring(conn);
+            start = newline - conn->in + 1;
+            if (conn->ring) {
+                conn->in_len = 0;
+                return;
+            }
+            continue;
+        }
+        uint64_t started = metrics_now();
+        uint64_t lsn = handle_command(conn->in + start, conn->out + conn->out_len, REPLY_SIZE);
+        metrics_operation(conn->in[start], conn->out[conn->out_len] == 'o', metrics_now() - started);
+        if (lsn > conn->wait_lsn) {
+            conn->wait_lsn = lsn;
+        }
+        conn->out_len += strlen(conn->out + conn->out_len);
+        start = newline - conn->in + 1;
+    }
+
+    // A full buffer without a newline can never become a valid command.
+    if (start == 0 && conn->in_len == CONN_INBUF && CONN_OUTBUF - conn->out_len >= REPLY_SIZE) {
+        conn->out_len += snprintf(conn->out + conn->out_len, REPLY_SIZE, "fail: Command too long\n");
+        conn->in_len = 0;
+        conn->discarding = 1;
+        return;
+    }
+
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+}
+
+
+// Write as much of the output buffer as the socket takes without blocking; on the blocking
+// sockets desks use, all of it. Returns 0 if the connection is broken.
+static int flush_connection(struct Connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = write(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
+
+
+// Serve a client over its shared memory rings until it quits or closes the socket. Requests
+// that arrived together are run together, and their responses are published once the last
+// journal record they depend on is durable, like replies on the socket.
+static void serve_ring(struct Connection *conn) {
+    struct Ring_segment *ring = conn->ring;
+    struct Wire_response responses[RING_SIZE];
+    int named = 1;
+    int quit = 0;
+
+    while (!quit) {
+        if (!ring_wait(&ring->requests, settings.ring_poll_us, RING_CHECK_MS)) {
+            // The client sends nothing on the socket after the switch, so anything there
+            // means it closed
+            struct pollfd socket_state = { conn->fd, POLLIN, 0 };
+            if (poll(&socket_state, 1, 0) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        // The client has mapped the segment once it sends a request, so the name can go
+        if (named) {
+            shm_unlink(conn->ring_name);
+            named = 0;
+        }
+
+        struct Wire_request request;
+        uint64_t wait_lsn = 0;
+        int count = 0;
+        while (!quit && count < RING_SIZE &&
+               ring_pop(&ring->requests, ring->request_entries, sizeof(request), &request)) {
+            uint64_t started = metrics_now();
+            uint64_t lsn = handle_request(&request, &responses[count]);
+            metrics_operation(request.operation, responses[count].status == WIRE_OK, metrics_now() - started);
+            if (lsn > wait_lsn) {
+                wait_lsn = lsn;
+            }
+            quit = request.operation == 'q';
+            count++;
+        }
+
+        // A client with more than RING_SIZE requests unanswered broke the protocol
+        journal_wait(&journal, wait_lsn);
+        for (int i = 0; i < count; i++) {
+            if (!ring_push(&ring->responses, ring->response_entries, sizeof(struct Wire_response), &responses[i])) {
+                LOG(LOG_WARNING, "Shared memory client overran its response ring");
+                quit = 1;
+                break;
+            }
+        }
+        ring_wake(&ring->responses);
+    }
+
+    if (named) {
+        shm_unlink(conn->ring_name);
+    }
+    ring_release(ring);
+    conn->ring = NULL;
+}
+
+
+// Loop to handle a client once they reach the desk. 
+// Called by the service desk.
+// Commands are lines, and a client may send many before reading any reply. Everything that
+// arrived is run in order, and the replies go out together in one write, once the last
+// journal record they depend on is durable.
+void* handle_client(void* arg) {
+    int client_socket = (intptr_t)arg;
+    ssize_t n;
+
+    struct Connection *conn = calloc(1, sizeof(struct Connection));
+    if (!conn) {
+        LOG(LOG_ERROR, "Failed to allocate client buffers");
+        close(client_socket);
+        return NULL;
+    }
+    conn->fd = client_socket;
+
+    // Once code reaches here, customer has reached the desk from the queue,
+    // meaning the client is now served and can thus be notified with "ready".
+    send_response(client_socket, "ready\n");
+
+    // Read clients messages from the socket
+    while ((n = read(client_socket, conn->in + conn->in_len, CONN_INBUF - conn->in_len)) > 0) {
+        conn->in_len += n;
+
+        // Commands that don't fit the reply buffer at once are run after it is written out.
+        // A command cut in half by the read stays in the buffer until the rest arrives.
+        int open = 1;
+        do {
+            process_connection_input(conn);
+            journal_wait(&journal, conn->wait_lsn);
+            open = flush_connection(conn);
+        } while (open && command_ready(conn));
+
+        if (!open) {
+            break;
+        }
+        if (conn->ring) {
+            serve_ring(conn);
+            break;
+        }
+    }
+    
+    close(client_socket);
+    free(conn);
+
+    return NULL;
+}
+
+
+// Pin the calling thread to one of the configured CPUs, picked by the thread's index.
+// Without configured CPUs threads run wherever the kernel puts them.
+static void pin_thread(int index) {
+    if (settings.cpu_count == 0) {
+        return;
+    }
+    int cpu = settings.cpus[index % settings.cpu_count];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        LOG(LOG_WARNING, "Failed to pin thread to CPU %d", cpu);
+    }
+}
+
+
+// Take a waiting client: from the desk's own queue first, then from the other desks' queues,
+// so a client queued behind a long session goes to whichever desk frees up first. Queues of
+// closed desks are searched too, for clients queued there just before the desk closed.
+// Only called after a successful sem_wait that didn't close the desk, which should guarantee
+// a client to take; a take only fails meanwhile while another desk takes a client of its own.
+// Yields after every pass, and returns NULL after DESK_SCAN_PASSES passes found nothing, so a
+// semaphore count that got ahead of the queues doesn't keep a desk spinning.
+static struct Client_message *next_client(int desk_id) {
+    for (int pass = 0; pass < DESK_SCAN_PASSES; pass++) {
+        for (int i = 0; i < settings.max_desks; i++) {
+            struct Client_message *client = deque_take(&desk_queues[(desk_id + i) % settings.max_desks]);
+            if (client) {
+                return client;
+            }
+        }
+        sched_yield();
+    }
+    LOG(LOG_WARNING, "Desk %d was woken for a client but found none", desk_id);
+    return NULL;
+}
+
+
+// Code of a single service desk thread, started by open_desk.
+// Takes customers from the queues and handles them by calling handle_client.
+// The desk sleeps on the semaphore while no client waits, so idle desks use no CPU.
+void* service_desk(void* arg) {
+    int desk_id = *(int*)arg;
+    free(arg);
+    pin_thread(desk_id);
+    LOG(LOG_INFO, "Desk %d is waiting for client.", desk_id);
+
+    while (1) {
+        if (sem_wait(&clients_waiting) == -1) {
+            continue;   // Interrupted
+        }
+
+        // A desk asked to close wakes up in place of a client, see close_desk
+        int closing = atomic_load(&closing_desks);
+        while (closing > 0 && !atomic_compare_exchange_weak(&closing_desks, &closing, closing - 1)) {
+        }
+        if (closing > 0) {
+            LOG(LOG_INFO, "Desk %d closed.", desk_id);
+            atomic_store(&desk_open[desk_id], 0);
+            return NULL;
+        }
+
+        struct Client_message *msg = next_client(desk_id);
+        if (!msg) {
+            continue;
+        }
+        LOG(LOG_DEBUG, "Desk %d received client %d from the queue.", desk_id, msg->client_socket);
+        uint64_t wait_ns = metrics_now() - msg->accepted_ns;
+        metrics_accept_to_serve(wait_ns);
+        atomic_fetch_add_explicit(&desk_wait_ns, wait_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&desk_waits, 1, memory_order_relaxed);
+
+        // handle_client closes the socket once the client leaves
+        atomic_store(&desk_busy[desk_id], 1);
+        handle_client((void*)(intptr_t)msg->client_socket);
+        atomic_store(&desk_busy[desk_id], 0);
+        free(msg);
+    }
+}
 
-#define BUFSIZE 255
 
-// Message queue
-#define MAX_ACTIVE_CLIENTS 4  // Amount of counters serving customers
-#define MESSAGE_QUEUE_KEY 1234
-#define MAX_CLIENTS 100 // Max amount of client sockets in queue
+// Start a desk thread in a free slot. Only the main thread and desk_manager open desks.
+// Returns 0 if every slot is taken, which can happen while closed desks are still exiting.
+static int open_desk(void) {
+    for (int i = 0; i < settings.max_desks; i++) {
+        if (atomic_load(&desk_open[i])) {
+            continue;
+        }
+        int* desk_id = malloc(sizeof(int));
+        if (!desk_id) {
+            return 0;
+        }
+        *desk_id = i;
+        atomic_store(&desk_open[i], 1);
+        atomic_fetch_add(&open_desks, 1);
+        pthread_t desk_thread;
+        pthread_create(&desk_thread, NULL, service_desk, desk_id);
+        pthread_detach(desk_thread);
+        return 1;
+    }
+    return 0;
+}
 
-// Init accounts, log, database and rwlocks for accounts
-struct Account *accounts = NULL;
-int acc_count = 0;
-FILE *log_file;
-FILE *database = NULL;
-pthread_rwlock_t accounts_lock;
-pthread_rwlock_t log_lock;
-int sock = -1;
 
-// Init message queue arrays and their lenghts & mutex for editing them
-int message_queue;
-int message_queues[MAX_ACTIVE_CLIENTS];
-int queue_lengths[MAX_ACTIVE_CLIENTS] = {0};
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Ask one desk to close. The next desk to wake up closes, so a busy desk finishes its client
+// first; clients still in its queue are taken by the other desks.
+static void close_desk(void) {
+    atomic_fetch_add(&closing_desks, 1);
+    atomic_fetch_sub(&open_desks, 1);
+    sem_post(&clients_waiting);
+}
+
+
+// Desk manager thread, running when max_desks is above min_desks. Every ADAPT_TICK_MS it
+// opens a desk if the clients served meanwhile waited longer than desk_wait_target_ms on
+// average, or if clients have waited that long without any being served. It closes one
+// once a desk has been idle with no client waiting for ADAPT_IDLE_TICKS ticks in a row.
+void *desk_manager(void *arg) {
+    uint64_t target_ns = (uint64_t)settings.desk_wait_target_ms * 1000000;
+    struct timespec tick = { 0, ADAPT_TICK_MS * 1000000L };
+    uint64_t unserved_ns = 0;
+    int idle_ticks = 0;
+
+    while (1) {
+        nanosleep(&tick, NULL);
+
+        // A client served between the two reads counts towards the next tick or this one,
+        // either is close enough
+        uint64_t waits = atomic_exchange(&desk_waits, 0);
+        uint64_t wait_ns = atomic_exchange(&desk_wait_ns, 0);
+        int waiting = 0;
+        sem_getvalue(&clients_waiting, &waiting);
+        int busy = 0;
+        for (int i = 0; i < settings.max_desks; i++) {
+            busy += atomic_load(&desk_busy[i]);
+        }
+        int open = atomic_load(&open_desks);
+
+        unserved_ns = waiting > 0 && waits == 0 ? unserved_ns + ADAPT_TICK_MS * 1000000ULL : 0;
+        idle_ticks = waiting == 0 && busy < open ? idle_ticks + 1 : 0;
+
+        if (open < settings.max_desks && ((waits > 0 && wait_ns / waits > target_ns) || unserved_ns >= target_ns)) {
+            if (open_desk()) {
+                LOG(LOG_INFO, "Opened a desk, %d open.", open + 1);
+                unserved_ns = 0;
+            }
+        }
+        else if (open > settings.min_desks && idle_ticks >= ADAPT_IDLE_TICKS) {
+            close_desk();
+            LOG(LOG_INFO, "Closing a desk, %d open.", open - 1);
+            idle_ticks = 0;
+        }
+    }
+    return NULL;
+}
+
+
+// Change the events epoll reports for a connection, if they differ from the current ones.
+static void watch_connection(struct Worker *worker, struct Connection *conn, uint32_t wanted) {
+    if (wanted != conn->events) {
+        struct epoll_event event = { .events = wanted, .data.ptr = conn };
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = wanted;
+    }
+}
+
+
+static void close_connection(struct Worker *worker, struct Connection *conn) {
+    if (conn->waiting) {
+        struct Connection **link = &worker->waiting;
+        while (*link != conn) {
+            link = &(*link)->next_waiting;
+        }
+        *link = conn->next_waiting;
+    }
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+}
+
+
+// Handle readiness of one connection: read what arrived, run complete commands and send replies.
+// While replies are waiting to be written, the connection stops reading, so a client
+// that doesn't read its replies can't make the server buffer without limit.
+// Replies that depend on journal records still being written are held back, and the
+// connection parks in the worker's waiting list until the journal signals the commit.
+static void service_connection(struct Worker *worker, struct Connection *conn, uint32_t ready) {
+    if (ready & EPOLLIN) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, CONN_INBUF - conn->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_connection(worker, conn);
+            return;
+        }
+        if (n > 0) {
+            conn->in_len += n;
+        }
+    }
+    else if (ready & (EPOLLHUP | EPOLLERR)) {
+        close_connection(worker, conn);
+        return;
+    }
+
+    // Keep going while replies drain immediately and complete commands remain.
+    do {
+        process_connection_input(conn);
+
+        if (conn->wait_lsn > journal_durable_lsn(&journal)) {
+            conn->waiting = 1;
+            conn->next_waiting = worker->waiting;
+            worker->waiting = conn;
+            watch_connection(worker, conn, 0);
+            return;
+        }
+
+        if (!flush_connection(conn)) {
+            close_connection(worker, conn);
+            return;
+        }
+    } while (conn->out_len == 0 && command_ready(conn));
+
+    watch_connection(worker, conn, conn->out_len > 0 ? EPOLLOUT : EPOLLIN);
+}
+
+
+// The journal made a group durable: continue every connection whose replies were waiting for it.
+static void resume_waiting(struct Worker *worker) {
+    uint64_t count;
+    read(worker->event_fd, &count, sizeof(count));
+
+    uint64_t durable = journal_durable_lsn(&journal);
+    struct Connection *conn = worker->waiting;
+    worker->waiting = NULL;
+
+    while (conn) {
+        struct Connection *next = conn->next_waiting;
+        if (conn->wait_lsn <= durable) {
+            conn->waiting = 0;
+            service_connection(worker, conn, 0);
+        }
+        else {
+            conn->next_waiting = worker->waiting;
+            worker->waiting = conn;
+        }
+        conn = next;
+    }
+}
+
+
+// Code of a single event loop worker thread, used instead of the service desks when the
+// server is started with -e. A worker serves every connection assigned to it, running each
+// command as soon as it has fully arrived, so idle clients don't occupy a thread.
+void* event_worker(void* arg) {
+    int worker_id = *(int*)arg;
+    free(arg);
+    struct Worker *worker = &workers[worker_id];
+    struct epoll_event events[EVENTS_PER_WAIT];
+    pin_thread(worker_id);
+
+    LOG(LOG_INFO, "Worker %d is waiting for clients.", worker_id);
+
+    while (1) {
+        int n = epoll_wait(worker->epoll_fd, events, EVENTS_PER_WAIT, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                LOG(LOG_ERROR, "Worker %d failed to wait for events", worker_id);
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            // The journal's eventfd is the only entry without a connection
+            if (events[i].data.ptr == NULL) {
+                resume_waiting(worker);
+            }
+            else {
+                service_connection(worker, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+}
+
+
+// Create the epoll instance of a worker and subscribe it to journal commits.
+static int init_worker(struct Worker *worker) {
+    worker->waiting = NULL;
+    worker->epoll_fd = epoll_create1(0);
+    worker->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (worker->epoll_fd == -1 || worker->event_fd == -1) {
+        LOG(LOG_ERROR, "Failed to create epoll instance");
+        return 0;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event) == -1 ||
+        !journal_add_watcher(&journal, worker->event_fd)) {
+        LOG(LOG_ERROR, "Failed to watch the journal");
+        return 0;
+    }
+    return 1;
+}
+
+
+// Greet a newly accepted client and hand it to an event loop worker.
+static void assign_to_worker(int conn, int worker_id, uint64_t accepted_ns) {
+    struct Connection *connection = malloc(sizeof(struct Connection));
+    if (!connection) {
+        LOG(LOG_ERROR, "Failed to allocate connection");
+        close(conn);
+        return;
+    }
+    connection->fd = conn;
+    connection->events = EPOLLIN;
+    connection->wait_lsn = 0;
+    connection->waiting = 0;
+    connection->discarding = 0;
+    connection->binary = 0;
+    connection->ring = NULL;
+    connection->next_waiting = NULL;
+    connection->in_len = 0;
+    connection->out_len = 0;
+    connection->out_sent = 0;
+
+    // Every client is served right away, there is no queue to wait in.
+    fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+    send_response(conn, "ready\n");
+    metrics_accept_to_serve(metrics_now() - accepted_ns);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    if (epoll_ctl(workers[worker_id].epoll_fd, EPOLL_CTL_ADD, conn, &event) == -1) {
+        LOG(LOG_ERROR, "Failed to add client to worker %d", worker_id);
+        close(conn);
+        free(connection);
+    }
+}
+
+
+// What journal replay needs to know about the loaded snapshot, and the changes of the
+// operation being replayed.
+struct Replay_state {
+    struct Account_store *store;
+    uint64_t snapshot_epoch;    // Records of this epoch and before are in the snapshot
+    uint64_t last_epoch;        // Latest epoch seen in the journal
+    uint64_t last_lsn;          // Last record replayed
+    uint64_t history_lsn;       // Records up to this one are in the loaded statements
+    char group;                 // Operation of the batch or transaction record the next legs belong to
+    struct Prepared *transaction;   // Prepared transaction the next legs belong to
+    int change_count;
+    struct Account *changed[BATCH_MAX_LEGS + 1];
+    int64_t amounts[BATCH_MAX_LEGS + 1];
+    int damaged;                // A group had more changes than any operation makes
+};
+
+// Journal replay of a replica's records, which the replicator owns until promote.
+struct Replay_state replica_state;
+
+
+// Add a change to a balance to the ones the record's operation makes. Changes in the
+// checkpoint's epoch and before are dropped: the snapshot has them, even those journaled
+// after its LSN was taken.
+static void replay_change(struct Replay_state *state, const struct Journal_record *record, int acc_id, int64_t amount) {
+    if (record->epoch <= state->snapshot_epoch) {
+        return;
+    }
+    if (state->change_count == BATCH_MAX_LEGS + 1) {
+        // The journal only hands over groups whose slots say they belong together
+        LOG(LOG_ERROR, "Journal record at LSN %" PRIu64 " has more than %d changes, the journal is damaged",
+                record->lsn, BATCH_MAX_LEGS + 1);
+        state->damaged = 1;
+        return;
+    }
+    if (create_new_account(state->store, acc_id, &accounts_lock) != 1) {
+        return;
+    }
+    state->changed[state->change_count] = get_account_by_id(state->store, acc_id);
+    state->amounts[state->change_count++] = amount;
+}
+
+
+// Redo one slot of a transaction step. Which transactions are prepared is tracked in every
+// epoch, since a transaction may stay prepared across checkpoints, while balances only
+// change for records after the snapshot. A prepare takes the debits, a commit pays its
+// legs and an abort gives them back; a held transaction was applied by its prepare.
+static void replay_transaction(const struct Journal_record *record, struct Replay_state *state) {
+    // A replica's clients may list the prepared transactions meanwhile
+    pthread_mutex_lock(&prepared_mutex);
+    if (record->operation != 'A') {
+        uint64_t transaction = (uint64_t)record->amount;
+        int index = find_prepared(transaction);
+        state->transaction = NULL;
+        if (state->group == JOURNAL_PREPARE || state->group == JOURNAL_HELD) {
+            // A transaction held at a checkpoint may also be read from its prepare record
+            state->transaction = index != -1 ? prepared[index] : add_prepared(transaction, NULL, 0);
+            if (state->transaction) {
+                state->transaction->count = 0;
+                state->transaction->lsn = record->lsn;
+            }
+            else {
+                LOG(LOG_ERROR, "Too many prepared transactions, lost %" PRIu64 " at LSN %" PRIu64, transaction, record->lsn);
+            }
+        }
+        else if (index != -1) {
+            remove_prepared(index);
+        }
+    }
+    else {
+        if (state->transaction && state->transaction->count < BATCH_MAX_LEGS) {
+            struct Batch_leg *leg = &state->transaction->legs[state->transaction->count++];
+            leg->account_id = record->account_id;
+            leg->amount = record->amount;
+        }
+        int applies = state->group == JOURNAL_PREPARE ? record->amount < 0 : state->group != JOURNAL_HELD;
+        if (applies) {
+            replay_change(state, record, record->account_id, record->amount);
+        }
+    }
+    pthread_mutex_unlock(&prepared_mutex);
+}
+
+
+// Add the changes of one journal record to the statements of their accounts, unless the
+// statements loaded at startup have them. Unlike balances, statements don't go by epoch:
+// the history file is saved up to an LSN.
+static void replay_history(const struct Replay_state *state, const struct Journal_record *record) {
+    if (record->lsn <= state->history_lsn) {
+        return;
+    }
+    switch (state->group) {
+        case 'd':
+        case 'w':
+            record_history(state->store, record->account_id, record->operation,
+                            record->operation == 'w' ? -record->amount : record->amount, -1, record->lsn);
+            break;
+        case 't':
+            record_history(state->store, record->account_id, 't', -record->amount, record->dest_id, record->lsn);
+            record_history(state->store, record->dest_id, 't', record->amount, record->account_id, record->lsn);
+            break;
+        case 'a':
+            record_history(state->store, record->account_id, 'a', record->amount, -1, record->lsn);
+            break;
+        case JOURNAL_PREPARE:
+        case JOURNAL_COMMIT:
+        case JOURNAL_ABORT:
+            if (record->operation == 'A' && (state->group != JOURNAL_PREPARE || record->amount < 0)) {
+                record_history(state->store, record->account_id, state->group, record->amount, -1, record->lsn);
+            }
+            break;
+    }
+}
+
+
+// Redo one journal record on top of the loaded snapshot.
+// Records are applied as plain balance changes without the checks the original operation
+// made: they passed them when they were first run, and two operations on one account may
+// have been journaled in the opposite order than they were applied. The changes of an
+// operation are applied together once its last slot is read, so a replica's readers never
+// see part of a batch or transfer.
+static void replay_record(const struct Journal_record *record, void *context) {
+    struct Replay_state *state = context;
+
+    // Nothing after a damaged group is applied, not even the rest of it
+    if (state->damaged) {
+        return;
+    }
+    if (record->epoch > state->last_epoch) {
+        state->last_epoch = record->epoch;
+    }
+    if (record->operation != 'A') {
+        state->group = record->operation;
+    }
+    switch (state->group) {
+        case 'd':
+            replay_change(state, record, record->account_id, record->amount);
+            if (record->epoch > state->snapshot_epoch) {
+                count_deposit(record->amount);
+            }
+            break;
+        case 'w':
+            replay_change(state, record, record->account_id, -record->amount);
+            break;
+        case 't':
+            replay_change(state, record, record->account_id, -record->amount);
+            replay_change(state, record, record->dest_id, record->amount);
+            break;
+        case 'a':   // Legs of a batch, which the journal only hands over complete
+            replay_change(state, record, record->account_id, record->amount);
+            break;
+        case JOURNAL_PREPARE:
+        case JOURNAL_HELD:
+        case JOURNAL_COMMIT:
+        case JOURNAL_ABORT:
+            replay_transaction(record, state);
+            break;
+        default:
+            LOG(LOG_ERROR, "Unknown operation '%c' in journal at LSN %lu", record->operation, (unsigned long)record->lsn);
+            break;
+    }
+    replay_history(state, record);
+
+    if (journal_ends_group(record)) {
+        apply_changes(state->changed, state->amounts, state->change_count);
+        state->change_count = 0;
+        // Records the snapshot has may be replayed for statements, see main
+        if (record->lsn > state->last_lsn) {
+            state->last_lsn = record->lsn;
+        }
+    }
+}
+
+
+// Oldest LSN a replica still needs, or below_lsn if that is older.
+static uint64_t kept_for_replicas(uint64_t below_lsn) {
+    for (int i = 0; i < MAX_REPLICAS; i++) {
+        uint64_t needed = atomic_load(&replica_needs[i]);
+        if (needed != 0 && needed < below_lsn) {
+            below_lsn = needed;
+        }
+    }
+    return below_lsn;
+}
+
+
+// Save the accounts as they were at the end of an epoch, while clients keep changing them.
+// The journal LSN is read before the epoch ends, so every change made in a later epoch gets
+// a later LSN and the journal from there on has everything the checkpoint lacks. A full
+// checkpoint replaces the database file; an incremental one only holds the accounts changed
+// since the previous checkpoint. Afterwards journal segments the checkpoint covers are deleted,
+// unless a replica still needs them. Transactions between shards that are still prepared are
+// journaled again after the LSN. Statements are only saved with full checkpoints, so the
+// journal also keeps what they lack, for replay to add at startup. Returns the epoch saved,
+// or 0 if the checkpoint failed. Called with checkpoint_mutex held.
+// A replica only takes full checkpoints, between the primary's epochs, see replicator. It
+// can't journal prepared transactions again, so its journal keeps their prepare records.
+static uint64_t take_checkpoint(int full, uint64_t since_epoch) {
+    uint64_t start_lsn = journal_next_lsn(&journal);
+    pthread_mutex_lock(&sum_mutex);
+    uint64_t epoch = advance_epoch();
+    int64_t deposits;
+    stable_deposits(&deposits);
+    epoch_closed_ns = metrics_now();
+    pthread_mutex_unlock(&sum_mutex);
+
+    uint64_t journal_epoch = epoch;
+    uint64_t below_lsn;
+    if (atomic_load(&following)) {
+        // The journal may already have slots of a group that isn't applied yet
+        start_lsn = replica_state.last_lsn + 1;
+        journal_epoch = replica_state.last_epoch;
+        below_lsn = kept_for_replicas(start_lsn);
+        pthread_mutex_lock(&prepared_mutex);
+        for (int i = 0; i < prepared_count; i++) {
+            if (prepared[i]->lsn < below_lsn) {
+                below_lsn = prepared[i]->lsn;
+            }
+        }
+        pthread_mutex_unlock(&prepared_mutex);
+    }
+    else {
+        below_lsn = kept_for_replicas(start_lsn);
+        hold_prepared(epoch);
+    }
+
+    if (full) {
+        if (save_accounts(&accounts, settings.database_file, start_lsn - 1, epoch, journal_epoch, deposits, 0) == 0) {
+            return 0;
+        }
+        // The journal keeps the changes statements lack if this fails, so the checkpoint goes on
+        if (save_history(&accounts, history_file, start_lsn - 1)) {
+            history_saved_lsn = start_lsn - 1;
+        }
+        else {
+            LOG(LOG_WARNING, "Failed to save account history");
+        }
+        remove_checkpoints(checkpoint_prefix, journal_epoch);
+    }
+    else {
+        char path[320];
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, checkpoint_prefix, epoch);
+        if (save_accounts(&accounts, path, start_lsn - 1, epoch, epoch, deposits, since_epoch) == 0) {
+            return 0;
+        }
+    }
+
+    // Start a new journal segment, so the current one can go at the next checkpoint
+    journal_rotate(&journal);
+    journal_truncate(&journal, below_lsn < history_saved_lsn + 1 ? below_lsn : history_saved_lsn + 1);
+    return epoch;
+}
+
+
+// Checkpointer thread. Every checkpoint_interval seconds saves the accounts changed since
+// the last checkpoint, and every CHECKPOINT_MAX_DELTAS rounds all of them, so that
+// recovery only replays the journal written since. Nothing is saved while no operations
+// have been journaled. The first checkpoint is full, because accounts restored at startup
+// aren't marked as changed.
+void *checkpointer(void *arg) {
+    uint64_t last_epoch = 0;
+    uint64_t last_lsn = journal_next_lsn(&journal);
+    int deltas = CHECKPOINT_MAX_DELTAS;
+
+    while (1) {
+        sleep(checkpoint_interval);
+
+        uint64_t next_lsn = journal_next_lsn(&journal);
+        if (next_lsn == last_lsn) {
+            continue;
+        }
+
+        pthread_mutex_lock(&checkpoint_mutex);
+        int full = deltas >= CHECKPOINT_MAX_DELTAS;
+        uint64_t epoch = take_checkpoint(full, last_epoch);
+        pthread_mutex_unlock(&checkpoint_mutex);
+
+        if (epoch == 0) {
+            // Try again with a full one, nothing since the last checkpoint is saved yet
+            LOG(LOG_ERROR, "Checkpoint failed");
+            deltas = CHECKPOINT_MAX_DELTAS;
+            continue;
+        }
+        deltas = full ? 0 : deltas + 1;
+        last_epoch = epoch;
+        last_lsn = next_lsn;
+    }
+    return NULL;
+}
+
+
+// Write all of data to fd. Returns 0 if the connection broke.
+static int write_fully(int fd, const void *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data = (const char *)data + n;
+        size -= n;
+    }
+    return 1;
+}
+
+
+// Read exactly size bytes from fd. Returns 0 if the connection broke or timed out first.
+static int read_fully(int fd, void *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data = (char *)data + n;
+        size -= n;
+    }
+    return 1;
+}
+
+
+// Records on their way to one replica, sent a frame at a time.
+struct Replica_stream {
+    int fd;
+    uint64_t sent_lsn;      // Last record added
+    int count;
+    int broken;
+    struct Journal_record records[REPLICATION_FRAME_RECORDS];
+};
+
+
+// Send the records collected so far as one frame, which may be empty.
+static void send_frame(struct Replica_stream *stream) {
+    struct Replication_frame frame = { journal_durable_lsn(&journal), stream->count, 0 };
+    if (!write_fully(stream->fd, &frame, sizeof(frame)) ||
+        !write_fully(stream->fd, stream->records, stream->count * sizeof(struct Journal_record))) {
+        stream->broken = 1;
+    }
+    stream->count = 0;
+}
+
+
+static void stream_record(const struct Journal_record *record, void *context) {
+    struct Replica_stream *stream = context;
+    if (stream->broken) {
+        return;
+    }
+    stream->records[stream->count++] = *record;
+    stream->sent_lsn = record->lsn;
+    if (stream->count == REPLICATION_FRAME_RECORDS) {
+        send_frame(stream);
+    }
+}
+
+
+// Take a full checkpoint for a replica that is too far behind to catch up from the journal
+// and send it the database file. Sets *snapshot_lsn to the last record the file holds.
+// Returns 0 if the checkpoint failed or the connection broke.
+static int send_snapshot(int fd, uint64_t *snapshot_lsn) {
+    struct Database_header header;
+    struct Replication_start start = { REPLICATION_MAGIC, 0 };
+    struct stat st;
+
+    // A replica's own epochs don't match the records it copies, see promote
+    if (atomic_load(&following)) {
+        return 0;
+    }
+    pthread_mutex_lock(&checkpoint_mutex);
+    int file = -1;
+    if (take_checkpoint(1, 0) != 0) {
+        file = open(settings.database_file, O_RDONLY);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+    if (file == -1) {
+        return 0;
+    }
+    // The file stays readable through the open descriptor even if the next checkpoint replaces it
+    if (fstat(file, &st) == -1 || pread(file, &header, sizeof(header), 0) != sizeof(header)) {
+        close(file);
+        return 0;
+    }
+    *snapshot_lsn = header.snapshot_lsn;
+    start.snapshot_size = st.st_size;
+
+    char buffer[65536];
+    int sent = write_fully(fd, &start, sizeof(start));
+    for (off_t offset = 0; sent && offset < st.st_size; ) {
+        ssize_t n = pread(file, buffer, sizeof(buffer), offset);
+        sent = n > 0 && write_fully(fd, buffer, n);
+        offset += n;
+    }
+    close(file);
+    return sent;
+}
+
+
+// Serve one replica on the replication socket: read the last record it has, catch it up
+// from the journal or from a fresh snapshot, then keep sending every durable record as it
+// comes, in whole groups. A frame goes out at least every REPLICATION_HEARTBEAT_MS, so the
+// replica can tell a quiet primary from a dead one.
+void *serve_replica(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    struct Replica_stream *stream = malloc(sizeof(struct Replica_stream));
+    char request[32] = {0};
+    unsigned long long after = 0;
+    int slot = -1;
+
+    // The replica sends its request right after connecting
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t n = read(fd, request, sizeof(request) - 1);
+    if (!stream || n <= 0 || sscanf(request, "F %llu", &after) != 1) {
+        LOG(LOG_WARNING, "Invalid replication request");
+        free(stream);
+        close(fd);
+        return NULL;
+    }
+
+    // Hold on to the journal from the replica's position on. Checkpoints delete segments
+    // with checkpoint_mutex held, so none goes between the claim and the look at what is left.
+    pthread_mutex_lock(&checkpoint_mutex);
+    for (int i = 0; i < MAX_REPLICAS && slot == -1; i++) {
+        uint_fast64_t free_slot = 0;
+        if (atomic_compare_exchange_strong(&replica_needs[i], &free_slot, after + 1)) {
+            slot = i;
+        }
+    }
+    int caught_up = after <= journal_durable_lsn(&journal) && journal_oldest_lsn(&journal) <= after + 1;
+    pthread_mutex_unlock(&checkpoint_mutex);
+    if (slot == -1) {
+        LOG(LOG_WARNING, "Refused a replica, %d are connected already", MAX_REPLICAS);
+        free(stream);
+        close(fd);
+        return NULL;
+    }
+
+    struct Replication_start start = { REPLICATION_MAGIC, 0 };
+    uint64_t snapshot_lsn;
+    int ok;
+    if (caught_up) {
+        ok = write_fully(fd, &start, sizeof(start));
+    }
+    else {
+        LOG(LOG_INFO, "Replica at LSN %llu is too far behind the journal, sending a snapshot", after);
+        ok = send_snapshot(fd, &snapshot_lsn);
+        if (ok) {
+            after = snapshot_lsn;
+            atomic_store(&replica_needs[slot], after + 1);
+        }
+    }
+    if (ok) {
+        LOG(LOG_INFO, "Replica connected, streaming the journal after LSN %llu", after);
+    }
+
+    stream->fd = fd;
+    stream->sent_lsn = after;
+    stream->count = 0;
+    stream->broken = !ok;
+    while (!stream->broken) {
+        uint64_t sent_before = stream->sent_lsn;
+        uint64_t durable = journal_durable_lsn(&journal);
+        if (durable > stream->sent_lsn &&
+            journal_replay(journal_prefix, stream->sent_lsn, durable, stream_record, stream) == -1) {
+            LOG(LOG_ERROR, "Failed to read the journal for a replica");
+            break;
+        }
+        if (stream->count > 0 || stream->sent_lsn == sent_before) {
+            send_frame(stream);
+        }
+        atomic_store(&replica_needs[slot], stream->sent_lsn + 1);
+
+        // Wait for more durable records, or until a heartbeat is due. A group durable only in
+        // part isn't sent, and is looked at again once more of it is.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += REPLICATION_HEARTBEAT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        journal_wait_until(&journal, durable + 1, &deadline);
+    }
+    if (ok) {
+        LOG(LOG_INFO, "Replica disconnected at LSN %" PRIu64, stream->sent_lsn);
+    }
+
+    atomic_store(&replica_needs[slot], 0);
+    free(stream);
+    close(fd);
+    return NULL;
+}
+
+
+// Accept replicas on the replication socket, each served by a thread of its own.
+void *replication_server(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    while (1) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_replica, (void *)(intptr_t)conn) != 0) {
+            LOG(LOG_ERROR, "Failed to start a replication thread");
+            close(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+
+
+// Connect to the primary's replication socket and ask for the records after after_lsn.
+// Returns the socket with the primary's Replication_start read into *start, or -1 if the
+// primary can't be reached.
+static int subscribe(uint64_t after_lsn, struct Replication_start *start) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, settings.primary_socket);
+
+    char request[32];
+    int length = snprintf(request, sizeof(request), "F %" PRIu64 "\n", after_lsn);
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        !write_fully(fd, request, length) || !read_fully(fd, start, sizeof(*start)) ||
+        memcmp(start->magic, REPLICATION_MAGIC, sizeof(start->magic)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+
+// Stop waiting for a primary that stayed silent through several heartbeats.
+static void expect_heartbeats(int fd) {
+    struct timeval timeout = { 0, REPLICATION_HEARTBEAT_MS * 10 * 1000L };
+    timeout.tv_sec = timeout.tv_usec / 1000000;
+    timeout.tv_usec %= 1000000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+
+// Replace the database with the snapshot the primary sends. The journal, checkpoints and
+// statements of the old database go first: a crash before the rename leaves the old database alone,
+// which is still a snapshot the primary once had. Returns 0 if the snapshot didn't arrive.
+static int receive_snapshot(int fd, uint64_t size) {
+    char temp_path[300];
+    char buffer[65536];
+    snprintf(temp_path, sizeof(temp_path), "%s.replica", settings.database_file);
+
+    int file = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = file != -1;
+    while (ok && size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        ok = read_fully(fd, buffer, chunk) && write_fully(file, buffer, chunk);
+        size -= chunk;
+    }
+    if (file != -1) {
+        ok = fsync(file) == 0 && ok;
+        close(file);
+    }
+    ok = ok && journal_remove(journal_prefix) && remove_checkpoints(checkpoint_prefix, UINT64_MAX) &&
+         (unlink(history_file) == 0 || errno == ENOENT) && rename(temp_path, settings.database_file) == 0;
+    if (!ok) {
+        unlink(temp_path);
+        return 0;
+    }
+    sync_parent_dir(settings.database_file);
+    return 1;
+}
+
 
+// Connect a replica to its primary at startup, once its own database and journal are
+// loaded. A primary that can't stream from where they end sends a snapshot, which replaces
+// them. Returns 0 if the primary can't be reached or the snapshot can't be loaded.
+static int start_following(struct Replay_state *replay, uint64_t *snapshot_lsn) {
+    struct Replication_start start;
+    int fd = subscribe(replay->last_lsn, &start);
+    if (fd == -1) {
+        LOG(LOG_ERROR, "Failed to reach the primary at %s", settings.primary_socket);
+        return 0;
+    }
+
+    if (start.snapshot_size > 0) {
+        uint64_t snapshot_epoch;
+        int64_t deposits;
+        if (!receive_snapshot(fd, start.snapshot_size)) {
+            LOG(LOG_ERROR, "Failed to receive a snapshot from the primary");
+            close(fd);
+            return 0;
+        }
+        while (prepared_count > 0) {
+            remove_prepared(0);
+        }
+        destroy_account_store(&accounts);
+        int count = load_accounts(&accounts, settings.database_file, snapshot_lsn, &snapshot_epoch, &deposits);
+        if (count == -1) {
+            LOG(LOG_ERROR, "Failed to load the snapshot from the primary");
+            close(fd);
+            return 0;
+        }
+        set_deposits(deposits);
+        *replay = (struct Replay_state){ &accounts, snapshot_epoch, snapshot_epoch, *snapshot_lsn, *snapshot_lsn, 0, NULL, 0 };
+        history_saved_lsn = *snapshot_lsn;
+        LOG(LOG_INFO, "Loaded a snapshot of %d accounts from the primary at LSN %" PRIu64 ".", count, *snapshot_lsn);
+    }
 
-// Loop to handle a client once they reach the desk. 
-// Called by the service desk.
-void* handle_client(void* arg) {
-    int client_socket = (intptr_t)arg;
-    char buffer[BUFSIZE];
-    ssize_t n;
+    expect_heartbeats(fd);
+    primary_connection = fd;
+    atomic_store(&replicated_lsn, replay->last_lsn);
+    atomic_store(&primary_durable_lsn, replay->last_lsn);
+    atomic_store(&primary_heard_ns, metrics_now());
+    atomic_store(&following, 1);
+    return 1;
+}
 
-    // Once code reaches here, customer has reached the desk from the queue,
-    // meaning the client is now served and can thus be notified with "ready".
-    send_response(client_socket, "ready\n");
 
-    // Read clients messages from the socket
-    while ((n = read(client_socket, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[n] = '\0'; 
-
-        char operation;
-        int acc_id = -1;
-        int dest_id = -1;
-        double amount = 0.0;
-        char response[BUFSIZE];
-
-        // Parse the operation type
-        if (sscanf(buffer, "%c", &operation) < 1) {
-            send_response(client_socket, "fail: Invalid command\n");
+// Replica thread. Copies the records the primary streams to this server's journal and
+// applies them, a whole group at a time. When the connection breaks it connects again
+// every REPLICA_RETRY_MS, asking for the records after the last one applied, until
+// promote stops it. Every checkpoint_interval seconds it takes a full checkpoint when the
+// first record of a new primary epoch arrives: the primary journals all changes of an epoch
+// before any of the next, so the accounts then hold every epoch before and nothing after.
+void *replicator(void *arg) {
+    struct Replay_state *state = arg;
+    struct Journal_record *records = malloc(REPLICATION_FRAME_RECORDS * sizeof(struct Journal_record));
+    struct Replication_frame frame;
+    int fd = primary_connection;
+    uint64_t checkpoint_ns = metrics_now();
+
+    while (records && !atomic_load(&promoting)) {
+        if (fd == -1) {
+            struct timespec pause = { REPLICA_RETRY_MS / 1000, REPLICA_RETRY_MS % 1000 * 1000000L };
+            nanosleep(&pause, NULL);
+            struct Replication_start start;
+            fd = subscribe(state->last_lsn, &start);
+            if (fd != -1 && start.snapshot_size > 0) {
+                // Only a restart may replace the accounts clients are reading
+                LOG(LOG_ERROR, "The primary no longer has the journal after LSN %" PRIu64 ", "
+                               "restart this replica to load a snapshot", state->last_lsn);
+                close(fd);
+                fd = -1;
+                break;
+            }
+            if (fd != -1) {
+                expect_heartbeats(fd);
+                LOG(LOG_INFO, "Reconnected to the primary after LSN %" PRIu64, state->last_lsn);
+            }
             continue;
         }
 
-        // Handle different operations requested by the customer.
-        // Mostly just error checking and calling the helper funtions.
-        // If operation succeeds, notify client with message beginning with "ok: ...",
-        // in case of failure, "fail: ..." instead.
-        switch (operation) {
-            case 'l': { // Check balance
-
-                if (sscanf(buffer, "%c %d", &operation, &acc_id) != 2 || acc_id < 0) {
-                    send_response(client_socket, "fail: Invalid input for balance check\n");
-                    break;
+        int received = read_fully(fd, &frame, sizeof(frame)) && frame.count <= REPLICATION_FRAME_RECORDS &&
+                       read_fully(fd, records, frame.count * sizeof(struct Journal_record));
+        // Changes are applied in an epoch, so totals read on the replica see them whole
+        enter_epoch();
+        for (uint32_t i = 0; received && i < frame.count; i++) {
+            if (checkpoint_interval > 0 && records[i].epoch > state->last_epoch && state->change_count == 0 &&
+                metrics_now() - checkpoint_ns >= checkpoint_interval * 1000000000ULL) {
+                leave_epoch();
+                pthread_mutex_lock(&checkpoint_mutex);
+                if (take_checkpoint(1, 0) == 0) {
+                    LOG(LOG_WARNING, "Failed to take a checkpoint at LSN %" PRIu64, state->last_lsn);
                 }
+                pthread_mutex_unlock(&checkpoint_mutex);
+                checkpoint_ns = metrics_now();
+                enter_epoch();
+            }
+            if (!journal_copy(&journal, &records[i])) {
+                LOG(LOG_ERROR, "Damaged record from the primary at LSN %" PRIu64, records[i].lsn);
+                received = 0;
+            }
+            else {
+                replay_record(&records[i], state);
+            }
+        }
+        leave_epoch();
+        if (state->damaged) {
+            LOG(LOG_ERROR, "Stopped replicating after LSN %" PRIu64 ", the primary sent a damaged record", state->last_lsn);
+            break;
+        }
+        if (!received) {
+            // The primary sends the group cut short here again, from its first slot
+            state->change_count = 0;
+            close(fd);
+            fd = -1;
+            if (!atomic_load(&promoting)) {
+                LOG(LOG_WARNING, "Lost the primary after LSN %" PRIu64, state->last_lsn);
+            }
+            continue;
+        }
+        atomic_store(&replicated_lsn, state->last_lsn);
+        atomic_store(&primary_durable_lsn, frame.durable_lsn);
+        atomic_store(&primary_heard_ns, metrics_now());
+    }
 
-                if (create_new_account(&accounts, &acc_count, acc_id, &accounts_lock) != 1) {
-                    send_response(client_socket, "fail: Failed to create or find account\n");
-                    break;
-                }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(records);
+    return NULL;
+}
 
-                struct Account* acc = get_account_by_id(accounts, acc_count, acc_id);
 
-                if (!acc) {
-                    send_response(client_socket, "fail: Account not found\n");
-                    break;
-                }
+static void start_checkpointer(void) {
+    if (checkpoint_interval > 0) {
+        pthread_t checkpoint_thread;
+        pthread_create(&checkpoint_thread, NULL, checkpointer, NULL);
+        pthread_detach(checkpoint_thread);
+    }
+}
 
-                double balance = get_balance(acc);
-                snprintf(response, sizeof(response), "ok: Account %d balance: %.2f\n", acc_id, balance);
-                send_response(client_socket, response);
-                break;
-            }
 
-            case 'w': { // Withdraw money from chosen account
+// Make this replica the primary: stop applying the old primary's records, which may take
+// until its next heartbeat, and start taking changes. Returns 0 if this server isn't a replica.
+static int promote(void) {
+    if (!atomic_load(&following)) {
+        return 0;
+    }
+    atomic_store(&promoting, 1);
+    pthread_join(replicator_thread, NULL);
+
+    // The epochs of new records continue after the old primary's, which the journal holds,
+    // and after the ones totals took here, which the accounts hold
+    pthread_mutex_lock(&checkpoint_mutex);
+    pthread_mutex_lock(&sum_mutex);
+    uint64_t epoch = current_epoch() > replica_state.last_epoch ? current_epoch() : replica_state.last_epoch;
+    set_epoch(epoch + 1);
+    pthread_mutex_unlock(&sum_mutex);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    atomic_store(&following, 0);
+    start_checkpointer();
+    LOG(LOG_INFO, "Promoted to primary after LSN %" PRIu64 ".", replica_state.last_lsn);
+    return 1;
+}
 
-                if (sscanf(buffer, "%c %d %lf", &operation, &acc_id, &amount) != 3 || acc_id < 0 || amount <= 0) {
-                    send_response(client_socket, "fail: Invalid input for withdrawal\n");
-                    break;
-                }
 
-                if (create_new_account(&accounts, &acc_count, acc_id, &accounts_lock) != 1) {
-                    send_response(client_socket, "fail: Failed to create or find account\n");
-                    break;
-                }
+// Answer metrics queries on the admin socket, one connection at a time. A query is the line
+// "text" or "json"; the reply is the report in that format, after which the connection is
+// closed. Reading the metrics takes no lock the desks or workers use. The query "promote"
+// turns a replica into the primary instead, see promote.
+void *admin_server(void *arg) {
+    int admin_sock = *(int*)arg;
+    free(arg);
 
-                struct Account* acc = get_account_by_id(accounts, acc_count, acc_id);
+    while (1) {
+        int conn = accept(admin_sock, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
 
-                if (!acc || withdraw(acc, amount) != 1) {
-                    send_response(client_socket, "fail: Withdraw failed (insufficient funds or invalid account)\n");
-                    break;
-                }
+        // An admin client that never sends its query mustn't keep others out for long
+        struct timeval timeout = { 1, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char query[16] = {0};
+        ssize_t n = read(conn, query, sizeof(query) - 1);
+        int json = n > 0 && strncmp(query, "json", 4) == 0;
+        if (n > 0 && strncmp(query, "promote", 7) == 0) {
+            const char *reply = promote() ? "ok: Promoted to primary\n" : "fail: Not a replica\n";
+            write_fully(conn, reply, strlen(reply));
+            close(conn);
+            continue;
+        }
 
-                snprintf(response, sizeof(response), "ok: Withdraw of %.2f from account %d successful\n", amount, acc_id);
-                send_response(client_socket, response);
-                if (write_log(log_file, operation, acc_id, -1, amount, &log_lock) == 0) {
-                    fprintf(stderr, "Failed to write log after withdraw\n");
+        // Gauges: current state rather than counts since startup
+        struct Metrics_gauge *gauges = malloc((settings.max_desks + 7) * sizeof(struct Metrics_gauge));
+        if (!gauges) {
+            close(conn);
+            continue;
+        }
+        int gauge_count = 0;
+        if (event_workers == 0) {
+            snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "desks");
+            gauges[gauge_count++].value = atomic_load(&open_desks);
+        }
+        for (int i = 0; event_workers == 0 && i < settings.max_desks; i++) {
+            if (atomic_load(&desk_open[i])) {
+                gauges[gauge_count].value = deque_length(&desk_queues[i]) + atomic_load(&desk_busy[i]);
+                snprintf(gauges[gauge_count++].name, sizeof(gauges[0].name), "queue_length_%d", i);
+            }
+        }
+        snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "accounts");
+        gauges[gauge_count++].value = account_count(&accounts);
+        snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "journal_pending_records");
+        gauges[gauge_count++].value = journal_next_lsn(&journal) - 1 - journal_durable_lsn(&journal);
+        snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "epoch");
+        gauges[gauge_count++].value = current_epoch();
+        snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "hot_accounts");
+        gauges[gauge_count++].value = hot_account_count();
+        if (atomic_load(&following)) {
+            // How far this replica is behind its primary, and how long since it last heard from it
+            uint64_t primary_lsn = atomic_load(&primary_durable_lsn);
+            uint64_t applied_lsn = atomic_load(&replicated_lsn);
+            snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "replication_lag_records");
+            gauges[gauge_count++].value = primary_lsn > applied_lsn ? primary_lsn - applied_lsn : 0;
+            snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "replication_silence_ms");
+            gauges[gauge_count++].value = (metrics_now() - atomic_load(&primary_heard_ns)) / 1000000;
+        }
+        else if (settings.replication_socket[0]) {
+            // Replicas connected, and how far the furthest behind is
+            int replicas = 0;
+            uint64_t lag = 0;
+            uint64_t durable = journal_durable_lsn(&journal);
+            for (int i = 0; i < MAX_REPLICAS; i++) {
+                uint64_t needed = atomic_load(&replica_needs[i]);
+                if (needed != 0) {
+                    replicas++;
+                    lag = durable + 1 > needed && durable + 1 - needed > lag ? durable + 1 - needed : lag;
                 }
-                break;
             }
+            snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "replicas");
+            gauges[gauge_count++].value = replicas;
+            snprintf(gauges[gauge_count].name, sizeof(gauges[0].name), "replication_lag_records");
+            gauges[gauge_count++].value = lag;
+        }
 
-            case 'd': { // Deposit money to chosen account
+        FILE *output = fdopen(conn, "w");
+        if (!output) {
+            close(conn);
+            free(gauges);
+            continue;
+        }
+        metrics_report(output, json, gauges, gauge_count);
+        fclose(output);
+        free(gauges);
+    }
+    return NULL;
+}
 
-                if (sscanf(buffer, "%c %d %lf", &operation, &acc_id, &amount) != 3 || acc_id < 0 || amount <= 0) {
-                    send_response(client_socket, "fail: Invalid input for deposit\n");
-                    break;
-                }
-                if (create_new_account(&accounts, &acc_count, acc_id, &accounts_lock) != 1) {
-                    send_response(client_socket, "fail: Failed to create or find account\n");
-                    break;
-                }
 
-                struct Account* acc = get_account_by_id(accounts, acc_count, acc_id);
+// Listen on the admin socket and start admin_server. The server runs without it if that fails.
+static void start_admin_server(void) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, settings.admin_socket_path);
+
+    int *admin_sock = malloc(sizeof(int));
+    if (!admin_sock || (*admin_sock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+        LOG(LOG_ERROR, "Failed to create admin socket");
+        free(admin_sock);
+        return;
+    }
+    unlink(settings.admin_socket_path);
+    if (bind(*admin_sock, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(*admin_sock, 5) < 0) {
+        LOG(LOG_ERROR, "Failed to listen on %s", settings.admin_socket_path);
+        close(*admin_sock);
+        free(admin_sock);
+        return;
+    }
 
-                if (!acc || deposit(acc, amount) != 1) {
-                    send_response(client_socket, "fail: Deposit failed (invalid account)\n");
-                    break;
-                }
+    pthread_t admin_thread;
+    pthread_create(&admin_thread, NULL, admin_server, admin_sock);
+    pthread_detach(admin_thread);
+}
 
-                snprintf(response, sizeof(response), "ok: Deposit of %.2f to account %d successful\n", amount, acc_id);
-                send_response(client_socket, response);
-                if (write_log(log_file, operation, acc_id, -1, amount, &log_lock) == 0) {
-                    fprintf(stderr, "Failed to write log after deposit\n");
-                }
-                break;
-            }
 
-            case 't': { // Transfer money between source and destination account
+// Listen on the replication socket and start replication_server. Returns 0 if that fails.
+static int start_replication_server(void) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, settings.replication_socket);
 
-                if (sscanf(buffer, "%c %d %d %lf", &operation, &acc_id, &dest_id, &amount) != 4 || acc_id < 0 || dest_id < 0 || amount <= 0) {
-                    send_response(client_socket, "fail: Invalid input for transfer\n");
-                    break;  
-                }
+    int listener = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        LOG(LOG_ERROR, "Failed to create replication socket");
+        return 0;
+    }
+    unlink(settings.replication_socket);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, MAX_REPLICAS) < 0) {
+        LOG(LOG_ERROR, "Failed to listen on %s", settings.replication_socket);
+        close(listener);
+        return 0;
+    }
 
-                if (acc_id == dest_id) {
-                    send_response(client_socket, "ok: Nothing really happened, but transfer to same account doesn't cause problems\n");
-                    break;
-                }
+    pthread_t replication_thread;
+    pthread_create(&replication_thread, NULL, replication_server, (void *)(intptr_t)listener);
+    pthread_detach(replication_thread);
+    LOG(LOG_INFO, "Streaming the journal to replicas on %s", settings.replication_socket);
+    return 1;
+}
 
-                if (create_new_account(&accounts, &acc_count, acc_id, &accounts_lock) != 1) {
-                    send_response(client_socket, "fail: Failed to create or find account\n");
-                    break;
-                }
 
-                if (create_new_account(&accounts, &acc_count, dest_id, &accounts_lock) != 1) {
-                    send_response(client_socket, "fail: Failed to create destination account\n");
-                    break;
-                }
+// Signal handler for SIGINT and SIGTERM. Only sets a flag: logging or checkpointing here
+// could interrupt the main thread inside log_line. Installed without SA_RESTART, so the
+// signal also interrupts the accept the main thread waits in, see accept_client.
+static void request_shutdown(int sig) {
+    (void)sig;
+    shutdown_requested = 1;
+}
 
-                struct Account* source = get_account_by_id(accounts, acc_count, acc_id);
-                struct Account* dest = get_account_by_id(accounts, acc_count, dest_id);
 
-                if (!source || !dest) {
-                    send_response(client_socket, "fail: Transfer failed (invalid account)\n");
-                    break;
-                }
+// Handle shutdown: save the accounts, close the journal and the sockets, and exit. Desks,
+// workers and the other threads keep running until the process exits, and account lookups
+// take no lock, so the accounts stay allocated for them. Holding accounts_lock only keeps
+// new accounts out of the last checkpoint. Run by the main thread, see request_shutdown.
+void handle_shutdown(void) {
+    pthread_mutex_lock(&checkpoint_mutex);
+    pthread_rwlock_wrlock(&accounts_lock);
 
-                if (transfer(accounts, acc_count, acc_id, dest_id, amount) != 1) {
-                    send_response(client_socket, "fail: Insufficient funds\n");
-                    break;
-                }
+    // A last full checkpoint. Operations still in flight finish in the next epoch: the ones
+    // that reach the journal before it is closed are replayed at the next start, the rest
+    // never reach the disk and their clients never get a reply. A replica saves nothing:
+    // its journal holds every record since its last checkpoint, see replicator.
+    if (atomic_load(&following)) {
+        LOG(LOG_INFO, "Replica stopped after LSN %" PRIu64 ".", atomic_load(&replicated_lsn));
+    }
+    else if (take_checkpoint(1, 0) == 0) {
+        LOG(LOG_ERROR, "Failed to save accounts");
+    }
+    else {
+        LOG(LOG_INFO, "Saved %d accounts to %s.", account_count(&accounts), settings.database_file);
+    }
+    journal_close(&journal);
 
-                char response[BUFSIZE];
-                snprintf(response, sizeof(response), "ok: Transfer of %.2f from account %d to account %d successful\n", amount, acc_id, dest_id);
-                send_response(client_socket, response);
-                if (write_log(log_file, operation, acc_id, dest_id, amount, &log_lock) == 0) {
-                    fprintf(stderr, "Failed to write log on a transfer\n");
-                }
-                break;
-            }
+    if (sock != -1) {
+        close(sock);
+        unlink(settings.socket_path);
+        unlink(settings.admin_socket_path);
+        if (settings.replication_socket[0]) {
+            unlink(settings.replication_socket);
+        }
+    }
+    exit(0);
+}
 
-            case 'q': { // Quit
-                send_response(client_socket, "ok: Closing connection...\n");
-                printf("Client disconnected\n");
-                break;
-            }
 
-            default: {
-                send_response(client_socket, "fail: Unknown operation\n");
-                break;
-            }
+// Accept the next client on sock, shutting the server down if a signal asked for it meanwhile.
+static int accept_client(struct sockaddr_un *address, socklen_t *addrLength) {
+    if (shutdown_requested) {
+        handle_shutdown();
+    }
+    int conn = accept(sock, (struct sockaddr*)address, addrLength);
+    if (shutdown_requested) {
+        if (conn >= 0) {
+            close(conn);
         }
+        handle_shutdown();
     }
-    
-    close(client_socket);
-
-    return NULL;
+    return conn;
 }
 
 
-// Code of a single service desk thread, initialized in the main loop.
-// Accepts customers from the queue with same id and handles them by calling handle_client.
-void* service_desk(void* arg) {
-    int desk_id = *(int*)arg;
-    free(arg);
-    printf("Desk %d is waiting for client.\n", desk_id);
+// Command line flags and the configuration file settings they stand for, see set_option.
+// -C names the configuration file.
+static const struct Option {
+    char flag;
+    const char *name;
+} options[] = {
+    { 's', "socket" },
+    { 'A', "admin_socket" },
+    { 'f', "database" },
+    { 'b', "backlog" },
+    { 'd', "desks" },
+    { 'm', "min_desks" },
+    { 'M', "max_desks" },
+    { 'w', "desk_wait_target_ms" },
+    { 'p', "cpus" },
+    { 'e', "event_workers" },
+    { 'g', "group_size" },
+    { 'G', "group_delay_us" },
+    { 'H', "hot_contention" },
+    { 'r', "ring_poll_us" },
+    { 'S', "shard" },
+    { 'R', "replication_socket" },
+    { 'P', "primary" },
+    { 'c', "checkpoint_interval" },
+    { 'l', "log_level" },
+    { 'o', "log_file" },
+};
+#define OPTION_COUNT (int)(sizeof(options) / sizeof(options[0]))
+#define OPTION_FLAGS "C:s:A:f:b:d:m:M:w:p:e:g:G:H:r:S:R:P:c:l:o:"
+
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-C config file] [-s socket] [-A admin socket] [-f database] [-b listen backlog]\n"
+                    "       [-d desks] [-m min desks] [-M max desks] [-w desk wait target ms] [-p cpus]\n"
+                    "       [-e workers] [-g group size] [-G group delay us] [-H hot contention]\n"
+                    "       [-r ring poll us] [-S shard index/count] [-R replication socket]\n"
+                    "       [-P primary replication socket] [-c checkpoint interval s]\n"
+                    "       [-l error|warning|info|debug] [-o log file]\n", program);
+}
 
-    while (1) {
-        struct Client_message msg;
 
-        // Take queue mutex to ensure correct behaviour when operating on queues
-        pthread_mutex_lock(&queue_mutex);
+// Read a whole decimal number between min and max. Returns 0 if text isn't one.
+static int parse_int(const char *text, int min, int max, int *result) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < min || value > max) {
+        return 0;
+    }
+    *result = value;
+    return 1;
+}
 
-        // If client in queue, try to serve it
-        if (queue_lengths[desk_id] >= 0) {
-            if (msgrcv(message_queues[desk_id], &msg, sizeof(msg), 0, IPC_NOWAIT) != -1) {
-                printf("Desk %d received client %d from the queue.\n", desk_id, msg.client_socket);
-            } 
-            else {
-                pthread_mutex_unlock(&queue_mutex);
-                continue;
+
+// Read a list of CPUs like "0,2,4-7" into settings.cpus. An empty list pins nothing.
+static int parse_cpus(const char *text) {
+    int count = 0;
+    while (*text != '\0') {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text) {
+            return 0;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text) {
+                return 0;
             }
-        } 
-        else {
-            pthread_mutex_unlock(&queue_mutex);
-            continue;
         }
+        if (first < 0 || last < first || last >= CPU_SETSIZE || count + (last - first) >= MAX_CPUS) {
+            return 0;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            settings.cpus[count++] = cpu;
+        }
+        if (*end == ',') {
+            end++;
+        }
+        else if (*end != '\0') {
+            return 0;
+        }
+        text = end;
+    }
+    settings.cpu_count = count;
+    return 1;
+}
 
-        pthread_mutex_unlock(&queue_mutex);
 
-        int client_socket = msg.client_socket;
+// Read a shard like "1/4": the server holds the accounts whose id divided by 4 leaves 1.
+static int parse_shard(const char *text) {
+    char index[16];
+    const char *slash = strchr(text, '/');
+    if (!slash || slash - text >= (long)sizeof(index)) {
+        return 0;
+    }
+    memcpy(index, text, slash - text);
+    index[slash - text] = '\0';
+    return parse_int(slash + 1, 1, 65536, &settings.shard_count) &&
+           parse_int(index, 0, settings.shard_count - 1, &settings.shard_index);
+}
 
-        handle_client((void*)(intptr_t)client_socket);
 
-        // Lock the queue mutex to decrease the queue size after handling the customer.
-        pthread_mutex_lock(&queue_mutex);
-        queue_lengths[desk_id]--;
-        pthread_mutex_unlock(&queue_mutex);
-        close(client_socket);
+// Copy a path setting, which must fit its buffer.
+static int set_path(char *path, size_t size, const char *value) {
+    if (*value == '\0' || strlen(value) >= size) {
+        return 0;
     }
+    strcpy(path, value);
+    return 1;
 }
 
 
-// Handle shutdown; Get locks, save account data and close/free everything.
-// Getting the locks first makes sure that pending transactions don't fail
-// thus no money is lost
-void handle_shutdown(int sig) {
-    pthread_rwlock_wrlock(&accounts_lock);
-    pthread_rwlock_wrlock(&log_lock);
+// Apply one setting, from the command line or the configuration file. Returns 0 if the
+// setting is unknown or its value is invalid.
+static int set_option(const char *name, const char *value) {
+    int ok;
+    if (strcmp(name, "socket") == 0) {
+        ok = set_path(settings.socket_path, sizeof(settings.socket_path), value);
+    }
+    else if (strcmp(name, "admin_socket") == 0) {
+        ok = set_path(settings.admin_socket_path, sizeof(settings.admin_socket_path), value);
+    }
+    else if (strcmp(name, "database") == 0) {
+        ok = set_path(settings.database_file, sizeof(settings.database_file), value);
+    }
+    else if (strcmp(name, "backlog") == 0) {
+        ok = parse_int(value, 1, SOMAXCONN, &settings.backlog);
+    }
+    else if (strcmp(name, "desks") == 0) {
+        ok = parse_int(value, 1, MAX_DESKS, &settings.desks);
+    }
+    else if (strcmp(name, "min_desks") == 0) {
+        ok = parse_int(value, 1, MAX_DESKS, &settings.min_desks);
+    }
+    else if (strcmp(name, "max_desks") == 0) {
+        ok = parse_int(value, 1, MAX_DESKS, &settings.max_desks);
+    }
+    else if (strcmp(name, "desk_wait_target_ms") == 0) {
+        ok = parse_int(value, 1, 60000, &settings.desk_wait_target_ms);
+    }
+    else if (strcmp(name, "cpus") == 0) {
+        ok = parse_cpus(value);
+    }
+    else if (strcmp(name, "event_workers") == 0) {   // Serve clients with event loop workers instead of desks
+        ok = parse_int(value, 1, MAX_EVENT_WORKERS, &event_workers);
+    }
+    else if (strcmp(name, "group_size") == 0) {      // Most journal records written per fdatasync
+        ok = parse_int(value, 1, INT32_MAX, &settings.group_size);
+    }
+    else if (strcmp(name, "group_delay_us") == 0) {  // Microseconds a partial group waits for more records
+        ok = parse_int(value, 0, INT32_MAX, &settings.group_delay_us);
+    }
+    else if (strcmp(name, "hot_contention") == 0) {  // Overlapping changes before an account's changes are combined
+        ok = parse_int(value, 0, UINT16_MAX, &settings.hot_contention);
+    }
+    else if (strcmp(name, "ring_poll_us") == 0) {    // Time a desk polls an idle shared memory client
+        ok = parse_int(value, 0, 1000000, &settings.ring_poll_us);
+    }
+    else if (strcmp(name, "shard") == 0) {           // Accounts this server holds in a sharded bank
+        ok = parse_shard(value);
+    }
+    else if (strcmp(name, "replication_socket") == 0) {  // Where replicas connect to follow this server
+        ok = set_path(settings.replication_socket, sizeof(settings.replication_socket), value);
+    }
+    else if (strcmp(name, "primary") == 0) {        // Replication socket of the primary this replica follows
+        ok = set_path(settings.primary_socket, sizeof(settings.primary_socket), value);
+    }
+    else if (strcmp(name, "checkpoint_interval") == 0) {     // Seconds between checkpoints
+        ok = parse_int(value, 0, INT32_MAX, &checkpoint_interval);
+    }
+    else if (strcmp(name, "log_level") == 0) {
+        settings.log_level = log_parse_level(value);
+        ok = settings.log_level != -1;
+    }
+    else if (strcmp(name, "log_file") == 0) {
+        ok = set_path(settings.log_file, sizeof(settings.log_file), value);
+    }
+    else {
+        fprintf(stderr, "Unknown setting %s\n", name);
+        return 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Invalid value for %s: %s\n", name, value);
+    }
+    return ok;
+}
+
 
-    if (save_accounts(accounts, acc_count, DATABASE_FILE) == 0) {
-        fprintf(stderr, "Failed to save accounts\n");
+// Apply the settings of a configuration file: "name = value" lines, with the names from
+// options. Returns 0 if the file can't be read or holds a line that isn't a valid setting.
+static int load_config(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open configuration file %s\n", path);
+        return 0;
     }
 
-    if (sock != -1) {
-        close(sock);
-        unlink(SOCKET_PATH);
+    char line[512];
+    char *name;
+    char *value;
+    int ok = 1;
+    for (int number = 1; ok && fgets(line, sizeof(line), file); number++) {
+        int found = parse_config_line(line, &name, &value);
+        if (found == -1) {
+            fprintf(stderr, "%s:%d: Expected a line like \"name = value\"\n", path, number);
+            ok = 0;
+        }
+        else if (found == 1 && !set_option(name, value)) {
+            fprintf(stderr, "%s:%d: Invalid setting\n", path, number);
+            ok = 0;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+
+// Fill in the desk limits that weren't set and check they fit together. Without limits the
+// desk count stays at settings.desks.
+static int check_desk_settings(void) {
+    if (settings.max_desks == 0) {
+        settings.max_desks = settings.desks > settings.min_desks ? settings.desks : settings.min_desks;
+    }
+    if (settings.min_desks == 0) {
+        settings.min_desks = settings.desks < settings.max_desks ? settings.desks : settings.max_desks;
+    }
+    if (settings.min_desks > settings.max_desks) {
+        fprintf(stderr, "min_desks %d is above max_desks %d\n", settings.min_desks, settings.max_desks);
+        return 0;
+    }
+    if (settings.desks < settings.min_desks) {
+        settings.desks = settings.min_desks;
     }
-    if (accounts) {
-        free(accounts);
+    if (settings.desks > settings.max_desks) {
+        settings.desks = settings.max_desks;
     }
+    return 1;
+}
+
 
-    if (log_file) {
-        fclose(log_file);
+// Put the journal, checkpoints and statements in the directory of the database file, so a
+// restart from another working directory finds everything the database needs with it.
+// Returns 0 if a path doesn't fit.
+static int set_data_paths(void) {
+    const char *slash = strrchr(settings.database_file, '/');
+    int dir_length = slash ? (int)(slash - settings.database_file) + 1 : 0;
+    const char *dir = settings.database_file;
+
+    if (snprintf(text_database_file, sizeof(text_database_file), "%.*s%s", dir_length, dir,
+                    TEXT_DATABASE_FILE) >= (int)sizeof(text_database_file) ||
+        snprintf(journal_prefix, sizeof(journal_prefix), "%.*s%s", dir_length, dir,
+                    JOURNAL_PREFIX) >= (int)sizeof(journal_prefix) ||
+        snprintf(checkpoint_prefix, sizeof(checkpoint_prefix), "%.*s%s", dir_length, dir,
+                    CHECKPOINT_PREFIX) >= (int)sizeof(checkpoint_prefix) ||
+        snprintf(history_file, sizeof(history_file), "%.*s%s", dir_length, dir,
+                    HISTORY_FILE) >= (int)sizeof(history_file)) {
+        fprintf(stderr, "Database path is too long: %s\n", settings.database_file);
+        return 0;
     }
-    exit(0);
+    return 1;
 }
 
 
-int main(void) {
+int main(int argc, char **argv) {
+    // The configuration file is read first, so flags override the settings in it
+    int opt;
+    while ((opt = getopt(argc, argv, OPTION_FLAGS)) != -1) {
+        if (opt == '?') {
+            usage(argv[0]);
+            return 0;
+        }
+        if (opt == 'C' && !load_config(optarg)) {
+            return 0;
+        }
+    }
+    optind = 1;
+    while ((opt = getopt(argc, argv, OPTION_FLAGS)) != -1) {
+        for (int i = 0; i < OPTION_COUNT; i++) {
+            if (options[i].flag == opt && !set_option(options[i].name, optarg)) {
+                return 0;
+            }
+        }
+    }
+    if (!check_desk_settings() || !set_data_paths()) {
+        return 0;
+    }
+
+    // From here on everything is logged; lines are written out by the log's own thread
+    if (!log_open(settings.log_file[0] ? settings.log_file : NULL, settings.log_level)) {
+        return 0;
+    }
+
+    // Starting from an empty database next to an old text one would lose every account
+    if (access(settings.database_file, F_OK) == -1 && access(text_database_file, F_OK) == 0) {
+        LOG(LOG_ERROR, "Found %s but no %s. Convert it first with: ./build/db_convert %s %s",
+                text_database_file, settings.database_file, text_database_file, settings.database_file);
+        return 0;
+    }
+
     // Open database in append mode to create it if it doesn't exist, but if it does, not overwrite anything.
-    FILE *file = fopen(DATABASE_FILE, "a+");
+    FILE *file = fopen(settings.database_file, "a+");
     if (file == NULL){
-        fprintf(stderr, "Failed to open database file");
+        LOG(LOG_ERROR, "Failed to open database file");
+        return 0;
     }
     fclose(file);
 
-    // Load accounts from database to memory.
-    acc_count = load_accounts(&accounts, DATABASE_FILE);
+    // Load accounts from database to memory, then the incremental checkpoints taken after it.
+    uint64_t snapshot_lsn;
+    uint64_t snapshot_epoch;
+    int64_t deposits;
+    int acc_count = load_accounts(&accounts, settings.database_file, &snapshot_lsn, &snapshot_epoch, &deposits);
 
     if ( acc_count == -1) {
-        fprintf(stderr, "Failed to load accounts from database\n");
+        LOG(LOG_ERROR, "Failed to load accounts from database");
         return 0;
     }
     if (acc_count == 0) {
-        printf("Database is initially empty. No accounts to load.\n");
+        LOG(LOG_INFO, "Database is initially empty. No accounts to load.");
     }
-    printf("\n");
+    else {
+        LOG(LOG_INFO, "Loaded %d accounts from %s.", acc_count, settings.database_file);
+    }
+    int checkpoints = load_checkpoints(&accounts, checkpoint_prefix, &snapshot_lsn, &snapshot_epoch, &deposits);
+    if (checkpoints == -1) {
+        LOG(LOG_ERROR, "Failed to load checkpoints");
+        return 0;
+    }
+    if (checkpoints > 0) {
+        LOG(LOG_INFO, "Applied %d incremental checkpoints up to epoch %" PRIu64 ".", checkpoints, snapshot_epoch);
+    }
+    set_deposits(deposits);
 
-    // Open log file to write account operations to log
-    log_file = fopen("log.txt", "a");
-    if (log_file == NULL) {
-        fprintf(stderr, "Failed to open log file\n");
+    // Statements are saved with full snapshots only; the journal has the changes since
+    uint64_t history_lsn;
+    int changes = load_history(&accounts, history_file, &history_lsn);
+    if (changes == -1) {
+        LOG(LOG_WARNING, "Account history is damaged, statements start over");
+    }
+    else if (changes > 0) {
+        LOG(LOG_INFO, "Loaded %d account changes for statements.", changes);
+    }
+
+    // Redo the operations journaled after the snapshot was saved. After a clean shutdown
+    // there are none, after a crash these are everything since the last save. Replay starts
+    // earlier if the statements are older, as they are after incremental checkpoints; their
+    // epochs keep the records the snapshot has from changing balances twice. A replica
+    // replays all of its journal, which keeps the prepare records of transactions still
+    // prepared at its checkpoint, see take_checkpoint.
+    history_saved_lsn = history_lsn;
+    uint64_t replay_lsn = history_lsn < snapshot_lsn ? history_lsn : snapshot_lsn;
+    if (settings.primary_socket[0]) {
+        replay_lsn = 0;
+    }
+    struct timespec replay_start, replay_end;
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    struct Replay_state replay = { &accounts, snapshot_epoch, snapshot_epoch, snapshot_lsn, history_lsn, 0, NULL, 0 };
+    long replayed = journal_replay(journal_prefix, replay_lsn, UINT64_MAX, replay_record, &replay);
+    clock_gettime(CLOCK_MONOTONIC, &replay_end);
+    if (replayed == -1 || replay.damaged) {
+        LOG(LOG_ERROR, "Failed to replay journal");
         return 0;
     }
+    if (prepared_count > 0) {
+        LOG(LOG_INFO, "%d transactions between shards are prepared and wait for their coordinator.", prepared_count);
+    }
+    if (replayed > 0) {
+        LOG(LOG_INFO, "Replayed %ld journal records after LSN %lu in %.3f s.", replayed, (unsigned long)replay_lsn,
+                (replay_end.tv_sec - replay_start.tv_sec) + (replay_end.tv_nsec - replay_start.tv_nsec) / 1e9);
+    }
 
-    // Init message queues for service desks to queue clients.
-    for (int i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
-        message_queues[i] = msgget(MESSAGE_QUEUE_KEY + i, IPC_CREAT | 0644);
+    // A replica continues from the end of its own copy of the primary's journal, or from a
+    // snapshot the primary sends
+    if (settings.primary_socket[0] && !start_following(&replay, &snapshot_lsn)) {
+        return 0;
+    }
 
-        if (message_queues[i] == -1) {
-            fprintf(stderr, "Failed to open message queue\n");
-            return 0;
-        }
-        printf("Queue for service desk %d initialized.\n", i);
+    // Continue after every epoch in use before, so new journal records sort after them
+    set_epoch(replay.last_epoch + 1);
+
+    // Count account lock waits from here on; replay took the locks single-threaded
+    metrics_init();
+    set_lock_observer(metrics_lock_wait);
+    set_hot_contention(settings.hot_contention);
+
+    // Only the main thread, which never changes accounts or writes the journal, may take the
+    // shutdown signals and run handle_shutdown. Threads started from here on inherit the
+    // blocked signals.
+    sigset_t shutdown_signals, main_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &main_signals);
+
+    // Open the journal that account operations are written to before they are confirmed
+    if (!journal_open(&journal, journal_prefix, snapshot_lsn, settings.group_size, settings.group_delay_us)) {
+        LOG(LOG_ERROR, "Failed to open journal");
+        return 0;
+    }
+
+    // Init the queues clients wait in for the service desks, one for every desk there may be
+    desk_queues = aligned_alloc(CACHE_LINE, settings.max_desks * sizeof(struct Client_deque));
+    desk_busy = malloc(settings.max_desks * sizeof(atomic_int));
+    desk_open = malloc(settings.max_desks * sizeof(atomic_int));
+    if (!desk_queues || !desk_busy || !desk_open) {
+        LOG(LOG_ERROR, "Failed to allocate desk queues");
+        return 0;
     }
+    for (int i = 0; i < settings.max_desks; i++) {
+        init_client_deque(&desk_queues[i]);
+        atomic_init(&desk_busy[i], 0);
+        atomic_init(&desk_open[i], 0);
+    }
+    sem_init(&clients_waiting, 0, 0);
 
     struct sockaddr_un address;
-    int sock, conn;
+    int conn;
     socklen_t addrLength;
 
     // Init unix domain socket for ipc between server and clients
     sock = socket(PF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
-        fprintf(stderr, "Socket creation failed\n");
+        LOG(LOG_ERROR, "Socket creation failed");
         return 0;
     }
 
     // Remove any preexisting socket
-    unlink(SOCKET_PATH);
+    unlink(settings.socket_path);
 
     address.sun_family = AF_UNIX;  // Unix domain socket
-    strcpy(address.sun_path, SOCKET_PATH);
+    strcpy(address.sun_path, settings.socket_path);
 
     addrLength = sizeof(address.sun_family) + strlen(address.sun_path);
 
     // Bind socket to socket name
     if (bind(sock, (struct sockaddr*)&address, addrLength) < 0) {
-        fprintf(stderr, "Bind failed\n");
+        LOG(LOG_ERROR, "Bind failed");
         close(sock);
         return 0;
     }
 
-    // Listen for connections
-    if (listen(sock, 5) < 0) {
-        fprintf(stderr, "Listen failed\n");
+    // Listen for connections. Event loop workers take clients in as fast as they connect,
+    // so unless configured otherwise the kernel may keep as many pending connections as it allows.
+    int backlog = settings.backlog > 0 ? settings.backlog : event_workers > 0 ? SOMAXCONN : LISTEN_BACKLOG;
+    if (listen(sock, backlog) < 0) {
+        LOG(LOG_ERROR, "Listen failed");
         close(sock);
         return 0;
     }
 
-    printf("\nServer listening on %s\n\n", SOCKET_PATH);
+    LOG(LOG_INFO, "Server listening on %s", settings.socket_path);
+    if (settings.shard_count > 1) {
+        LOG(LOG_INFO, "Shard %d of %d: accounts whose id %% %d is %d.", settings.shard_index, settings.shard_count,
+                settings.shard_count, settings.shard_index);
+    }
 
-    // Handle SIGINT and SIGTERM gracefully by calling the handle_shutdown-function
-    signal(SIGINT, handle_shutdown);
-    signal(SIGTERM, handle_shutdown);
+    // Handle SIGINT and SIGTERM gracefully: the main thread runs handle_shutdown once
+    // request_shutdown interrupts its accept
+    struct sigaction shutdown_action = {.sa_handler = request_shutdown};
+    sigemptyset(&shutdown_action.sa_mask);
+    sigaction(SIGINT, &shutdown_action, NULL);
+    sigaction(SIGTERM, &shutdown_action, NULL);
 
-    // Initialize the service desks (threads)
-    for (int i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
-        int* desk_id = malloc(sizeof(int));
-        *desk_id = i;
-        pthread_t desk_thread;
-        pthread_create(&desk_thread, NULL, service_desk, desk_id);
-        pthread_detach(desk_thread);
+    // A client that leaves before reading its replies must only fail the write to it
+    signal(SIGPIPE, SIG_IGN);
+
+    start_admin_server();
+    if (settings.replication_socket[0] && !start_replication_server()) {
+        return 0;
+    }
+
+    // A replica takes no checkpoints until it is promoted
+    if (atomic_load(&following)) {
+        replica_state = replay;
+        pthread_create(&replicator_thread, NULL, replicator, &replica_state);
+        LOG(LOG_INFO, "Replica of %s after LSN %" PRIu64 ", read-only until promoted.",
+                settings.primary_socket, replay.last_lsn);
+    }
+    else {
+        start_checkpointer();
+    }
+
+    if (event_workers > 0) {
+        // Initialize the event loop workers (threads), each with its own epoll instance
+        for (int i = 0; i < event_workers; i++) {
+            if (!init_worker(&workers[i])) {
+                return 0;
+            }
+            int* worker_id = malloc(sizeof(int));
+            *worker_id = i;
+            pthread_t worker_thread;
+            pthread_create(&worker_thread, NULL, event_worker, worker_id);
+            pthread_detach(worker_thread);
+        }
+        pthread_sigmask(SIG_SETMASK, &main_signals, NULL);
+
+        // Accept new clients and spread them over the workers in turns
+        for (int next = 0; ; next = (next + 1) % event_workers) {
+            conn = accept_client(&address, &addrLength);
+            if (conn > 0) {
+                assign_to_worker(conn, next, metrics_now());
+            }
+        }
+    }
+
+    // Initialize the service desks (threads), and the manager that adapts their count if it may change
+    for (int i = 0; i < settings.desks; i++) {
+        open_desk();
+    }
+    if (settings.max_desks > settings.min_desks) {
+        LOG(LOG_INFO, "Desks adapt between %d and %d to a wait of %d ms.",
+                settings.min_desks, settings.max_desks, settings.desk_wait_target_ms);
+        pthread_t manager_thread;
+        pthread_create(&manager_thread, NULL, desk_manager, NULL);
+        pthread_detach(manager_thread);
     }
+    pthread_sigmask(SIG_SETMASK, &main_signals, NULL);
 
+    int *queue_lengths = malloc(settings.max_desks * sizeof(int));
+    if (!queue_lengths) {
+        LOG(LOG_ERROR, "Failed to allocate queue lengths");
+        return 0;
+    }
 
     while (1) {
         // Accept new clients and send them so shortest queue
-        conn = accept(sock, (struct sockaddr*)&address, &addrLength);
+        conn = accept_client(&address, &addrLength);
         if (conn > 0) {
-            printf("Client connected\n");
+            LOG(LOG_DEBUG, "Client connected");
 
-            // Lock the queue mutex and find shortest queue.
-            pthread_mutex_lock(&queue_mutex);
-            int shortest_q = shortest_queue(queue_lengths, MAX_ACTIVE_CLIENTS);
-            pthread_mutex_unlock(&queue_mutex);
+            // Queue the client at the open desk with the least clients. Any idle desk may take
+            // it from there, so this only matters while every desk is busy.
+            for (int i = 0; i < settings.max_desks; i++) {
+                queue_lengths[i] = atomic_load(&desk_open[i]) ?
+                        deque_length(&desk_queues[i]) + atomic_load(&desk_busy[i]) : INT_MAX;
+            }
+            int shortest_q = shortest_queue(queue_lengths, settings.max_desks);
 
-            struct Client_message msg;
-            msg.mtype = 1;
-            msg.client_socket = conn;
+            struct Client_message *msg = malloc(sizeof(struct Client_message));
+            if (!msg) {
+                LOG(LOG_ERROR, "Failed to allocate client");
+                close(conn);
+                continue;
+            }
+            msg->client_socket = conn;
+            msg->accepted_ns = metrics_now();
 
-            printf("Assigning client %d to queue %d\n", conn, shortest_q);
+            LOG(LOG_DEBUG, "Assigning client %d to queue %d", conn, shortest_q);
 
-            // Send the client socket to the shortest queue
-            if (msgsnd(message_queues[shortest_q], &msg, sizeof(msg), 0) == -1) {
-                fprintf(stderr, "Failed to add client to queue %d\n", shortest_q);
+            if (!deque_push(&desk_queues[shortest_q], msg)) {
+                LOG(LOG_ERROR, "Failed to add client to queue %d", shortest_q);
                 close(conn);
-            } else {
-                // Lock the queue mutex to increase the queue size.
-                pthread_mutex_lock(&queue_mutex);
-                queue_lengths[shortest_q]++;
-                pthread_mutex_unlock(&queue_mutex);
-            }   
+                free(msg);
+                continue;
+            }
+            sem_post(&clients_waiting);
         }
     }
 
     // This part of the code should never be reached, but just in case handle the shutdown correctly.
-    handle_shutdown(SIGINT); 
+    handle_shutdown();
     return 0; 
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 202009L
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,9 +6,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <signal.h>
+#include <time.h>
+#include <poll.h>
 
-#define BUFSIZE 255
+#include "bank_helper.h"
+
+#define BUFSIZE 1024        // Longest reply line
+#define LINE_SIZE 4096      // Longest command line, as much as the server reads at once
 #define SOCKET_PATH "/tmp/bank-socket"
+#define PIPELINE_DEPTH 512  // Commands a batch client sends ahead of their replies
+#define RING_CHECK_MS 100   // How often a shared memory client checks the server is still there
 int sock;
 
 // Helper function to send message to server using socket
@@ -19,15 +27,27 @@ void send_to_server(int sock, const char *message) {
     }
 }
 
-// Helper function to receive messages from server from socket.
+// Helper function to read a reply line from server from socket into buffer.
+void read_from_server(int sock, char *buffer, size_t size) {
+    size_t length = 0;
+    while (length == 0 || (buffer[length - 1] != '\n' && length < size - 1)) {
+        ssize_t n = read(sock, buffer + length, size - 1 - length);
+        if (n < 0) {
+            fprintf(stderr, "Failed to receive message from server\n");
+            exit(1);
+        }
+        if (n == 0) {
+            break;
+        }
+        length += n;
+    }
+    buffer[length] = '\0';
+}
+
+// Helper function to receive a reply line from server from socket.
 void receive_from_server(int sock) {
     char buffer[BUFSIZE];
-    ssize_t n = read(sock, buffer, sizeof(buffer) - 1);
-    if (n < 0) {
-        fprintf(stderr, "Failed to receive message from server\n");
-        exit(1);
-    }
-    buffer[n] = '\0';
+    read_from_server(sock, buffer, sizeof(buffer));
     printf("%s", buffer);
 }
 
@@ -43,10 +63,253 @@ void handle_sigint(int sig) {
 }
  
 
+// Send commands from stdin without waiting for each reply, keeping up to PIPELINE_DEPTH
+// of them in flight, and print the replies as they arrive. The server answers in order,
+// so counting reply lines tells how many commands are still on their way.
+// Returns the amount of commands sent, or -1 if the connection broke.
+long run_batch(int sock) {
+    char line[LINE_SIZE];
+    char *pending = malloc(PIPELINE_DEPTH * LINE_SIZE);
+    char replies[16384];
+    long sent = 0;
+    long answered = 0;
+    int input_done = 0;
+
+    if (!pending) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    while (!input_done || answered < sent) {
+        // Top up the commands in flight in one write
+        size_t pending_len = 0;
+        while (!input_done && sent - answered < PIPELINE_DEPTH) {
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                input_done = 1;
+                break;
+            }
+            if (line[0] == '\n') {
+                continue;
+            }
+            size_t len = strlen(line);
+            if (line[len - 1] != '\n') {
+                line[len++] = '\n';
+            }
+            memcpy(pending + pending_len, line, len);
+            pending_len += len;
+            sent++;
+        }
+        for (size_t written = 0; written < pending_len; ) {
+            ssize_t n = write(sock, pending + written, pending_len - written);
+            if (n < 0) {
+                free(pending);
+                return -1;
+            }
+            written += n;
+        }
+
+        if (answered == sent) {
+            continue;
+        }
+        ssize_t n = read(sock, replies, sizeof(replies));
+        if (n <= 0) {
+            free(pending);
+            return -1;
+        }
+        fwrite(replies, 1, n, stdout);
+        for (ssize_t i = 0; i < n; i++) {
+            answered += replies[i] == '\n';
+        }
+    }
+
+    free(pending);
+    return sent;
+}
+
+
+// Turn a command line into a binary request. A command that doesn't parse gets account -1,
+// which the server answers as invalid input, so its reply still comes in order.
+static void parse_request(const char *line, struct Wire_request *request) {
+    char amount_text[AMOUNT_TEXT];
+    int ok = 1;
+
+    memset(request, 0, sizeof(*request));
+    request->operation = line[0];
+    request->dest_id = -1;
+    switch (line[0]) {
+        case 'l':
+            ok = sscanf(line + 1, "%d", &request->account_id) == 1;
+            break;
+        case 'w':
+        case 'd':
+            ok = sscanf(line + 1, "%d %31s", &request->account_id, amount_text) == 2 &&
+                 parse_amount(amount_text, &request->amount);
+            break;
+        case 't':
+            ok = sscanf(line + 1, "%d %d %31s", &request->account_id, &request->dest_id, amount_text) == 3 &&
+                 parse_amount(amount_text, &request->amount);
+            break;
+    }
+    if (!ok) {
+        request->account_id = -1;
+    }
+}
+
+
+// Print the response to request the way the server words its text replies.
+static void print_response(const struct Wire_request *request, const struct Wire_response *response) {
+    char amount[AMOUNT_TEXT];
+    switch (response->status) {
+        case WIRE_OK:
+            switch (request->operation) {
+                case 'l':
+                    printf("ok: Account %d balance: %s\n", request->account_id, format_amount(response->value, amount));
+                    break;
+                case 'w':
+                    printf("ok: Withdraw of %s from account %d successful\n", format_amount(request->amount, amount), request->account_id);
+                    break;
+                case 'd':
+                    printf("ok: Deposit of %s to account %d successful\n", format_amount(request->amount, amount), request->account_id);
+                    break;
+                case 't':
+                    printf("ok: Transfer of %s from account %d to account %d successful\n", format_amount(request->amount, amount),
+                            request->account_id, request->dest_id);
+                    break;
+                case 'q':
+                    printf("ok: Closing connection...\n");
+                    break;
+            }
+            break;
+        case WIRE_INVALID:
+            printf("fail: Invalid input\n");
+            break;
+        case WIRE_NO_ACCOUNT:
+            printf("fail: Failed to create or find account\n");
+            break;
+        case WIRE_NO_DEST:
+            printf("fail: Failed to create destination account\n");
+            break;
+        case WIRE_INSUFFICIENT:
+            printf("fail: Insufficient funds\n");
+            break;
+        case WIRE_WRONG_SHARD:
+            printf("fail: Account belongs to another shard\n");
+            break;
+        case WIRE_READ_ONLY:
+            printf("fail: Replica is read-only, send changes to the primary\n");
+            break;
+        case WIRE_BALANCE_LIMIT:
+            printf("fail: Balance limit reached\n");
+            break;
+        default:
+            printf("fail: Unknown operation\n");
+            break;
+    }
+}
+
+
+// Switch to the server's shared memory rings, see struct Ring_segment, and send the commands
+// from stdin through them as binary requests. With pipelined set up to RING_SIZE commands are
+// in flight, otherwise one at a time after a prompt. Waiting for responses polls for poll_us
+// before sleeping. Only the commands the binary protocol has work; batches and balance checks
+// of several accounts need the socket. Returns the amount of commands sent, or -1 if the
+// connection broke.
+long run_ring(int sock, int pipelined, int poll_us) {
+    char reply[BUFSIZE];
+    char name[RING_NAME_SIZE];
+    char line[LINE_SIZE];
+    struct Wire_request requests[RING_SIZE];
+    long sent = 0;
+    long answered = 0;
+    int input_done = 0;
+
+    send_to_server(sock, "m\n");
+    read_from_server(sock, reply, sizeof(reply));
+    if (sscanf(reply, "ok: Shared memory %63s", name) != 1) {
+        printf("%s", reply);
+        return -1;
+    }
+    struct Ring_segment *ring = ring_attach(name);
+    if (!ring) {
+        fprintf(stderr, "Failed to map shared memory %s\n", name);
+        return -1;
+    }
+
+    while (!input_done || answered < sent) {
+        while (!input_done && sent - answered < (pipelined ? RING_SIZE : 1)) {
+            if (!pipelined) {
+                printf("Enter command:\n");
+            }
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                input_done = 1;
+                break;
+            }
+            if (line[0] == '\n') {
+                continue;
+            }
+            struct Wire_request *request = &requests[sent % RING_SIZE];
+            parse_request(line, request);
+            ring_push(&ring->requests, ring->request_entries, sizeof(*request), request);
+            sent++;
+            input_done = request->operation == 'q';
+        }
+        ring_wake(&ring->requests);
+
+        if (answered == sent) {
+            continue;
+        }
+        if (!ring_wait(&ring->responses, poll_us, RING_CHECK_MS)) {
+            struct pollfd socket_state = { sock, POLLIN, 0 };
+            if (poll(&socket_state, 1, 0) != 0) {
+                ring_release(ring);
+                return -1;
+            }
+            continue;
+        }
+        struct Wire_response response;
+        while (ring_pop(&ring->responses, ring->response_entries, sizeof(response), &response)) {
+            print_response(&requests[answered % RING_SIZE], &response);
+            answered++;
+        }
+    }
+
+    ring_release(ring);
+    return sent;
+}
+
+
 // Main client code
+// With -b, commands are read from stdin and pipelined instead of asked for one by one:
+// $ ./build/client -b < commands.txt
+// With -m, commands go through shared memory instead of the socket, and -p <microseconds>
+// sets how long to poll for a response before sleeping.
+// Another argument is the socket path of a server not listening on SOCKET_PATH.
 int main(int argc, char **argv) {
+    int batch = 0;
+    int shared = 0;
+    int poll_us = 0;
+    const char *socket_path = SOCKET_PATH;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            batch = 1;
+        }
+        else if (strcmp(argv[i], "-m") == 0) {
+            shared = 1;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            poll_us = atoi(argv[++i]);
+        }
+        else {
+            socket_path = argv[i];
+        }
+    }
+    if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return -1;
+    }
+
     setvbuf(stdin, NULL, _IOLBF, 0);
-    setvbuf(stdout, NULL, _IOLBF, 0);
+    setvbuf(stdout, NULL, batch ? _IOFBF : _IOLBF, 0);
 
     printf("Connecting to the bank, please wait.\n");
 
@@ -60,7 +323,7 @@ int main(int argc, char **argv) {
     struct sockaddr_un server_addr;
     memset(&server_addr, 0, sizeof(struct sockaddr_un));
     server_addr.sun_family = AF_UNIX;
-    strcpy(server_addr.sun_path, SOCKET_PATH);
+    strcpy(server_addr.sun_path, socket_path);
 
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_un)) < 0) {
         fprintf(stderr, "Failed to connect to server");
@@ -72,7 +335,7 @@ int main(int argc, char **argv) {
     signal(SIGINT, handle_sigint);
 
     int quit = 0;
-    char *buf = malloc(BUFSIZE);
+    char *buf = malloc(LINE_SIZE);
     if (buf == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         close(sock);
@@ -84,10 +347,30 @@ int main(int argc, char **argv) {
     // Wait for "ready"-message from server
     receive_from_server(sock);
 
+    if (batch || shared) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long sent = shared ? run_ring(sock, batch, poll_us) : run_batch(sock);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fflush(stdout);
+        close(sock);
+        free(buf);
+        if (sent < 0) {
+            fprintf(stderr, "Connection to server lost\n");
+            return -1;
+        }
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (batch) {
+            fprintf(stderr, "%ld commands in %.3f s, %.0f per second\n", sent, seconds, sent / seconds);
+        }
+        return 0;
+    }
+
     // Loop to ask client for commands until getting 'q' or SIGINT
     while (!quit) {
         printf("Enter command:\n");
-        if (fgets(buf, BUFSIZE, stdin) == NULL) {
+        if (fgets(buf, LINE_SIZE, stdin) == NULL) {
             break;
         }
 
@@ -120,6 +403,21 @@ int main(int argc, char **argv) {
                 receive_from_server(sock);
                 break;
 
+            case 'a':  // Batch
+                send_to_server(sock, buf);
+                receive_from_server(sock);
+                break;
+
+            case 's':  // Statement
+                send_to_server(sock, buf);
+                receive_from_server(sock);
+                break;
+
+            case 'T':  // Total of all balances and deposits
+                send_to_server(sock, buf);
+                receive_from_server(sock);
+                break;
+
             default:  // Unknown command
                 printf("fail: Unknown command\n");
                 break;
@@ -0,0 +1,54 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bank_helper.h"
+
+// Convert an account database between the text format and the binary one.
+// The direction is picked from the input: a binary database is written out as text,
+// anything else is read as text and written out as binary.
+//
+// $ ./build/db_convert database.txt database.bin
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <input database> <output database>\n", argv[0]);
+        return 1;
+    }
+
+    // Look at the magic to see which way to convert
+    char magic[sizeof(DATABASE_MAGIC) - 1] = {0};
+    FILE *input = fopen(argv[1], "r");
+    if (!input) {
+        fprintf(stderr, "Failed to open database file: %s\n", argv[1]);
+        return 1;
+    }
+    int binary = fread(magic, 1, sizeof(magic), input) == sizeof(magic) &&
+                    memcmp(magic, DATABASE_MAGIC, sizeof(magic)) == 0;
+    fclose(input);
+
+    struct Account_store store;
+    uint64_t snapshot_lsn;
+    uint64_t epoch;
+    int64_t deposits;
+    int count = binary ? load_accounts(&store, argv[1], &snapshot_lsn, &epoch, &deposits)
+                       : load_accounts_text(&store, argv[1], &snapshot_lsn, &epoch, &deposits);
+    if (count == -1) {
+        fprintf(stderr, "Failed to load accounts from %s\n", argv[1]);
+        return 1;
+    }
+
+    // Nothing changes the accounts here, so the loaded epoch's balances are the current ones
+    int saved = binary ? save_accounts_text(&store, argv[2], snapshot_lsn, epoch, deposits)
+                       : save_accounts(&store, argv[2], snapshot_lsn, epoch, epoch, deposits, 0);
+    destroy_account_store(&store);
+    if (!saved) {
+        fprintf(stderr, "Failed to save accounts to %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("Converted %d accounts from %s to %s (%s).\n", count, argv[1], argv[2], binary ? "text" : "binary");
+    return 0;
+}
@@ -0,0 +1,741 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "bank_helper.h"
+#include "journal.h"
+#include "metrics.h"
+
+// Records are written as they are laid out in memory, which bank_helper.h requires to be
+// little-endian.
+
+// CRC-32 of a record, covering everything before the checksum field.
+static uint32_t record_checksum(const struct Journal_record *record) {
+    return crc32_update(0, record, offsetof(struct Journal_record, checksum));
+}
+
+
+// Write the whole buffer, continuing after partial writes and signals.
+static int write_all(int fd, const void *buffer, size_t size) {
+    const char *bytes = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return 1;
+}
+
+
+// Check that an existing journal file was written by this version of the journal.
+static int check_header(int fd) {
+    struct Journal_header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != JOURNAL_VERSION || header.record_size != sizeof(struct Journal_record)) {
+        fprintf(stderr, "Journal file has an unknown format\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+// Open the segment file that starts at first_lsn, creating it with a header if needed,
+// and make it the one the writer appends to.
+static int open_segment(struct Journal *journal, uint64_t first_lsn) {
+    char path[300];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s.%016" PRIx64, journal->prefix, first_lsn);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Failed to open journal segment: %s\n", path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    if (st.st_size == 0) {
+        struct Journal_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.version = JOURNAL_VERSION;
+        header.record_size = sizeof(struct Journal_record);
+        // The segment must survive a crash before any of its records can count as durable
+        if (!write_all(fd, &header, sizeof(header)) || fdatasync(fd) == -1) {
+            close(fd);
+            return 0;
+        }
+        sync_parent_dir(path);
+        st.st_size = sizeof(header);
+    }
+
+    journal->fd = fd;
+    journal->segment_size = st.st_size;
+    return 1;
+}
+
+
+// Find the last valid record of an existing segment, so numbering continues from it.
+// A torn record at the end, left by a crash in the middle of a write, is cut off.
+// last_lsn is left alone if the segment has no records.
+static int find_last_lsn(int fd, uint64_t *last_lsn) {
+    struct stat st;
+    struct Journal_header header;
+    struct Journal_record record;
+
+    if (fstat(fd, &st) == -1 || !check_header(fd)) {
+        return 0;
+    }
+
+    off_t records = (st.st_size - sizeof(header)) / sizeof(record);
+    while (records > 0) {
+        off_t offset = sizeof(header) + (records - 1) * sizeof(record);
+        if (pread(fd, &record, sizeof(record), offset) == sizeof(record) &&
+            record.checksum == record_checksum(&record)) {
+            *last_lsn = record.lsn;
+            break;
+        }
+        records--;
+    }
+    return ftruncate(fd, sizeof(header) + records * sizeof(record)) == 0;
+}
+
+
+// Move records that producers have finished from the ring to batch, in ticket order.
+static int take_records(struct Journal *journal, struct Journal_record *batch, int max) {
+    int n = 0;
+    while (n < max) {
+        struct Journal_cell *cell = &journal->ring[journal->read_ticket & (JOURNAL_RING_SIZE - 1)];
+        if (atomic_load(&cell->seq) != journal->read_ticket + 1) {
+            break;
+        }
+        batch[n++] = cell->record;
+        atomic_store_explicit(&cell->seq, journal->read_ticket + JOURNAL_RING_SIZE, memory_order_release);
+        journal->read_ticket++;
+    }
+    return n;
+}
+
+
+// Writer thread. Takes a group of records from the ring, writes it with a single write
+// and fdatasync, then releases everyone waiting for those records to be durable.
+static void *journal_writer(void *arg) {
+    struct Journal *journal = arg;
+    struct Journal_record *batch = malloc(journal->group_size * sizeof(struct Journal_record));
+    if (!batch) {
+        fprintf(stderr, "Failed to allocate journal batch\n");
+        return NULL;
+    }
+
+    while (1) {
+        int n = take_records(journal, batch, journal->group_size);
+
+        if (n == 0) {
+            // Stop only once every ticket handed out has been written
+            if (atomic_load(&journal->stopping) && journal->read_ticket == atomic_load(&journal->next_ticket)) {
+                break;
+            }
+
+            // Nothing to write; sleep until a producer wakes us up. The flag is set before
+            // checking the ring once more, so a record published meanwhile isn't missed.
+            pthread_mutex_lock(&journal->mutex);
+            atomic_store(&journal->writer_idle, 1);
+            if (atomic_load(&journal->ring[journal->read_ticket & (JOURNAL_RING_SIZE - 1)].seq) != journal->read_ticket + 1 &&
+                !atomic_load(&journal->stopping)) {
+                pthread_cond_wait(&journal->work_ready, &journal->mutex);
+            }
+            atomic_store(&journal->writer_idle, 0);
+            pthread_mutex_unlock(&journal->mutex);
+            continue;
+        }
+
+        // A short group waits a moment for more records, trading commit latency for fewer syncs
+        if (n < journal->group_size && journal->group_delay_us > 0) {
+            struct timespec delay = { 0, journal->group_delay_us * 1000L };
+            nanosleep(&delay, NULL);
+            n += take_records(journal, batch + n, journal->group_size - n);
+        }
+
+        // Start a new segment when this one is full or a checkpoint wants the old one closed.
+        // Everything in the old segment is already synced, so it is simply closed.
+        size_t bytes = n * sizeof(struct Journal_record);
+        if (journal->segment_size > (off_t)sizeof(struct Journal_header) &&
+            (journal->segment_size + (off_t)bytes > JOURNAL_SEGMENT_BYTES || atomic_exchange(&journal->rotate_requested, 0))) {
+            int old_fd = journal->fd;
+            if (!open_segment(journal, batch[0].lsn)) {
+                exit(1);
+            }
+            close(old_fd);
+        }
+
+        uint64_t write_start = metrics_now();
+        if (!write_all(journal->fd, batch, bytes) || fdatasync(journal->fd) == -1) {
+            // Replies wait for durability, so there is no safe way to continue
+            fprintf(stderr, "Failed to write journal: %s\n", strerror(errno));
+            exit(1);
+        }
+        metrics_journal_write(n, metrics_now() - write_start);
+        journal->segment_size += bytes;
+
+        pthread_mutex_lock(&journal->mutex);
+        atomic_store(&journal->durable_lsn, batch[n - 1].lsn);
+        pthread_cond_broadcast(&journal->durable);
+        pthread_mutex_unlock(&journal->mutex);
+
+        uint64_t one = 1;
+        for (int i = 0; i < journal->watcher_count; i++) {
+            write(journal->watchers[i], &one, sizeof(one));
+        }
+    }
+
+    free(batch);
+    return NULL;
+}
+
+
+// Open the last journal segment, or create the first one, and start the writer thread.
+// New records are numbered after both the last record in the journal and min_lsn, so they
+// always sort after a snapshot even if the journal files were removed.
+// group_size records at most go to disk with one fdatasync; a group that isn't full waits
+// group_delay_us microseconds for more records before it is written.
+int journal_open(struct Journal *journal, const char *prefix, uint64_t min_lsn,
+                    int group_size, int group_delay_us) {
+    uint64_t *segments;
+    uint64_t last_lsn = min_lsn;
+
+    snprintf(journal->prefix, sizeof(journal->prefix), "%s", prefix);
+    atomic_init(&journal->rotate_requested, 0);
+
+    int count = list_numbered_files(prefix, &segments);
+    if (count == -1) {
+        fprintf(stderr, "Failed to list journal segments: %s\n", prefix);
+        return 0;
+    }
+    if (count == 0) {
+        if (!open_segment(journal, last_lsn + 1)) {
+            return 0;
+        }
+    }
+    else {
+        uint64_t segment_last = segments[count - 1] - 1;
+        if (!open_segment(journal, segments[count - 1]) || !find_last_lsn(journal->fd, &segment_last)) {
+            free(segments);
+            return 0;
+        }
+        if (segment_last > last_lsn) {
+            last_lsn = segment_last;
+        }
+    }
+    free(segments);
+
+    journal->ring = malloc(JOURNAL_RING_SIZE * sizeof(struct Journal_cell));
+    if (!journal->ring) {
+        fprintf(stderr, "Failed to allocate journal ring\n");
+        close(journal->fd);
+        return 0;
+    }
+    for (uint64_t i = 0; i < JOURNAL_RING_SIZE; i++) {
+        atomic_init(&journal->ring[i].seq, i);
+    }
+
+    journal->group_size = group_size > 0 ? group_size : 1;
+    journal->group_delay_us = group_delay_us > 0 ? group_delay_us : 0;
+    atomic_init(&journal->first_lsn, last_lsn + 1);
+    atomic_init(&journal->next_ticket, 0);
+    journal->read_ticket = 0;
+    atomic_init(&journal->durable_lsn, last_lsn);
+    atomic_init(&journal->stopping, 0);
+    atomic_init(&journal->writer_idle, 0);
+    journal->watcher_count = 0;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->work_ready, NULL);
+    pthread_cond_init(&journal->durable, NULL);
+
+    if (pthread_create(&journal->writer, NULL, journal_writer, journal) != 0) {
+        fprintf(stderr, "Failed to start journal writer\n");
+        free(journal->ring);
+        close(journal->fd);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Add an operation made in given epoch to the journal and return its LSN. Doesn't wait for
+// the disk; call journal_wait with the LSN before telling the client the operation succeeded.
+uint64_t journal_append(struct Journal *journal, uint64_t epoch, char operation,
+                        int account_id, int dest_id, int64_t amount) {
+    uint64_t ticket = atomic_fetch_add(&journal->next_ticket, 1);
+    uint64_t lsn = atomic_load_explicit(&journal->first_lsn, memory_order_relaxed) + ticket;
+    struct Journal_cell *cell = &journal->ring[ticket & (JOURNAL_RING_SIZE - 1)];
+
+    // If the ring is full, wait for the writer to free this cell
+    while (atomic_load_explicit(&cell->seq, memory_order_acquire) != ticket) {
+        sched_yield();
+    }
+
+    memset(&cell->record, 0, sizeof(cell->record));
+    cell->record.lsn = lsn;
+    cell->record.epoch = epoch;
+    cell->record.account_id = account_id;
+    cell->record.dest_id = dest_id;
+    cell->record.amount = amount;
+    cell->record.operation = operation;
+    cell->record.checksum = record_checksum(&cell->record);
+    atomic_store(&cell->seq, ticket + 1);
+
+    if (atomic_load(&journal->writer_idle)) {
+        pthread_mutex_lock(&journal->mutex);
+        pthread_cond_signal(&journal->work_ready);
+        pthread_mutex_unlock(&journal->mutex);
+    }
+    return lsn;
+}
+
+
+// Fill count consecutive ring slots starting with the record operation, then the legs.
+// A batch's first leg is the record itself, while a transaction record has a header slot
+// holding its id before its legs. Returns the LSN of the last slot.
+static uint64_t append_group(struct Journal *journal, uint64_t epoch, char operation, uint64_t transaction,
+                                const struct Batch_leg *legs, int count) {
+    int header = operation != 'a';
+    int slots = count + header;
+    uint64_t first = atomic_fetch_add(&journal->next_ticket, slots);
+    uint64_t first_lsn = atomic_load_explicit(&journal->first_lsn, memory_order_relaxed) + first;
+
+    for (int i = 0; i < slots; i++) {
+        uint64_t ticket = first + i;
+        struct Journal_cell *cell = &journal->ring[ticket & (JOURNAL_RING_SIZE - 1)];
+        while (atomic_load_explicit(&cell->seq, memory_order_acquire) != ticket) {
+            sched_yield();
+        }
+
+        memset(&cell->record, 0, sizeof(cell->record));
+        cell->record.lsn = first_lsn + i;
+        cell->record.epoch = epoch;
+        cell->record.dest_id = slots - 1 - i;
+        if (header && i == 0) {
+            cell->record.account_id = -1;
+            cell->record.amount = (int64_t)transaction;
+        }
+        else {
+            cell->record.account_id = legs[i - header].account_id;
+            cell->record.amount = legs[i - header].amount;
+        }
+        cell->record.operation = i == 0 ? operation : 'A';
+        cell->record.checksum = record_checksum(&cell->record);
+        atomic_store(&cell->seq, ticket + 1);
+    }
+
+    if (atomic_load(&journal->writer_idle)) {
+        pthread_mutex_lock(&journal->mutex);
+        pthread_cond_signal(&journal->work_ready);
+        pthread_mutex_unlock(&journal->mutex);
+    }
+    return first_lsn + slots - 1;
+}
+
+
+// Add a batch made in given epoch to the journal as one record spanning a slot per leg.
+// The slots get consecutive LSNs, so nothing else can come between them. Returns the LSN
+// of the last slot; the batch is durable once that is.
+uint64_t journal_append_batch(struct Journal *journal, uint64_t epoch,
+                                const struct Batch_leg *legs, int count) {
+    return append_group(journal, epoch, 'a', 0, legs, count);
+}
+
+
+// Add a step of a transaction between shards, see JOURNAL_PREPARE, as one record: a header
+// slot with the transaction id, then a slot per leg. Returns the LSN of the last slot.
+uint64_t journal_append_transaction(struct Journal *journal, uint64_t epoch, char operation,
+                                    uint64_t transaction, const struct Batch_leg *legs, int count) {
+    return append_group(journal, epoch, operation, transaction, legs, count);
+}
+
+
+// Append a record taken from another server's journal, see the replicator in the server.
+// It keeps its LSN, which may be past the next one here; a record this journal already has
+// is skipped. Only one thread may copy, and nothing else may append meanwhile.
+// Returns 0 if the record is damaged.
+int journal_copy(struct Journal *journal, const struct Journal_record *record) {
+    uint64_t next = journal_next_lsn(journal);
+    if (record->lsn < next) {
+        return 1;
+    }
+    if (record->checksum != record_checksum(record)) {
+        return 0;
+    }
+    // The slots of a group the other journal lost in a crash were never sent; their LSNs
+    // are skipped here too
+    if (record->lsn > next) {
+        atomic_fetch_add(&journal->first_lsn, record->lsn - next);
+    }
+
+    uint64_t ticket = atomic_fetch_add(&journal->next_ticket, 1);
+    struct Journal_cell *cell = &journal->ring[ticket & (JOURNAL_RING_SIZE - 1)];
+    while (atomic_load_explicit(&cell->seq, memory_order_acquire) != ticket) {
+        sched_yield();
+    }
+    cell->record = *record;
+    atomic_store(&cell->seq, ticket + 1);
+
+    if (atomic_load(&journal->writer_idle)) {
+        pthread_mutex_lock(&journal->mutex);
+        pthread_cond_signal(&journal->work_ready);
+        pthread_mutex_unlock(&journal->mutex);
+    }
+    return 1;
+}
+
+
+// LSN the next appended record will get.
+uint64_t journal_next_lsn(struct Journal *journal) {
+    return atomic_load(&journal->first_lsn) + atomic_load(&journal->next_ticket);
+}
+
+
+// Highest LSN that has reached the disk. Every record before it is on disk as well.
+uint64_t journal_durable_lsn(struct Journal *journal) {
+    return atomic_load(&journal->durable_lsn);
+}
+
+
+// Block until the record with given LSN is durable.
+void journal_wait(struct Journal *journal, uint64_t lsn) {
+    if (atomic_load(&journal->durable_lsn) >= lsn) {
+        return;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    while (atomic_load(&journal->durable_lsn) < lsn) {
+        pthread_cond_wait(&journal->durable, &journal->mutex);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+
+// Like journal_wait, but gives up at deadline, a CLOCK_REALTIME time. Returns 0 if the
+// record isn't durable by then.
+int journal_wait_until(struct Journal *journal, uint64_t lsn, const struct timespec *deadline) {
+    if (atomic_load(&journal->durable_lsn) >= lsn) {
+        return 1;
+    }
+    int timed_out = 0;
+    pthread_mutex_lock(&journal->mutex);
+    while (atomic_load(&journal->durable_lsn) < lsn && !timed_out) {
+        timed_out = pthread_cond_timedwait(&journal->durable, &journal->mutex, deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return atomic_load(&journal->durable_lsn) >= lsn;
+}
+
+
+// Register an eventfd that the writer signals after every group it makes durable.
+// Must be called before any records are appended.
+int journal_add_watcher(struct Journal *journal, int event_fd) {
+    if (journal->watcher_count == JOURNAL_MAX_WATCHERS) {
+        return 0;
+    }
+    journal->watchers[journal->watcher_count++] = event_fd;
+    return 1;
+}
+
+
+// Ask the writer to put the next group in a new segment, so the current one can be
+// deleted once a checkpoint covers it.
+void journal_rotate(struct Journal *journal) {
+    atomic_store(&journal->rotate_requested, 1);
+}
+
+
+// Delete the segments whose records all have LSNs below below_lsn. The last segment is
+// always kept, since the writer appends to it. Returns 0 if the segments can't be listed.
+int journal_truncate(struct Journal *journal, uint64_t below_lsn) {
+    uint64_t *segments;
+    int count = list_numbered_files(journal->prefix, &segments);
+    if (count == -1) {
+        return 0;
+    }
+
+    char path[300];
+    int removed = 0;
+    // A segment ends right before the next one starts
+    for (int i = 0; i + 1 < count && segments[i + 1] <= below_lsn; i++) {
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, journal->prefix, segments[i]);
+        if (unlink(path) == 0) {
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        sync_parent_dir(path);
+    }
+    free(segments);
+    return 1;
+}
+
+
+// LSN of the oldest record the segments on disk can hold, the next LSN if there are none.
+// Records from there on can be replayed, older ones only a checkpoint has.
+uint64_t journal_oldest_lsn(struct Journal *journal) {
+    uint64_t *segments;
+    int count = list_numbered_files(journal->prefix, &segments);
+    uint64_t oldest = count > 0 ? segments[0] : journal_next_lsn(journal);
+    if (count != -1) {
+        free(segments);
+    }
+    return oldest;
+}
+
+
+// Delete every segment of the journal with given prefix, which must not be open.
+// Returns 0 if the segments can't be listed or one can't be deleted.
+int journal_remove(const char *prefix) {
+    uint64_t *segments;
+    int count = list_numbered_files(prefix, &segments);
+    if (count == -1) {
+        return 0;
+    }
+
+    char path[300];
+    int removed = 1;
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, prefix, segments[i]);
+        if (unlink(path) == -1) {
+            removed = 0;
+        }
+    }
+    if (count > 0) {
+        sync_parent_dir(path);
+    }
+    free(segments);
+    return removed;
+}
+
+
+// Write out everything appended so far, stop the writer and close the file.
+// The ring stays allocated: records appended after this are never written, and whoever
+// appended them waits in journal_wait until the process exits.
+void journal_close(struct Journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    atomic_store(&journal->stopping, 1);
+    pthread_cond_signal(&journal->work_ready);
+    pthread_mutex_unlock(&journal->mutex);
+
+    pthread_join(journal->writer, NULL);
+    close(journal->fd);
+}
+
+
+// Index of the first record with an LSN above after_lsn. LSNs grow through the file,
+// so a binary search finds it without reading the records already in the snapshot.
+static off_t first_record_after(int fd, off_t records, uint64_t after_lsn) {
+    struct Journal_record record;
+    off_t low = 0;
+    off_t high = records;
+
+    while (low < high) {
+        off_t middle = low + (high - low) / 2;
+        if (pread(fd, &record, sizeof(record), sizeof(struct Journal_header) + middle * sizeof(record)) != sizeof(record)) {
+            return -1;
+        }
+        if (record.lsn <= after_lsn) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+// Slots of a batch or transaction read so far. A group may continue in the next segment.
+struct Replay_batch {
+    struct Journal_record legs[BATCH_MAX_LEGS + 1];
+    int count;
+};
+
+
+static int starts_group(uint8_t operation) {
+    return operation == 'a' || operation == JOURNAL_PREPARE || operation == JOURNAL_HELD ||
+           operation == JOURNAL_COMMIT || operation == JOURNAL_ABORT;
+}
+
+
+// Pass a record to apply, holding back the slots of a batch or transaction until its last
+// one is read. A group cut short by a crash is followed by a record that doesn't continue
+// it, and is dropped: its client was never told it succeeded. A group longer than any
+// operation writes can't come from a crash; returns 0 for it, as the journal is damaged.
+static int deliver_record(const struct Journal_record *record, struct Replay_batch *batch,
+                    void (*apply)(const struct Journal_record *record, void *context), void *context) {
+    if (!starts_group(record->operation) && record->operation != 'A') {
+        batch->count = 0;
+        apply(record, context);
+        return 1;
+    }
+
+    if (starts_group(record->operation)) {
+        batch->count = 0;
+    }
+    else if (batch->count == 0 || batch->legs[batch->count - 1].dest_id != record->dest_id + 1) {
+        batch->count = 0;
+        return 1;
+    }
+    if (batch->count == BATCH_MAX_LEGS + 1 || record->dest_id > BATCH_MAX_LEGS) {
+        fprintf(stderr, "Journal record at LSN %" PRIu64 " has more than %d slots, the journal is damaged\n",
+                record->lsn, BATCH_MAX_LEGS + 1);
+        return 0;
+    }
+    batch->legs[batch->count++] = *record;
+
+    if (record->dest_id == 0) {
+        for (int i = 0; i < batch->count; i++) {
+            apply(&batch->legs[i], context);
+        }
+        batch->count = 0;
+    }
+    return 1;
+}
+
+
+// Whether record is the last slot of its operation: a record of its own, or the slot of a
+// batch or transaction with none left after it.
+int journal_ends_group(const struct Journal_record *record) {
+    return (!starts_group(record->operation) && record->operation != 'A') || record->dest_id == 0;
+}
+
+
+// Apply the records of one segment after *after_lsn and up to up_to_lsn, and move *after_lsn
+// forward. Returns the amount applied, or -1 if the segment can't be read or is damaged.
+// Sets *finished when the segment ends in a record that fails its checksum or reaches past
+// up_to_lsn.
+static long replay_segment(const char *path, uint64_t *after_lsn, uint64_t up_to_lsn, int *finished,
+                    struct Replay_batch *pending,
+                    void (*apply)(const struct Journal_record *record, void *context), void *context) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    if (!check_header(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    off_t records = (st.st_size - sizeof(struct Journal_header)) / sizeof(struct Journal_record);
+    off_t next = first_record_after(fd, records, *after_lsn);
+    struct Journal_record *batch = malloc(JOURNAL_REPLAY_BATCH * sizeof(struct Journal_record));
+    if (next == -1 || !batch) {
+        free(batch);
+        close(fd);
+        return -1;
+    }
+
+    long applied = 0;
+    while (next < records) {
+        off_t count = records - next < JOURNAL_REPLAY_BATCH ? records - next : JOURNAL_REPLAY_BATCH;
+        ssize_t n = pread(fd, batch, count * sizeof(struct Journal_record),
+                            sizeof(struct Journal_header) + next * sizeof(struct Journal_record));
+        if (n != (ssize_t)(count * sizeof(struct Journal_record))) {
+            break;
+        }
+        for (off_t i = 0; i < count; i++) {
+            if (batch[i].lsn > up_to_lsn) {
+                *finished = 1;
+                free(batch);
+                close(fd);
+                return applied;
+            }
+            if (batch[i].checksum != record_checksum(&batch[i])) {
+                fprintf(stderr, "Journal ends in a damaged record after LSN %" PRIu64 "\n", *after_lsn);
+                *finished = 1;
+                free(batch);
+                close(fd);
+                return applied;
+            }
+            if (!deliver_record(&batch[i], pending, apply, context)) {
+                free(batch);
+                close(fd);
+                return -1;
+            }
+            *after_lsn = batch[i].lsn;
+            applied++;
+        }
+        next += count;
+    }
+
+    free(batch);
+    close(fd);
+    return applied;
+}
+
+
+// Call apply for every record after after_lsn and up to up_to_lsn, in LSN order, going
+// through the segments that can hold such records. Replay stops at the first record that
+// fails its checksum, since that can only be a write torn by a crash. The slots of a batch
+// or transaction are only applied once all of them are read, so a group that up_to_lsn
+// cuts through isn't applied at all.
+// Returns the amount of records applied, or -1 if the journal can't be read or is damaged.
+long journal_replay(const char *prefix, uint64_t after_lsn, uint64_t up_to_lsn,
+                    void (*apply)(const struct Journal_record *record, void *context), void *context) {
+    uint64_t *segments;
+    char path[300];
+
+    int count = list_numbered_files(prefix, &segments);
+    if (count == -1) {
+        return -1;
+    }
+
+    struct Replay_batch *pending = malloc(sizeof(struct Replay_batch));
+    if (!pending) {
+        free(segments);
+        return -1;
+    }
+    pending->count = 0;
+
+    long applied = 0;
+    int finished = 0;
+    for (int i = 0; i < count && !finished; i++) {
+        // Skip segments that end before the first record wanted
+        if (i + 1 < count && segments[i + 1] <= after_lsn + 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s.%016" PRIx64, prefix, segments[i]);
+        long n = replay_segment(path, &after_lsn, up_to_lsn, &finished, pending, apply, context);
+        if (n == -1) {
+            free(pending);
+            free(segments);
+            return -1;
+        }
+        applied += n;
+    }
+
+    free(pending);
+    free(segments);
+    return applied;
+}
@@ -0,0 +1,136 @@
+#define _POSIX_C_SOURCE 202009L
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// Binary write-ahead journal of account operations.
+// Desks append fixed-size records into a lock-free ring, and a writer thread
+// writes them to the journal file in groups with one fdatasync per group.
+// The journal is split into segment files named <prefix>.<first LSN in hex>, so
+// segments that a checkpoint already covers can be deleted.
+
+#define JOURNAL_MAGIC "BANKJRNL"
+#define JOURNAL_VERSION 3
+#define JOURNAL_RING_SIZE 65536     // Records, must be a power of two
+#define JOURNAL_MAX_WATCHERS 64
+#define JOURNAL_REPLAY_BATCH 4096  // Records read at once during replay
+#define JOURNAL_SEGMENT_BYTES (64L << 20)  // Size after which the writer starts a new segment
+
+// One operation as stored in the journal file, in host byte order, see struct Wire_request.
+struct Journal_record {
+    uint64_t lsn;           // Log sequence number, consecutive from 1
+    uint64_t epoch;         // Checkpoint epoch the operation was made in
+    int32_t account_id;
+    int32_t dest_id;        // Transfer destination, slots left in a batch or transaction, else -1
+    int64_t amount;         // Minor units, negative for a debit; the id in a transaction header
+    uint8_t operation;      // 'd', 'w', 't', 'a' starting a batch or a JOURNAL_ transaction step, 'A' for a leg after it
+    uint8_t pad[3];
+    uint32_t checksum;      // CRC-32 of the bytes before this field
+};
+
+// Steps of a transaction between shards. Each record is a header slot holding the
+// transaction id, followed by 'A' slots with its legs on this shard.
+#define JOURNAL_PREPARE 'p'     // Debits taken and held; every leg of the transaction
+#define JOURNAL_HELD 'h'        // Still prepared at a checkpoint; every leg, none applied again
+#define JOURNAL_COMMIT 'c'      // Credits paid
+#define JOURNAL_ABORT 'r'       // Held debits given back
+
+// Stream of the journal from a primary to a replica over the replication socket. The replica
+// sends "F <LSN>\n", the last record it has. The primary replies with a Replication_start,
+// then snapshot_size bytes of a database file if it can't stream from that LSN on, then
+// frames of the records that follow, durable ones only and whole groups only. A frame
+// with no records is a heartbeat.
+#define REPLICATION_MAGIC "BANKREPL"
+#define REPLICATION_FRAME_RECORDS 256  // Most records per frame
+#define REPLICATION_HEARTBEAT_MS 100    // Longest the primary stays silent
+
+struct Replication_start {
+    char magic[8];
+    uint64_t snapshot_size;     // 0 when the records follow right away
+};
+
+struct Replication_frame {
+    uint64_t durable_lsn;       // Of the primary when it sent the frame
+    uint32_t count;             // Records following
+    uint32_t pad;
+};
+
+struct Journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// Ring cell. seq tells whose turn the cell is: it equals the ticket of the producer that may
+// fill it, ticket + 1 once the record is ready, and ticket + ring size after the writer took it.
+struct Journal_cell {
+    atomic_uint_fast64_t seq;
+    struct Journal_record record;
+};
+
+struct Journal {
+    char prefix[256];
+    int fd;                 // Current segment
+    off_t segment_size;
+    atomic_int rotate_requested;
+    int group_size;         // Most records written per fdatasync
+    int group_delay_us;     // How long a short group waits for more records
+
+    struct Journal_cell *ring;
+    atomic_uint_fast64_t first_lsn;     // LSN of ticket 0, moves only when journal_copy skips LSNs
+    atomic_uint_fast64_t next_ticket;
+    uint64_t read_ticket;   // Only used by the writer thread
+    atomic_uint_fast64_t durable_lsn;
+
+    pthread_t writer;
+    atomic_int stopping;
+    atomic_int writer_idle;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t durable;
+
+    // eventfds written after every commit, for threads that can't block in journal_wait
+    int watchers[JOURNAL_MAX_WATCHERS];
+    int watcher_count;
+};
+
+int journal_open(struct Journal *journal, const char *prefix, uint64_t min_lsn,
+                    int group_size, int group_delay_us);
+
+long journal_replay(const char *prefix, uint64_t after_lsn, uint64_t up_to_lsn,
+                    void (*apply)(const struct Journal_record *record, void *context), void *context);
+
+int journal_ends_group(const struct Journal_record *record);
+
+uint64_t journal_append(struct Journal *journal, uint64_t epoch, char operation,
+                        int account_id, int dest_id, int64_t amount);
+
+uint64_t journal_append_batch(struct Journal *journal, uint64_t epoch,
+                                const struct Batch_leg *legs, int count);
+
+uint64_t journal_append_transaction(struct Journal *journal, uint64_t epoch, char operation,
+                                    uint64_t transaction, const struct Batch_leg *legs, int count);
+
+int journal_copy(struct Journal *journal, const struct Journal_record *record);
+
+uint64_t journal_next_lsn(struct Journal *journal);
+
+uint64_t journal_durable_lsn(struct Journal *journal);
+
+void journal_wait(struct Journal *journal, uint64_t lsn);
+
+int journal_wait_until(struct Journal *journal, uint64_t lsn, const struct timespec *deadline);
+
+int journal_add_watcher(struct Journal *journal, int event_fd);
+
+void journal_rotate(struct Journal *journal);
+
+int journal_truncate(struct Journal *journal, uint64_t below_lsn);
+
+uint64_t journal_oldest_lsn(struct Journal *journal);
+
+int journal_remove(const char *prefix);
+
+void journal_close(struct Journal *journal);
@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_OUTPUT_SIZE 65536   // Bytes the flusher collects per write
+
+// Header of a line in a thread's buffer. The text follows, padded to 8 bytes.
+struct Log_record {
+    uint64_t time_ns;       // CLOCK_REALTIME
+    uint32_t length;
+    uint32_t level;
+};
+
+// Ring buffer of one thread. Only the owning thread moves head, only the flusher moves tail.
+struct Log_buffer {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_uint_fast64_t dropped;
+    char data[LOG_BUFFER_SIZE];
+};
+
+int log_level = LOG_INFO;
+
+// Buffers of the threads that logged anything so far. Like metrics slots, a buffer is never
+// freed, and the buffer of a thread that exited goes to the next new thread.
+static struct Log_buffer *_Atomic log_slots[LOG_MAX_THREADS];
+static atomic_int log_slots_released[LOG_MAX_THREADS];
+static atomic_int log_slot_count = 0;
+static _Thread_local struct Log_buffer *thread_log;
+static pthread_key_t slot_owner;
+static pthread_once_t slot_owner_once = PTHREAD_ONCE_INIT;
+static atomic_uint_fast64_t unbuffered_dropped;     // Lines of threads that got no buffer
+
+static int output_fd = -1;  // Until log_open, lines go straight to stderr
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+
+
+// Level named by name, in any case, or -1 if there is no such level.
+int log_parse_level(const char *name) {
+    for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+        if (strcasecmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+
+// Called when a thread that owned a buffer exits. The key holds the slot number plus one.
+static void release_slot(void *owner) {
+    atomic_store(&log_slots_released[(intptr_t)owner - 1], 1);
+}
+
+
+static void create_slot_owner(void) {
+    pthread_key_create(&slot_owner, release_slot);
+}
+
+
+static struct Log_buffer *take_slot(int slot) {
+    pthread_once(&slot_owner_once, create_slot_owner);
+    pthread_setspecific(slot_owner, (void *)(intptr_t)(slot + 1));
+    thread_log = atomic_load(&log_slots[slot]);
+    return thread_log;
+}
+
+
+// This thread's buffer, taken on its first line. NULL once every slot is taken.
+static struct Log_buffer *own_buffer(void) {
+    if (thread_log) {
+        return thread_log;
+    }
+    int count = atomic_load(&log_slot_count);
+    for (int i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+        int released = 1;
+        if (atomic_compare_exchange_strong(&log_slots_released[i], &released, 0)) {
+            return take_slot(i);
+        }
+    }
+
+    int slot = atomic_fetch_add(&log_slot_count, 1);
+    if (slot >= LOG_MAX_THREADS) {
+        return NULL;
+    }
+    struct Log_buffer *buffer = aligned_alloc(64, sizeof(struct Log_buffer));
+    if (!buffer) {
+        return NULL;
+    }
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    atomic_init(&buffer->dropped, 0);
+    atomic_store(&log_slots[slot], buffer);
+    return take_slot(slot);
+}
+
+
+// Copy into or out of a ring buffer at a position that may wrap around its end.
+static void copy_in(struct Log_buffer *buffer, size_t position, const void *data, size_t size) {
+    size_t offset = position & (LOG_BUFFER_SIZE - 1);
+    size_t first = size < LOG_BUFFER_SIZE - offset ? size : LOG_BUFFER_SIZE - offset;
+    memcpy(buffer->data + offset, data, first);
+    memcpy(buffer->data, (const char *)data + first, size - first);
+}
+
+
+static void copy_out(const struct Log_buffer *buffer, size_t position, void *data, size_t size) {
+    size_t offset = position & (LOG_BUFFER_SIZE - 1);
+    size_t first = size < LOG_BUFFER_SIZE - offset ? size : LOG_BUFFER_SIZE - offset;
+    memcpy(data, buffer->data + offset, first);
+    memcpy((char *)data + first, buffer->data, size - first);
+}
+
+
+static size_t record_size(uint32_t length) {
+    return sizeof(struct Log_record) + ((length + 7) & ~(size_t)7);
+}
+
+
+// Log a line, without a trailing newline. Called through LOG, which checks the level first.
+void log_line(int level, const char *format, ...) {
+    char text[LOG_LINE];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+        return;
+    }
+    if (length >= LOG_LINE) {
+        length = LOG_LINE - 1;
+    }
+
+    if (output_fd == -1) {
+        fprintf(stderr, "%s\n", text);
+        return;
+    }
+    struct Log_buffer *buffer = own_buffer();
+    if (!buffer) {
+        atomic_fetch_add_explicit(&unbuffered_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct Log_record record = { (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, length, level };
+    size_t size = record_size(length);
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    if (LOG_BUFFER_SIZE - (head - tail) < size) {
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    copy_in(buffer, head, &record, sizeof(record));
+    copy_in(buffer, head + sizeof(record), text, length);
+    atomic_store_explicit(&buffer->head, head + size, memory_order_release);
+}
+
+
+static void write_all(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(output_fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;     // Nowhere left to report it
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+
+// Write the time and level a line starts with. The date part is formatted once per second.
+static int format_prefix(char *output, uint64_t time_ns, int level) {
+    static time_t last_second = -1;
+    static char date[32];
+    time_t second = time_ns / 1000000000;
+    if (second != last_second) {
+        struct tm local;
+        localtime_r(&second, &local);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &local);
+        last_second = second;
+    }
+    return sprintf(output, "%s.%06u %s ", date, (unsigned)(time_ns % 1000000000 / 1000), level_names[level]);
+}
+
+
+// Write out every line buffered so far. A thread's lines stay in order, and the lines of
+// different threads are merged by time. Called with flush_mutex held.
+static void flush_buffers(void) {
+    static char output[LOG_OUTPUT_SIZE];
+    static size_t heads[LOG_MAX_THREADS];
+    static size_t tails[LOG_MAX_THREADS];
+    static struct Log_record next[LOG_MAX_THREADS];
+    size_t used = 0;
+
+    int count = atomic_load(&log_slot_count);
+    count = count < LOG_MAX_THREADS ? count : LOG_MAX_THREADS;
+    for (int i = 0; i < count; i++) {
+        struct Log_buffer *buffer = atomic_load(&log_slots[i]);
+        heads[i] = tails[i] = 0;
+        if (buffer) {
+            heads[i] = atomic_load_explicit(&buffer->head, memory_order_acquire);
+            tails[i] = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        }
+        if (tails[i] < heads[i]) {
+            copy_out(buffer, tails[i], &next[i], sizeof(struct Log_record));
+        }
+    }
+
+    while (1) {
+        int oldest = -1;
+        for (int i = 0; i < count; i++) {
+            if (tails[i] < heads[i] && (oldest == -1 || next[i].time_ns < next[oldest].time_ns)) {
+                oldest = i;
+            }
+        }
+        if (oldest == -1) {
+            break;
+        }
+
+        if (used + LOG_LINE + 64 > sizeof(output)) {
+            write_all(output, used);
+            used = 0;
+        }
+        struct Log_buffer *buffer = atomic_load(&log_slots[oldest]);
+        struct Log_record *record = &next[oldest];
+        used += format_prefix(output + used, record->time_ns, record->level);
+        copy_out(buffer, tails[oldest] + sizeof(struct Log_record), output + used, record->length);
+        used += record->length;
+        output[used++] = '\n';
+
+        tails[oldest] += record_size(record->length);
+        atomic_store_explicit(&buffer->tail, tails[oldest], memory_order_release);
+        if (tails[oldest] < heads[oldest]) {
+            copy_out(buffer, tails[oldest], record, sizeof(struct Log_record));
+        }
+    }
+
+    uint64_t dropped = atomic_exchange(&unbuffered_dropped, 0);
+    for (int i = 0; i < count; i++) {
+        struct Log_buffer *buffer = atomic_load(&log_slots[i]);
+        if (buffer) {
+            dropped += atomic_exchange(&buffer->dropped, 0);
+        }
+    }
+    if (dropped > 0) {
+        // The last line may have left less room than a line takes
+        if (used + LOG_LINE + 64 > sizeof(output)) {
+            write_all(output, used);
+            used = 0;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        used += format_prefix(output + used, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, LOG_WARNING);
+        used += snprintf(output + used, sizeof(output) - used, "Dropped %llu log lines, the log couldn't keep up\n",
+                            (unsigned long long)dropped);
+    }
+    write_all(output, used);
+}
+
+
+// Write out the lines buffered so far. Runs at exit too, so nothing logged before it is lost.
+void log_flush(void) {
+    if (output_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&flush_mutex);
+    flush_buffers();
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+
+static void *flusher(void *arg) {
+    struct timespec pause = { 0, LOG_FLUSH_MS * 1000000L };
+    while (1) {
+        nanosleep(&pause, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+
+// Start logging lines up to level to the file at path, appending, or to stdout if path is
+// NULL, and start the flusher. Called once, before the threads that log start.
+// Returns 0 if the file can't be opened.
+int log_open(const char *path, int level) {
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND, 0644) : STDOUT_FILENO;
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open log file %s\n", path);
+        return 0;
+    }
+    log_level = level;
+    output_fd = fd;
+    atexit(log_flush);
+
+    // The flusher takes no signals, so a signal handler that flushes never finds the flush
+    // lock held by the thread it interrupted
+    sigset_t all_signals, signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &signals);
+    pthread_t flusher_thread;
+    int started = pthread_create(&flusher_thread, NULL, flusher, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &signals, NULL);
+    if (!started) {
+        output_fd = -1;
+        fprintf(stderr, "Failed to start log flusher\n");
+        return 0;
+    }
+    pthread_detach(flusher_thread);
+    return 1;
+}
@@ -0,0 +1,40 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Server log. A thread writes its lines into a buffer of its own, taking no lock and making
+// no system call, and a flusher thread writes them out in time order every LOG_FLUSH_MS.
+// A line that doesn't fit in its thread's buffer is dropped and counted rather than waited
+// for, so a slow terminal or pipe never holds up serving.
+
+#define LOG_MAX_THREADS 256
+#define LOG_BUFFER_SIZE 65536       // Bytes per thread, must be a power of two
+#define LOG_LINE 512                // Longer lines are cut
+#define LOG_FLUSH_MS 20
+
+enum Log_level {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,       // Default: startup, and every client connecting and leaving
+    LOG_DEBUG,
+};
+
+// Most detailed level written. Set by log_open, before other threads start.
+extern int log_level;
+
+// Log a line if level is enabled. The arguments aren't evaluated otherwise, so a disabled
+// level costs one comparison.
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= log_level) { \
+            log_line((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+int log_parse_level(const char *name);
+
+int log_open(const char *path, int level);
+
+void log_line(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void log_flush(void);
@@ -0,0 +1,335 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+// Slots of the threads that recorded anything so far. A slot is never freed, since a
+// report may be reading it, but the slot of a thread that exited goes to the next new
+// thread, which keeps adding to its counts. Desks come and go when their count adapts.
+static struct Metrics_thread *_Atomic metric_slots[METRICS_MAX_THREADS];
+static atomic_int metric_slots_released[METRICS_MAX_THREADS];
+static atomic_int metric_slot_count = 0;
+static _Thread_local struct Metrics_thread *thread_metrics;
+static pthread_key_t slot_owner;
+static pthread_once_t slot_owner_once = PTHREAD_ONCE_INIT;
+static uint64_t start_ns;
+
+// A histogram added up over every thread.
+struct Histogram_sum {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct Metrics_sum {
+    uint64_t operations[METRICS_OPERATION_COUNT];
+    uint64_t failures[METRICS_OPERATION_COUNT];
+    struct Histogram_sum operation_ns[METRICS_OPERATION_COUNT];
+    uint64_t lock_acquisitions;
+    uint64_t lock_contended;
+    struct Histogram_sum lock_wait_ns;
+    uint64_t journal_records;
+    struct Histogram_sum journal_write_ns;
+    struct Histogram_sum accept_to_serve_ns;
+};
+
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Start counting uptime. Called once before the server starts serving.
+void metrics_init(void) {
+    start_ns = metrics_now();
+}
+
+
+// Called when a thread that owned a slot exits. The key holds the slot number plus one.
+static void release_slot(void *owner) {
+    atomic_store(&metric_slots_released[(intptr_t)owner - 1], 1);
+}
+
+
+static void create_slot_owner(void) {
+    pthread_key_create(&slot_owner, release_slot);
+}
+
+
+// Make slot this thread's, and release it again when the thread exits.
+static struct Metrics_thread *take_slot(int slot) {
+    pthread_once(&slot_owner_once, create_slot_owner);
+    pthread_setspecific(slot_owner, (void *)(intptr_t)(slot + 1));
+    thread_metrics = atomic_load(&metric_slots[slot]);
+    return thread_metrics;
+}
+
+
+// This thread's slot, taken on its first use: one released by an exited thread, or a new one.
+// NULL once every slot is taken; such threads go uncounted rather than share a slot.
+static struct Metrics_thread *own_slot(void) {
+    if (thread_metrics) {
+        return thread_metrics;
+    }
+    int count = atomic_load(&metric_slot_count);
+    for (int i = 0; i < count && i < METRICS_MAX_THREADS; i++) {
+        int released = 1;
+        if (atomic_compare_exchange_strong(&metric_slots_released[i], &released, 0)) {
+            return take_slot(i);
+        }
+    }
+
+    int slot = atomic_fetch_add(&metric_slot_count, 1);
+    if (slot >= METRICS_MAX_THREADS) {
+        return NULL;
+    }
+    // Rounded up to whole cache lines, so no two threads write the same line
+    size_t size = (sizeof(struct Metrics_thread) + 63) / 64 * 64;
+    struct Metrics_thread *metrics = aligned_alloc(64, size);
+    if (!metrics) {
+        return NULL;
+    }
+    memset(metrics, 0, size);
+    atomic_store(&metric_slots[slot], metrics);
+    return take_slot(slot);
+}
+
+
+// Only the owning thread writes its counters, so a plain load and store is enough; the
+// atomics just keep a concurrent report from reading a torn value.
+static void add(atomic_uint_fast64_t *counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+
+static int bucket_of(uint64_t value) {
+    if (value < 2 * METRICS_HALF) {
+        return value;
+    }
+    int msb = 0;
+    while (value >> (msb + 1)) {
+        msb++;
+    }
+    int shift = msb - (METRICS_SUB_BITS - 1);
+    return shift * METRICS_HALF + (value >> shift);
+}
+
+
+// Highest value that lands in a bucket.
+static uint64_t bucket_value(int bucket) {
+    if (bucket < 2 * METRICS_HALF) {
+        return bucket;
+    }
+    int shift = bucket / METRICS_HALF - 1;
+    uint64_t low = (uint64_t)(bucket - shift * METRICS_HALF) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+
+static void record(struct Metrics_histogram *histogram, uint64_t value) {
+    int bucket = bucket_of(value);
+    add(&histogram->counts[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1], 1);
+    add(&histogram->total, 1);
+    add(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+
+static int operation_index(char operation) {
+    const char *found = operation ? strchr(METRICS_OPERATIONS, operation) : NULL;
+    return found ? found - METRICS_OPERATIONS : METRICS_OPERATION_COUNT - 1;
+}
+
+
+// A client command finished. elapsed_ns covers running it, not waiting for the journal.
+void metrics_operation(char operation, int succeeded, uint64_t elapsed_ns) {
+    struct Metrics_thread *metrics = own_slot();
+    if (metrics) {
+        int index = operation_index(operation);
+        add(&metrics->operations[index], 1);
+        if (!succeeded) {
+            add(&metrics->failures[index], 1);
+        }
+        record(&metrics->operation_ns[index], elapsed_ns);
+    }
+}
+
+
+// An account lock was taken, after waiting wait_ns for it. Set as the lock observer.
+void metrics_lock_wait(uint64_t wait_ns) {
+    struct Metrics_thread *metrics = own_slot();
+    if (metrics) {
+        add(&metrics->lock_acquisitions, 1);
+        if (wait_ns > 0) {
+            add(&metrics->lock_contended, 1);
+            record(&metrics->lock_wait_ns, wait_ns);
+        }
+    }
+}
+
+
+// The journal wrote a group of records to disk and synced it.
+void metrics_journal_write(int records, uint64_t elapsed_ns) {
+    struct Metrics_thread *metrics = own_slot();
+    if (metrics) {
+        add(&metrics->journal_records, records);
+        record(&metrics->journal_write_ns, elapsed_ns);
+    }
+}
+
+
+// A client was greeted with "ready", elapsed_ns after it was accepted.
+void metrics_accept_to_serve(uint64_t elapsed_ns) {
+    struct Metrics_thread *metrics = own_slot();
+    if (metrics) {
+        record(&metrics->accept_to_serve_ns, elapsed_ns);
+    }
+}
+
+
+static void sum_histogram(struct Histogram_sum *into, struct Metrics_histogram *from) {
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        into->counts[i] += atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+    }
+    into->total += atomic_load_explicit(&from->total, memory_order_relaxed);
+    into->sum += atomic_load_explicit(&from->sum, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+
+static double percentile_us(const struct Histogram_sum *histogram, double percentile) {
+    uint64_t wanted = histogram->total * percentile / 100.0;
+    uint64_t seen = 0;
+    if (wanted == 0 || wanted < histogram->total * percentile / 100.0) {
+        wanted++;
+    }
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = bucket_value(i);
+            return (value < histogram->max ? value : histogram->max) / 1e3;
+        }
+    }
+    return histogram->max / 1e3;
+}
+
+
+// Print a histogram's count, mean and percentiles in microseconds, as "key value" lines
+// starting with prefix, or as the members of a JSON object.
+static void report_histogram(FILE *output, int json, const char *prefix, const struct Histogram_sum *histogram) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char *names[] = { "p50", "p90", "p99", "p999" };
+    double mean = histogram->total ? (double)histogram->sum / histogram->total / 1e3 : 0;
+
+    if (json) {
+        fprintf(output, "{\"count\":%llu,\"mean\":%.2f", (unsigned long long)histogram->total, mean);
+    }
+    else {
+        fprintf(output, "%s_count %llu\n%s_us_mean %.2f\n", prefix, (unsigned long long)histogram->total, prefix, mean);
+    }
+    for (int i = 0; i < 4; i++) {
+        double value = histogram->total ? percentile_us(histogram, percentiles[i]) : 0;
+        if (json) {
+            fprintf(output, ",\"%s\":%.2f", names[i], value);
+        }
+        else {
+            fprintf(output, "%s_us_%s %.2f\n", prefix, names[i], value);
+        }
+    }
+    if (json) {
+        fprintf(output, ",\"max\":%.2f}", histogram->max / 1e3);
+    }
+    else {
+        fprintf(output, "%s_us_max %.2f\n", prefix, histogram->max / 1e3);
+    }
+}
+
+
+// Add up every thread's slot and print the result with the gauges, as "key value" lines
+// or as one JSON object. Threads keep recording meanwhile, so the sums may be a few
+// operations apart from each other.
+void metrics_report(FILE *output, int json, const struct Metrics_gauge *gauges, int gauge_count) {
+    struct Metrics_sum *sum = calloc(1, sizeof(struct Metrics_sum));
+    if (!sum) {
+        fprintf(output, json ? "{}\n" : "error out of memory\n");
+        return;
+    }
+
+    int count = atomic_load(&metric_slot_count);
+    for (int i = 0; i < count && i < METRICS_MAX_THREADS; i++) {
+        struct Metrics_thread *metrics = atomic_load(&metric_slots[i]);
+        if (!metrics) {
+            continue;   // Still being set up
+        }
+        for (int op = 0; op < METRICS_OPERATION_COUNT; op++) {
+            sum->operations[op] += atomic_load_explicit(&metrics->operations[op], memory_order_relaxed);
+            sum->failures[op] += atomic_load_explicit(&metrics->failures[op], memory_order_relaxed);
+            sum_histogram(&sum->operation_ns[op], &metrics->operation_ns[op]);
+        }
+        sum->lock_acquisitions += atomic_load_explicit(&metrics->lock_acquisitions, memory_order_relaxed);
+        sum->lock_contended += atomic_load_explicit(&metrics->lock_contended, memory_order_relaxed);
+        sum_histogram(&sum->lock_wait_ns, &metrics->lock_wait_ns);
+        sum->journal_records += atomic_load_explicit(&metrics->journal_records, memory_order_relaxed);
+        sum_histogram(&sum->journal_write_ns, &metrics->journal_write_ns);
+        sum_histogram(&sum->accept_to_serve_ns, &metrics->accept_to_serve_ns);
+    }
+
+    double uptime = (metrics_now() - start_ns) / 1e9;
+    char prefix[64];
+
+    if (!json) {
+        fprintf(output, "uptime_s %.3f\n", uptime);
+        for (int i = 0; i < gauge_count; i++) {
+            fprintf(output, "%s %lld\n", gauges[i].name, gauges[i].value);
+        }
+        for (int op = 0; op < METRICS_OPERATION_COUNT; op++) {
+            char name = op < METRICS_OPERATION_COUNT - 1 ? METRICS_OPERATIONS[op] : 'x';
+            fprintf(output, "op_%c_failed %llu\n", name, (unsigned long long)sum->failures[op]);
+            fprintf(output, "op_%c_per_s %.1f\n", name, uptime > 0 ? sum->operations[op] / uptime : 0);
+            snprintf(prefix, sizeof(prefix), "op_%c", name);
+            report_histogram(output, 0, prefix, &sum->operation_ns[op]);
+        }
+        fprintf(output, "lock_acquisitions %llu\n", (unsigned long long)sum->lock_acquisitions);
+        fprintf(output, "lock_contended %llu\n", (unsigned long long)sum->lock_contended);
+        report_histogram(output, 0, "lock_wait", &sum->lock_wait_ns);
+        fprintf(output, "journal_records %llu\n", (unsigned long long)sum->journal_records);
+        report_histogram(output, 0, "journal_write", &sum->journal_write_ns);
+        report_histogram(output, 0, "accept_to_serve", &sum->accept_to_serve_ns);
+        free(sum);
+        return;
+    }
+
+    fprintf(output, "{\"uptime_s\":%.3f,\"gauges\":{", uptime);
+    for (int i = 0; i < gauge_count; i++) {
+        fprintf(output, "%s\"%s\":%lld", i ? "," : "", gauges[i].name, gauges[i].value);
+    }
+    fprintf(output, "},\"operations\":{");
+    for (int op = 0; op < METRICS_OPERATION_COUNT; op++) {
+        char name = op < METRICS_OPERATION_COUNT - 1 ? METRICS_OPERATIONS[op] : 'x';
+        fprintf(output, "%s\"%c\":{\"failed\":%llu,\"per_s\":%.1f,\"latency_us\":", op ? "," : "", name,
+                (unsigned long long)sum->failures[op], uptime > 0 ? sum->operations[op] / uptime : 0);
+        report_histogram(output, 1, NULL, &sum->operation_ns[op]);
+        fprintf(output, "}");
+    }
+    fprintf(output, "},\"locks\":{\"acquisitions\":%llu,\"contended\":%llu,\"wait_us\":",
+            (unsigned long long)sum->lock_acquisitions, (unsigned long long)sum->lock_contended);
+    report_histogram(output, 1, NULL, &sum->lock_wait_ns);
+    fprintf(output, "},\"journal\":{\"records\":%llu,\"write_us\":", (unsigned long long)sum->journal_records);
+    report_histogram(output, 1, NULL, &sum->journal_write_ns);
+    fprintf(output, "},\"accept_to_serve_us\":");
+    report_histogram(output, 1, NULL, &sum->accept_to_serve_ns);
+    fprintf(output, "}\n");
+    free(sum);
+}
@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Counters and latency histograms of the running server.
+// Every thread records into a slot of its own, so recording takes no lock and shares no
+// cache line with other threads; a report adds the slots up while the threads keep going.
+
+#define METRICS_MAX_THREADS 256
+#define METRICS_OPERATIONS "lwdtaq"     // Operations counted apart; anything else counts as other
+#define METRICS_OPERATION_COUNT 7
+#define METRICS_SUB_BITS 4              // Histogram buckets per power of two: 2^(METRICS_SUB_BITS-1)
+#define METRICS_HALF (1 << (METRICS_SUB_BITS - 1))
+#define METRICS_BUCKETS (60 * METRICS_HALF)
+
+// Log-linear histogram of nanosecond values: exact below 2^METRICS_SUB_BITS, and split in
+// METRICS_HALF equal buckets within every higher power of two, so values are within 12%.
+// Only the owning thread writes it.
+struct Metrics_histogram {
+    atomic_uint_fast64_t counts[METRICS_BUCKETS];
+    atomic_uint_fast64_t total;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+struct Metrics_thread {
+    atomic_uint_fast64_t operations[METRICS_OPERATION_COUNT];
+    atomic_uint_fast64_t failures[METRICS_OPERATION_COUNT];
+    struct Metrics_histogram operation_ns[METRICS_OPERATION_COUNT];    // Running the command, without the journal wait
+    atomic_uint_fast64_t lock_acquisitions;
+    atomic_uint_fast64_t lock_contended;
+    struct Metrics_histogram lock_wait_ns;          // Only acquisitions that had to wait
+    atomic_uint_fast64_t journal_records;
+    struct Metrics_histogram journal_write_ns;      // One write and fdatasync per group
+    struct Metrics_histogram accept_to_serve_ns;
+};
+
+// Value shown next to the counters, such as a queue length, read when the report is made.
+struct Metrics_gauge {
+    char name[32];
+    long long value;
+};
+
+uint64_t metrics_now(void);
+
+void metrics_init(void);
+
+void metrics_operation(char operation, int succeeded, uint64_t elapsed_ns);
+
+void metrics_lock_wait(uint64_t wait_ns);
+
+void metrics_journal_write(int records, uint64_t elapsed_ns);
+
+void metrics_accept_to_serve(uint64_t elapsed_ns);
+
+void metrics_report(FILE *output, int json, const struct Metrics_gauge *gauges, int gauge_count);
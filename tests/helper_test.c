@@ -5,52 +5,1022 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include "bank_helper.h"
 
 void test_save_accounts() {
-    const char *save_db = "test_saved_accounts.txt";
+    const char *save_db = "test_saved_accounts.bin";
 
-    struct Account test_accounts[] = {
-        {1, 1020.50},
-        {2, 250.75},
-        {3, 3010.00}
+    struct Database_record test_accounts[] = {
+        {1, 0, 102050},
+        {2, 0, 25075},
+        {3, 0, 301000}
     };
     int test_account_count = sizeof(test_accounts) / sizeof(test_accounts[0]);
 
-    int save_result = save_accounts(test_accounts, test_account_count, save_db);
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+
+    for (int i = 0; i < test_account_count; i++) {
+        assert(create_new_account(&store, test_accounts[i].id, &store_lock) == 1);
+        get_account_by_id(&store, test_accounts[i].id)->balance = test_accounts[i].balance;
+    }
+
+    int save_result = save_accounts(&store, save_db, 42, 3, 3, 7000, 0);
     assert(save_result == 1);
 
-    printf("Accounts saved.\n", save_db);
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Accounts saved.\n");
 }
 
 
 void test_load_accounts() {
-    const char *load_db = "test_saved_accounts.txt";
+    const char *load_db = "test_saved_accounts.bin";
 
-    struct Account *loaded_accounts = NULL;
-    int loaded_count = load_accounts(&loaded_accounts, load_db);
+    struct Account_store loaded_accounts;
+    uint64_t snapshot_lsn;
+    uint64_t epoch;
+    int64_t deposits;
+    int loaded_count = load_accounts(&loaded_accounts, load_db, &snapshot_lsn, &epoch, &deposits);
     assert(loaded_count == 3);
+    assert(snapshot_lsn == 42);
+    assert(epoch == 3);
+    assert(deposits == 7000);
 
-    struct Account expected_accounts[] = {
-        {1, 1020.50},
-        {2, 250.75},
-        {3, 3010.00}
+    struct Database_record expected_accounts[] = {
+        {1, 0, 102050},
+        {2, 0, 25075},
+        {3, 0, 301000}
     };
 
     for (int i = 0; i < loaded_count; i++) {
-        assert(loaded_accounts[i].id == expected_accounts[i].id);
-        assert(loaded_accounts[i].balance == expected_accounts[i].balance);
-        pthread_rwlock_destroy(&loaded_accounts[i].lock);
+        struct Account *account = account_at(&loaded_accounts, i);
+        assert(account_id(&loaded_accounts, i) == expected_accounts[i].id);
+        assert(account->balance == expected_accounts[i].balance);
+        assert(get_account_by_id(&loaded_accounts, expected_accounts[i].id) == account);
+    }
+
+    destroy_account_store(&loaded_accounts);
+
+    printf("Accounts loaded.\n");
+}
+
+
+void test_database_formats() {
+    const char *binary_db = "test_saved_accounts.bin";
+    const char *text_db = "test_converted_accounts.txt";
+
+    // Binary to text and back keeps accounts, snapshot LSN, epoch and deposits
+    struct Account_store store;
+    uint64_t snapshot_lsn;
+    uint64_t epoch;
+    int64_t deposits;
+    assert(load_accounts(&store, binary_db, &snapshot_lsn, &epoch, &deposits) == 3);
+    assert(save_accounts_text(&store, text_db, snapshot_lsn, epoch, deposits) == 1);
+    destroy_account_store(&store);
+
+    assert(load_accounts_text(&store, text_db, &snapshot_lsn, &epoch, &deposits) == 3);
+    assert(snapshot_lsn == 42 && epoch == 3 && deposits == 7000);
+    assert(get_account_by_id(&store, 3)->balance == 301000);
+    destroy_account_store(&store);
+    unlink(text_db);
+
+    // A flipped byte in a record fails the checksum
+    int fd = open(binary_db, O_RDWR);
+    char byte;
+    off_t offset = sizeof(struct Database_header) + sizeof(struct Database_record) + 8;
+    assert(pread(fd, &byte, 1, offset) == 1);
+    byte ^= 1;
+    assert(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+    assert(load_accounts(&store, binary_db, &snapshot_lsn, &epoch, &deposits) == -1);
+    unlink(binary_db);
+
+    printf("Database formats work.\n");
+}
+
+
+void test_amounts() {
+    int64_t amount;
+    char text[AMOUNT_TEXT];
+
+    assert(parse_amount("12", &amount) == 1 && amount == 1200);
+    assert(parse_amount("0.1", &amount) == 1 && amount == 10);
+    assert(parse_amount("100.25", &amount) == 1 && amount == 10025);
+    assert(parse_amount("-3.05", &amount) == 1 && amount == -305);
+    assert(parse_amount("1.005", &amount) == 0);
+    assert(parse_amount("12abc", &amount) == 0);
+    assert(parse_amount(".", &amount) == 0);
+    assert(parse_amount("99999999999999999999", &amount) == 0);
+
+    assert(strcmp(format_amount(10025, text), "100.25") == 0);
+    assert(strcmp(format_amount(5, text), "0.05") == 0);
+    assert(strcmp(format_amount(-305, text), "-3.05") == 0);
+
+    printf("Amounts work.\n");
+}
+
+
+void test_config_lines() {
+    char *key;
+    char *value;
+    char line[64];
+
+    strcpy(line, "  socket =  /tmp/other-socket \n");
+    assert(parse_config_line(line, &key, &value) == 1);
+    assert(strcmp(key, "socket") == 0);
+    assert(strcmp(value, "/tmp/other-socket") == 0);
+
+    strcpy(line, "cpus=0,2");
+    assert(parse_config_line(line, &key, &value) == 1);
+    assert(strcmp(key, "cpus") == 0);
+    assert(strcmp(value, "0,2") == 0);
+
+    strcpy(line, "database =\n");
+    assert(parse_config_line(line, &key, &value) == 1);
+    assert(strcmp(value, "") == 0);
+
+    strcpy(line, "  # desks = 8\n");
+    assert(parse_config_line(line, &key, &value) == 0);
+    strcpy(line, " \t\n");
+    assert(parse_config_line(line, &key, &value) == 0);
+    strcpy(line, "desks 8\n");
+    assert(parse_config_line(line, &key, &value) == -1);
+    strcpy(line, " = 8\n");
+    assert(parse_config_line(line, &key, &value) == -1);
+
+    printf("Config lines work.\n");
+}
+
+
+void test_batch_legs() {
+    struct Batch_leg legs[BATCH_MAX_LEGS];
+    char line[BATCH_MAX_LEGS * 8 + 16];
+    int count;
+
+    assert(parse_legs(" 1 -2.50  3 1 \t", legs, &count) == 1);
+    assert(count == 2);
+    assert(legs[0].account_id == 1 && legs[0].amount == -250);
+    assert(legs[1].account_id == 3 && legs[1].amount == 100);
+
+    assert(parse_legs("", legs, &count) == 0);
+    assert(parse_legs(" 1", legs, &count) == 0);
+    assert(parse_legs(" 1 5 2", legs, &count) == 0);
+    assert(parse_legs(" 1 0", legs, &count) == 0);
+    assert(parse_legs(" -1 5", legs, &count) == 0);
+    assert(parse_legs(" 1 5x", legs, &count) == 0);
+
+    // One leg more than a batch may have
+    size_t length = 0;
+    for (int i = 0; i <= BATCH_MAX_LEGS; i++) {
+        length += sprintf(line + length, " %d 1", i % 10);
+    }
+    assert(parse_legs(line, legs, &count) == 0);
+    line[length - 4] = '\0';
+    assert(parse_legs(line, legs, &count) == 1);
+    assert(count == BATCH_MAX_LEGS);
+
+    printf("Batch legs work.\n");
+}
+
+
+// The binary protocol's layout is fixed, clients build the structs byte by byte.
+void test_wire_layout() {
+    assert(sizeof(struct Wire_request) == 24);
+    assert(offsetof(struct Wire_request, account_id) == 4);
+    assert(offsetof(struct Wire_request, dest_id) == 8);
+    assert(offsetof(struct Wire_request, amount) == 16);
+
+    assert(sizeof(struct Wire_response) == 16);
+    assert(offsetof(struct Wire_response, account_id) == 4);
+    assert(offsetof(struct Wire_response, value) == 8);
+
+    printf("Wire layout works.\n");
+}
+
+
+struct Balance_mover {
+    const struct Account_store *store;
+    atomic_int *done;
+    int step;
+};
+
+// Moves money around accounts 1 to 4, so their total never changes.
+static void *move_balances(void *arg) {
+    struct Balance_mover *mover = arg;
+    for (int i = 0; !atomic_load(mover->done); i++) {
+        int source = 1 + (i + mover->step) % 4;
+        transfer(mover->store, source, 1 + (source + mover->step) % 4, 1 + i % 7);
+    }
+    return NULL;
+}
+
+
+void test_read_balances() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    struct Account *read[4];
+    int64_t balances[4];
+    for (int id = 1; id <= 4; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+        read[id - 1] = get_account_by_id(&store, id);
+        deposit(read[id - 1], 1000);
+    }
+    assert(read_balances(read, 4, balances) == 1);
+    assert(balances[0] == 1000 && balances[3] == 1000);
+    assert(read_balances(read, 0, balances) == 0);
+    assert(read_balances(read, READ_MAX_ACCOUNTS + 1, balances) == 0);
+
+    // Transfers racing the reads never show money that is in flight
+    atomic_int done = 0;
+    struct Balance_mover movers[2] = { { &store, &done, 1 }, { &store, &done, 2 } };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, move_balances, &movers[i]);
+    }
+    int consistent = 0;
+    for (int i = 0; i < 20000; i++) {
+        if (read_balances(read, 4, balances)) {
+            assert(balances[0] + balances[1] + balances[2] + balances[3] == 4000);
+            consistent++;
+        }
+    }
+    atomic_store(&done, 1);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(consistent > 0);
+
+    printf("Read balances works.\n");
+}
+
+
+struct Change_applier {
+    struct Account **accounts;
+    atomic_int *done;
+};
+
+
+// Moves money around the accounts in changes the way a replica applies them
+static void *apply_moves(void *arg) {
+    struct Change_applier *applier = arg;
+    int64_t amounts[3] = { -30, 10, 20 };
+    for (int i = 0; !atomic_load(applier->done); i++) {
+        int64_t sign = i % 2 ? -1 : 1;
+        int64_t signed_amounts[3] = { sign * amounts[0], sign * amounts[1], sign * amounts[2] };
+        apply_changes(applier->accounts, signed_amounts, 3);
+    }
+    return NULL;
+}
+
+
+void test_apply_changes() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    struct Account *accounts[3];
+    int64_t balances[3];
+    for (int id = 1; id <= 3; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+        accounts[id - 1] = get_account_by_id(&store, id);
+        deposit(accounts[id - 1], 100);
+    }
+
+    int64_t amounts[3] = { -100, 50, 50 };
+    apply_changes(accounts, amounts, 3);
+    assert(read_balances(accounts, 3, balances) == 1);
+    assert(balances[0] == 0 && balances[1] == 150 && balances[2] == 150);
+
+    // Nothing is checked: a change the primary made may leave any balance
+    int64_t overdraw[1] = { -10 };
+    apply_changes(accounts, overdraw, 1);
+    assert(atomic_load(&accounts[0]->balance) == -10);
+    int64_t refill[1] = { 40 };
+    apply_changes(accounts, refill, 1);
+
+    // Readers see a change to several accounts whole
+    atomic_int done = 0;
+    struct Change_applier applier = { accounts, &done };
+    pthread_t thread;
+    pthread_create(&thread, NULL, apply_moves, &applier);
+    for (int i = 0; i < 20000; i++) {
+        if (read_balances(accounts, 3, balances)) {
+            assert(balances[0] + balances[1] + balances[2] == 330);
+        }
+    }
+    atomic_store(&done, 1);
+    pthread_join(thread, NULL);
+
+    printf("Apply changes works.\n");
+}
+
+
+static void *change_hot_account(void *arg) {
+    struct Account *account = arg;
+    for (int i = 0; i < 20000; i++) {
+        deposit(account, 2);
+        assert(withdraw(account, 1) == 1);
+    }
+    return NULL;
+}
+
+
+static void *transfer_to_hot_account(void *arg) {
+    const struct Account_store *store = arg;
+    for (int i = 0; i < 20000; i++) {
+        assert(transfer(store, 2, 1, 1) == 1);
     }
+    return NULL;
+}
+
+
+void test_hot_accounts() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    for (int id = 1; id <= HOT_MAX_ACCOUNTS + 2; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+    }
+    struct Account *hot = get_account_by_id(&store, 1);
+    deposit(get_account_by_id(&store, 2), 20000);
+
+    // A hot account's changes go through its combiner and give the same results. Accounts of
+    // earlier tests may have got hot already.
+    int hot_before = hot_account_count();
+    assert(make_hot(hot) == 1);
+    assert(make_hot(hot) == 1);
+    assert(hot_account_count() == hot_before + 1);
+    assert(deposit(hot, 100) == 1);
+    assert(withdraw(hot, 30) == 1);
+    assert(withdraw(hot, 71) == 0);
+    assert(get_balance(hot) == 70);
+
+    // Combined changes and transfers racing them all land
+    pthread_t threads[4];
+    for (int i = 0; i < 3; i++) {
+        pthread_create(&threads[i], NULL, change_hot_account, hot);
+    }
+    pthread_create(&threads[3], NULL, transfer_to_hot_account, &store);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(get_balance(hot) == 70 + 3 * 20000 + 20000);
+    assert(get_balance(get_account_by_id(&store, 2)) == 0);
+
+    // There are only so many combiners
+    for (int id = 1; id <= HOT_MAX_ACCOUNTS + 1; id++) {
+        make_hot(get_account_by_id(&store, id));
+    }
+    assert(hot_account_count() == HOT_MAX_ACCOUNTS);
+    assert(make_hot(get_account_by_id(&store, HOT_MAX_ACCOUNTS + 2)) == 0);
+
+    // Accounts only one thread changes cool down again
+    for (int id = 1; id <= HOT_MAX_ACCOUNTS + 1; id++) {
+        for (int i = 0; i < HOT_COOL_PASSES; i++) {
+            deposit(get_account_by_id(&store, id), 1);
+        }
+    }
+    assert(hot_account_count() == hot_before);
+    assert(atomic_load(&hot->hot) == 0);
+    assert(deposit(hot, 1) == 1);
+
+    destroy_account_store(&store);
+    printf("Hot accounts work.\n");
+}
+
+
+static void *change_in_epoch(void *arg) {
+    struct Account *account = arg;
+    enter_epoch();
+    deposit(account, 1);
+    leave_epoch();
+    return NULL;
+}
+
+
+// Threads that exit leave their epoch slot to later threads
+void test_epoch_slots() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    for (int i = 0; i < 2 * MAX_EPOCH_THREADS; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, change_in_epoch, get_account_by_id(&store, 1));
+        pthread_join(thread, NULL);
+    }
+    assert(get_balance(get_account_by_id(&store, 1)) == 2 * MAX_EPOCH_THREADS);
+    advance_epoch();
+
+    destroy_account_store(&store);
+    printf("Epoch slots work.\n");
+}
+
+
+struct Epoch_mover {
+    struct Account_store *store;
+    atomic_int *done;
+};
+
+
+// Keeps moving money between accounts in epochs, with transfers and changes a replica applies
+static void *move_in_epochs(void *arg) {
+    struct Epoch_mover *mover = arg;
+    struct Account *pair[2] = { get_account_by_id(mover->store, 3), get_account_by_id(mover->store, 4) };
+    for (int i = 0; !atomic_load(mover->done); i++) {
+        enter_epoch();
+        if (i % 2) {
+            transfer(mover->store, 1 + i % 100, 1 + (i * 7) % 100, 5);
+        }
+        else {
+            int64_t amounts[2] = { i % 4 ? -1 : 1, i % 4 ? 1 : -1 };
+            apply_changes(pair, amounts, 2);
+        }
+        leave_epoch();
+    }
+    return NULL;
+}
+
+
+// Sum of the balances at epoch, which must fit
+static int64_t sum_at(const struct Account_store *store, uint64_t epoch, int *count) {
+    int64_t total;
+    assert(sum_balances_at_epoch(store, epoch, &total, count) == 1);
+    return total;
+}
+
+
+void test_sum_balances() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    for (int id = 1; id <= 100; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+        deposit(get_account_by_id(&store, id), 1000);
+    }
+    int count;
+    assert(sum_at(&store, advance_epoch(), &count) == 100000 && count == 100);
+
+    // Changes after the epoch ended aren't counted
+    uint64_t epoch = advance_epoch();
+    enter_epoch();
+    deposit(get_account_by_id(&store, 1), 500);
+    leave_epoch();
+    assert(sum_at(&store, epoch, &count) == 100000);
+    assert(sum_at(&store, advance_epoch(), &count) == 100500);
+
+    // Money moving meanwhile is never counted twice or missed
+    atomic_int done = 0;
+    struct Epoch_mover mover = { &store, &done };
+    pthread_t thread;
+    pthread_create(&thread, NULL, move_in_epochs, &mover);
+    for (int i = 0; i < 2000; i++) {
+        assert(sum_at(&store, advance_epoch(), &count) == 100500);
+    }
+    atomic_store(&done, 1);
+    pthread_join(thread, NULL);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+    printf("Summing balances works.\n");
+}
+
+
+static void *push_requests(void *arg) {
+    struct Ring_segment *ring = arg;
+    for (int i = 0; i < 10 * RING_SIZE; i++) {
+        struct Wire_request request = { .operation = 'd', .account_id = i };
+        while (!ring_push(&ring->requests, ring->request_entries, sizeof(request), &request)) {
+            sched_yield();
+        }
+        ring_wake(&ring->requests);
+    }
+    return NULL;
+}
+
+
+void test_rings() {
+    char name[RING_NAME_SIZE];
+    snprintf(name, sizeof(name), "/bank-ring-test-%d", (int)getpid());
+    struct Ring_segment *server = ring_create(name);
+    assert(server != NULL);
+    assert(ring_create(name) == NULL);
+    struct Ring_segment *client = ring_attach(name);
+    assert(client != NULL);
+    shm_unlink(name);
+    assert(ring_attach(name) == NULL);
+
+    // What one side pushes the other takes, in order, until the ring is full
+    struct Wire_request request = { .operation = 'l' };
+    for (int i = 0; i < RING_SIZE; i++) {
+        request.account_id = i;
+        assert(ring_push(&client->requests, client->request_entries, sizeof(request), &request) == 1);
+    }
+    assert(ring_push(&client->requests, client->request_entries, sizeof(request), &request) == 0);
+    assert(ring_length(&server->requests) == RING_SIZE);
+    for (int i = 0; i < RING_SIZE; i++) {
+        assert(ring_pop(&server->requests, server->request_entries, sizeof(request), &request) == 1);
+        assert(request.account_id == i);
+    }
+    assert(ring_pop(&server->requests, server->request_entries, sizeof(request), &request) == 0);
+    assert(ring_wait(&server->requests, 0, 10) == 0);
+
+    // A consumer that sleeps is woken for every entry
+    pthread_t producer;
+    pthread_create(&producer, NULL, push_requests, client);
+    for (int i = 0; i < 10 * RING_SIZE; i++) {
+        while (!ring_pop(&server->requests, server->request_entries, sizeof(request), &request)) {
+            ring_wait(&server->requests, i % 2 ? 5 : 0, 1000);
+        }
+        assert(request.account_id == i);
+    }
+    pthread_join(producer, NULL);
+
+    ring_release(client);
+    ring_release(server);
+    printf("Rings work.\n");
+}
+
+
+static atomic_int withdrawals = 0;
+
+static void *withdraw_all(void *arg) {
+    struct Account *account = arg;
+    for (int i = 0; i < 100000; i++) {
+        if (withdraw(account, 3)) {
+            atomic_fetch_add(&withdrawals, 1);
+        }
+        deposit(account, 1);
+    }
+    return NULL;
+}
+
+
+void test_concurrent_withdraw() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    struct Account *account = get_account_by_id(&store, 1);
+    deposit(account, 1000);
+
+    // Withdrawals racing each other may fail, but none is lost or takes the balance below zero
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, withdraw_all, account);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(get_balance(account) >= 0);
+    assert(get_balance(account) == 1000 + 4 * 100000 - 3 * atomic_load(&withdrawals));
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Concurrent withdrawals work.\n");
+}
+
+
+void test_batches() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    for (int id = 1; id <= 3; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+    }
+    deposit(get_account_by_id(&store, 1), 100);
+
+    // Legs on one account are netted, and accounts that net to nothing are left out
+    struct Batch_leg legs[] = { {3, 30}, {1, -50}, {2, 20}, {1, -10}, {2, -20}, {2, 10} };
+    int count = 6;
+    assert(apply_batch(&store, legs, &count) == 1);
+    assert(count == 3);
+    assert(legs[0].account_id == 1 && legs[0].amount == -60);
+    assert(legs[1].account_id == 2 && legs[1].amount == 10);
+    assert(get_balance(get_account_by_id(&store, 1)) == 40);
+    assert(get_balance(get_account_by_id(&store, 3)) == 30);
+
+    // A debit that can't be covered leaves every account as it was
+    struct Batch_leg short_legs[] = { {1, -20}, {2, 25}, {3, -31} };
+    count = 3;
+    assert(apply_batch(&store, short_legs, &count) == 0);
+    assert(get_balance(get_account_by_id(&store, 1)) == 40);
+    assert(get_balance(get_account_by_id(&store, 2)) == 10);
+    assert(get_balance(get_account_by_id(&store, 3)) == 30);
+
+    struct Batch_leg missing[] = { {1, -5}, {4, 5} };
+    count = 2;
+    assert(apply_batch(&store, missing, &count) == 0);
+    assert(get_balance(get_account_by_id(&store, 1)) == 40);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Batches work.\n");
+}
+
+
+// Deposit into account until its balance is MAX_BALANCE
+static void fill_account(struct Account *account) {
+    while (get_balance(account) <= MAX_BALANCE - MAX_AMOUNT) {
+        assert(deposit(account, MAX_AMOUNT) == 1);
+    }
+    if (get_balance(account) < MAX_BALANCE) {
+        assert(deposit(account, MAX_BALANCE - get_balance(account)) == 1);
+    }
+}
+
+
+void test_balance_limit() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    for (int id = 1; id <= 10; id++) {
+        assert(create_new_account(&store, id, &store_lock) == 1);
+    }
+    struct Account *full = get_account_by_id(&store, 1);
+    struct Account *other = get_account_by_id(&store, 2);
+
+    // Deposits stop at MAX_BALANCE instead of wrapping around
+    fill_account(full);
+    assert(deposit(full, 1) == 0);
+    assert(get_balance(full) == MAX_BALANCE);
+
+    // A transfer or batch that would go over leaves every account as it was
+    assert(deposit(other, 100) == 1);
+    assert(transfer(&store, 2, 1, 50) == -1);
+    struct Batch_leg legs[] = { {2, -50}, {1, 50} };
+    int count = 2;
+    assert(apply_batch(&store, legs, &count) == -1);
+    assert(get_balance(full) == MAX_BALANCE && get_balance(other) == 100);
+    assert(transfer(&store, 1, 2, 50) == 1);
+    assert(transfer(&store, 2, 1, 50) == 1);
+
+    // So do the combined deposits of a hot account
+    assert(make_hot(full) == 1);
+    assert(deposit(full, 1) == 0);
+    assert(withdraw(full, 1) == 1);
+    assert(deposit(full, 1) == 1);
+    assert(get_balance(full) == MAX_BALANCE);
+
+    // Promised credits are paid even over the limit
+    struct Batch_leg paid[] = { {1, 10} };
+    count = 1;
+    assert(pay_batch(&store, paid, &count) == 1);
+    assert(get_balance(full) == MAX_BALANCE + 10);
+
+    // A total that doesn't fit says so
+    int64_t total;
+    int accounts;
+    assert(sum_balances_at_epoch(&store, advance_epoch(), &total, &accounts) == 1);
+    assert(total == MAX_BALANCE + 110 && accounts == 10);
+    for (int id = 2; id <= 10; id++) {
+        fill_account(get_account_by_id(&store, id));
+    }
+    assert(sum_balances_at_epoch(&store, advance_epoch(), &total, &accounts) == 0);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Balance limit works.\n");
+}
+
+
+static int observed_locks = 0;
+
+static void count_lock(uint64_t wait_ns) {
+    assert(wait_ns == 0);   // Nothing else holds the locks here
+    observed_locks++;
+}
+
+
+void test_lock_observer() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    assert(create_new_account(&store, 2, &store_lock) == 1);
+    deposit(get_account_by_id(&store, 1), 100);
+
+    set_lock_observer(count_lock);
+    assert(transfer(&store, 1, 2, 40) == 1);
+    assert(observed_locks == 2);
+    set_lock_observer(NULL);
+    assert(transfer(&store, 2, 1, 40) == 1);
+    assert(observed_locks == 2);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Lock observer works.\n");
+}
+
+
+struct Deque_taker {
+    struct Client_deque *deque;
+    atomic_int *taken;
+    atomic_int *done;
+};
+
+
+static void *take_clients(void *arg) {
+    struct Deque_taker *taker = arg;
+    while (!atomic_load(taker->done) || deque_length(taker->deque) > 0) {
+        struct Client_message *client = deque_take(taker->deque);
+        if (client) {
+            atomic_fetch_add(&taker->taken[client->client_socket], 1);
+        }
+    }
+    return NULL;
+}
+
+
+void test_client_deque() {
+    static struct Client_deque deque;
+    static struct Client_message clients[3 * CLIENT_DEQUE_SIZE];
+    init_client_deque(&deque);
+    assert(deque_take(&deque) == NULL);
+
+    // Clients come out in the order they arrived
+    for (int i = 0; i < 3; i++) {
+        clients[i].client_socket = i;
+        assert(deque_push(&deque, &clients[i]) == 1);
+    }
+    assert(deque_length(&deque) == 3);
+    for (int i = 0; i < 3; i++) {
+        assert(deque_take(&deque)->client_socket == i);
+    }
+    assert(deque_take(&deque) == NULL);
+    assert(deque_length(&deque) == 0);
+
+    // A full deque refuses more
+    for (int i = 0; i < CLIENT_DEQUE_SIZE; i++) {
+        assert(deque_push(&deque, &clients[i]) == 1);
+    }
+    assert(deque_push(&deque, &clients[0]) == 0);
+    while (deque_take(&deque)) {
+    }
+
+    // Several takers racing each get every client exactly once
+    static atomic_int taken[3 * CLIENT_DEQUE_SIZE];
+    atomic_int done = 0;
+    struct Deque_taker taker = { &deque, taken, &done };
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, take_clients, &taker);
+    }
+    for (int i = 0; i < 3 * CLIENT_DEQUE_SIZE; i++) {
+        clients[i].client_socket = i;
+        while (!deque_push(&deque, &clients[i])) {
+        }
+    }
+    atomic_store(&done, 1);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < 3 * CLIENT_DEQUE_SIZE; i++) {
+        assert(atomic_load(&taken[i]) == 1);
+    }
+
+    printf("Client deque works.\n");
+}
+
+
+void test_account_store() {
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 10) == 1);
+
+    // Pointers to accounts must survive the store growing past several segments
+    assert(create_new_account(&store, 42, &store_lock) == 1);
+    struct Account *first = get_account_by_id(&store, 42);
+    for (int i = 0; i < 5000; i++) {
+        assert(create_new_account(&store, 1000 + i, &store_lock) == 1);
+    }
+    assert(create_new_account(&store, 42, &store_lock) == 1);
+    assert(account_count(&store) == 5001);
+    assert(get_account_by_id(&store, 42) == first);
+    assert(account_id(&store, index_lookup(&store.index, 5999)) == 5999);
+    assert(get_account_by_id(&store, 5999) == account_at(&store, 5000));
+    assert(get_account_by_id(&store, 7) == NULL);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    printf("Account store works.\n");
+}
+
+
+struct History_writer {
+    struct Account_store *store;
+    int first;      // Writes every second LSN from here
+};
+
+
+// Records changes whose amount is their LSN, so a torn entry shows
+static void *record_changes(void *arg) {
+    struct History_writer *writer = arg;
+    for (int i = 0; i < 20000; i++) {
+        uint64_t lsn = writer->first + 2 * i;
+        assert(record_history(writer->store, 1, 'd', (int64_t)lsn, -1, lsn) == 1);
+    }
+    return NULL;
+}
+
+
+void test_history() {
+    const char *history_file = "test_history.bin";
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    assert(create_new_account(&store, 2, &store_lock) == 1);
+    struct Statement_entry entries[HISTORY_ENTRIES];
+
+    assert(read_history(&store, 1, entries, HISTORY_ENTRIES) == 0);
+    assert(read_history(&store, 3, entries, HISTORY_ENTRIES) == -1);
+    assert(record_history(&store, 3, 'd', 100, -1, 1) == 0);
+
+    // Newest first, and only the latest HISTORY_ENTRIES are kept
+    for (int i = 1; i <= 40; i++) {
+        assert(record_history(&store, 1, 't', -i, 2, i) == 1);
+    }
+    assert(record_history(&store, 2, 'd', 500, -1, 41) == 1);
+    assert(read_history(&store, 1, entries, 3) == 3);
+    assert(entries[0].lsn == 40 && entries[0].amount == -40 && entries[0].kind == 't' && entries[0].other_id == 2);
+    assert(entries[2].lsn == 38);
+    assert(read_history(&store, 1, entries, 100) == HISTORY_ENTRIES);
+    assert(entries[HISTORY_ENTRIES - 1].lsn == 40 - HISTORY_ENTRIES + 1);
+
+    // Changes recorded out of journal order come back in it
+    assert(record_history(&store, 2, 'w', -5, -1, 39) == 1);
+    assert(read_history(&store, 2, entries, HISTORY_ENTRIES) == 2);
+    assert(entries[0].lsn == 41 && entries[1].lsn == 39);
+
+    // The file only has changes up to the snapshot LSN, each account's oldest first
+    uint64_t snapshot_lsn;
+    assert(save_history(&store, history_file, 40) == 1);
+    destroy_account_store(&store);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    assert(create_new_account(&store, 2, &store_lock) == 1);
+    assert(load_history(&store, history_file, &snapshot_lsn) == HISTORY_ENTRIES + 1);
+    assert(snapshot_lsn == 40);
+    assert(read_history(&store, 1, entries, HISTORY_ENTRIES) == HISTORY_ENTRIES && entries[0].lsn == 40);
+    assert(read_history(&store, 2, entries, HISTORY_ENTRIES) == 1 && entries[0].amount == -5);
+    assert(load_history(&store, "no_such_history.bin", &snapshot_lsn) == 0 && snapshot_lsn == 0);
+
+    // Two writers on one account never leave a torn entry for readers
+    struct History_writer writers[2] = { { &store, 100 }, { &store, 101 } };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, record_changes, &writers[i]);
+    }
+    for (int i = 0; i < 20000; i++) {
+        int count = read_history(&store, 1, entries, HISTORY_ENTRIES);
+        for (int j = 0; j < count; j++) {
+            assert(entries[j].amount == (int64_t)entries[j].lsn || entries[j].lsn <= 40);
+            assert(j == 0 || entries[j].lsn < entries[j - 1].lsn);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(read_history(&store, 1, entries, HISTORY_ENTRIES) == HISTORY_ENTRIES);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+    remove(history_file);
+
+    printf("Account history works.\n");
+}
+
+
+void test_account_index() {
+    struct Account_index index;
+    assert(init_account_index(&index, 0) == 1);
+
+    // Insert enough ids to make the index grow a few times
+    for (int i = 0; i < 1000; i++) {
+        assert(index_insert(&index, i * 7, i) == 1);
+    }
+    for (int i = 0; i < 1000; i++) {
+        assert(index_lookup(&index, i * 7) == i);
+    }
+    assert(index_lookup(&index, 3) == -1);
+
+    destroy_account_index(&index);
+
+    printf("Account index works.\n");
+}
+
+void test_checkpoints() {
+    const char *database = "test_checkpoint_db.txt";
+    const char *prefix = "test_checkpoint";
+    char delta[64];
+
+    struct Account_store store;
+    pthread_rwlock_t store_lock;
+    pthread_rwlock_init(&store_lock, NULL);
+    assert(init_account_store(&store, 0) == 1);
+    assert(create_new_account(&store, 1, &store_lock) == 1);
+    assert(create_new_account(&store, 2, &store_lock) == 1);
+    struct Account *first = get_account_by_id(&store, 1);
+    struct Account *second = get_account_by_id(&store, 2);
+
+    // Deposits of earlier tests are in the total already
+    int64_t earlier;
+    int64_t deposits;
+    advance_epoch();
+    assert(stable_deposits(&earlier) == 1);
+
+    enter_epoch();
+    deposit(first, 100);
+    deposit(second, 50);
+    leave_epoch();
+    uint64_t full_epoch = advance_epoch();
+    assert(stable_deposits(&deposits) == 1 && deposits == earlier + 150);
+    assert(save_accounts(&store, database, 10, full_epoch, full_epoch, deposits, 0) == 1);
+
+    enter_epoch();
+    deposit(first, 5);
+    leave_epoch();
+    uint64_t delta_epoch = advance_epoch();
+
+    // Changes made after the epoch ended must not show up in its checkpoint, nor in its deposits
+    enter_epoch();
+    deposit(first, 1000);
+    leave_epoch();
+    assert(stable_deposits(&deposits) == 1 && deposits == earlier + 155);
+    snprintf(delta, sizeof(delta), "%s.%016" PRIx64, prefix, delta_epoch);
+    assert(save_accounts(&store, delta, 20, delta_epoch, delta_epoch, deposits, full_epoch) == 1);
+
+    destroy_account_store(&store);
+    pthread_rwlock_destroy(&store_lock);
+
+    struct Account_store loaded;
+    uint64_t snapshot_lsn;
+    uint64_t epoch;
+    assert(load_accounts(&loaded, database, &snapshot_lsn, &epoch, &deposits) == 2);
+    assert(snapshot_lsn == 10 && epoch == full_epoch && deposits == earlier + 150);
+    assert(get_account_by_id(&loaded, 1)->balance == 100);
+
+    assert(load_checkpoints(&loaded, prefix, &snapshot_lsn, &epoch, &deposits) == 1);
+    assert(snapshot_lsn == 20 && epoch == delta_epoch && deposits == earlier + 155);
+    assert(get_account_by_id(&loaded, 1)->balance == 105);
+    assert(get_account_by_id(&loaded, 2)->balance == 50);
+    destroy_account_store(&loaded);
 
-    free(loaded_accounts);
+    assert(remove_checkpoints(prefix, delta_epoch) == 1);
+    assert(access(delta, F_OK) == -1);
+    unlink(database);
 
-    printf("Accounts loaded");
+    printf("Checkpoints work.\n");
 }
 
 int main() {
     test_save_accounts();
     test_load_accounts();
+    test_database_formats();
+    test_amounts();
+    test_config_lines();
+    test_batch_legs();
+    test_wire_layout();
+    test_concurrent_withdraw();
+    test_batches();
+    test_read_balances();
+    test_apply_changes();
+    test_hot_accounts();
+    test_lock_observer();
+    test_client_deque();
+    test_rings();
+    test_account_index();
+    test_account_store();
+    test_history();
+    test_checkpoints();
+    test_epoch_slots();
+    test_sum_balances();
+    test_balance_limit();
     printf("All tests passed!\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 202009L
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "bank_helper.h"
+#include "journal.h"
+
+// Built with the journal and what it uses:
+// $ gcc -Wall -pedantic -pthread -I src tests/journal_test.c src/journal.c src/bank_helper.c src/metrics.c
+
+#define PREFIX "test_journal"
+
+
+// What a replay handed over, in order.
+struct Replayed {
+    uint64_t lsns[100000];
+    char operations[100000];
+    long count;
+};
+
+static void collect(const struct Journal_record *record, void *context) {
+    struct Replayed *replayed = context;
+    replayed->lsns[replayed->count] = record->lsn;
+    replayed->operations[replayed->count++] = record->operation;
+}
+
+
+static long replay(uint64_t after_lsn, uint64_t up_to_lsn, struct Replayed *replayed) {
+    replayed->count = 0;
+    return journal_replay(PREFIX, after_lsn, up_to_lsn, collect, replayed);
+}
+
+
+// Path of the segment that starts at first_lsn.
+static const char *segment_path(uint64_t first_lsn) {
+    static char path[300];
+    snprintf(path, sizeof(path), "%s.%016" PRIx64, PREFIX, first_lsn);
+    return path;
+}
+
+
+// Write a segment by hand, as a crash may have left it.
+static void write_segment(uint64_t first_lsn, const struct Journal_record *records, int count) {
+    struct Journal_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.record_size = sizeof(struct Journal_record);
+
+    FILE *file = fopen(segment_path(first_lsn), "w");
+    assert(file);
+    assert(fwrite(&header, sizeof(header), 1, file) == 1);
+    assert(fwrite(records, sizeof(struct Journal_record), count, file) == (size_t)count);
+    fclose(file);
+}
+
+
+// A record with a valid checksum. Slots of a group count down to 0 in dest_id.
+static struct Journal_record make_record(uint64_t lsn, char operation, int account_id, int dest_id, int64_t amount) {
+    struct Journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.lsn = lsn;
+    record.epoch = 1;
+    record.account_id = account_id;
+    record.dest_id = dest_id;
+    record.amount = amount;
+    record.operation = operation;
+    record.checksum = crc32_update(0, &record, offsetof(struct Journal_record, checksum));
+    return record;
+}
+
+
+// Flip a byte of the record at given index of a segment, so it fails its checksum.
+static void damage_record(uint64_t first_lsn, int index) {
+    int fd = open(segment_path(first_lsn), O_RDWR);
+    char byte;
+    off_t offset = sizeof(struct Journal_header) + index * sizeof(struct Journal_record) + 20;
+    assert(pread(fd, &byte, 1, offset) == 1);
+    byte ^= 1;
+    assert(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+}
+
+
+struct Appender {
+    struct Journal *journal;
+    int count;
+    int batches;    // Every tenth append is a batch of three legs
+};
+
+// Appends records, waiting for every thousandth and the last one to be durable.
+static void *append_records(void *arg) {
+    struct Appender *appender = arg;
+    struct Batch_leg legs[3] = { { 1, -5 }, { 2, 3 }, { 3, 2 } };
+    for (int i = 0; i < appender->count; i++) {
+        uint64_t lsn = appender->batches && i % 10 == 0 ? journal_append_batch(appender->journal, 1, legs, 3)
+                                                         : journal_append(appender->journal, 1, 'd', i, -1, 100);
+        if (i % 1000 == 999 || i == appender->count - 1) {
+            journal_wait(appender->journal, lsn);
+            assert(journal_durable_lsn(appender->journal) >= lsn);
+        }
+    }
+    return NULL;
+}
+
+
+void test_group_commit(struct Replayed *replayed) {
+    journal_remove(PREFIX);
+
+    // More records than the ring holds, so appenders also wait for the writer to free cells
+    struct Journal journal;
+    assert(journal_open(&journal, PREFIX, 0, 64, 100) == 1);
+    struct Appender appenders[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        appenders[i] = (struct Appender){ &journal, JOURNAL_RING_SIZE / 3, i % 2 };
+        pthread_create(&threads[i], NULL, append_records, &appenders[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t last_lsn = journal_next_lsn(&journal) - 1;
+    assert(journal_durable_lsn(&journal) == last_lsn);
+    journal_close(&journal);
+
+    // Every record is on disk once, in LSN order, and the slots of each batch are together
+    assert(replay(0, UINT64_MAX, replayed) == (long)last_lsn);
+    for (long i = 0; i < replayed->count; i++) {
+        assert(replayed->lsns[i] == (uint64_t)i + 1);
+        if (replayed->operations[i] == 'a') {
+            assert(replayed->operations[i + 1] == 'A' && replayed->operations[i + 2] == 'A');
+        }
+    }
+
+    printf("Group commit works.\n");
+}
+
+
+void test_torn_tail(struct Replayed *replayed) {
+    journal_remove(PREFIX);
+
+    struct Journal journal;
+    assert(journal_open(&journal, PREFIX, 0, 8, 0) == 1);
+    for (int i = 0; i < 10; i++) {
+        journal_wait(&journal, journal_append(&journal, 1, 'd', i, -1, 100));
+    }
+    journal_close(&journal);
+
+    // A crash tore the last record, and left half of another after it
+    struct stat st;
+    damage_record(1, 9);
+    FILE *file = fopen(segment_path(1), "a");
+    struct Journal_record half = make_record(11, 'd', 1, -1, 100);
+    assert(fwrite(&half, sizeof(half) / 2, 1, file) == 1);
+    fclose(file);
+
+    // Opening cuts both off and numbers the next record after the last whole one
+    assert(journal_open(&journal, PREFIX, 0, 8, 0) == 1);
+    assert(stat(segment_path(1), &st) == 0);
+    assert(st.st_size == (off_t)(sizeof(struct Journal_header) + 9 * sizeof(struct Journal_record)));
+    assert(journal_next_lsn(&journal) == 10);
+    journal_wait(&journal, journal_append(&journal, 1, 'w', 1, -1, 50));
+    journal_close(&journal);
+
+    assert(replay(0, UINT64_MAX, replayed) == 10);
+    assert(replayed->lsns[9] == 10 && replayed->operations[9] == 'w');
+
+    // Numbering also continues after a snapshot that is newer than the journal
+    assert(journal_open(&journal, PREFIX, 500, 8, 0) == 1);
+    assert(journal_next_lsn(&journal) == 501);
+    journal_close(&journal);
+
+    printf("Torn journal tails are cut off.\n");
+}
+
+
+void test_replay_range(struct Replayed *replayed) {
+    journal_remove(PREFIX);
+
+    struct Journal_record records[1000];
+    for (int i = 0; i < 1000; i++) {
+        records[i] = make_record(i + 1, 'd', i, -1, 100);
+    }
+    write_segment(1, records, 1000);
+
+    // The search starts right after the snapshot's LSN, wherever that is in the segment
+    uint64_t afters[] = { 0, 1, 499, 500, 998, 999, 1000, 5000 };
+    for (int i = 0; i < 8; i++) {
+        long expected = afters[i] < 1000 ? 1000 - (long)afters[i] : 0;
+        assert(replay(afters[i], UINT64_MAX, replayed) == expected);
+        assert(expected == 0 || replayed->lsns[0] == afters[i] + 1);
+    }
+    assert(replay(100, 200, replayed) == 100);
+    assert(replayed->lsns[0] == 101 && replayed->lsns[99] == 200);
+
+    // Replay stops at a record that fails its checksum, even with good records after it
+    damage_record(1, 600);
+    assert(replay(0, UINT64_MAX, replayed) == 600);
+    assert(replayed->lsns[599] == 600);
+    assert(replay(700, UINT64_MAX, replayed) == 300);
+
+    printf("Journal replay finds its range.\n");
+}
+
+
+void test_partial_groups(struct Replayed *replayed) {
+    journal_remove(PREFIX);
+
+    // A batch cut short by a crash, the records written after the restart, a whole batch,
+    // and a transaction whose slots are not consecutive
+    struct Journal_record records[] = {
+        make_record(1, 'd', 1, -1, 100),
+        make_record(2, 'a', 1, 2, -30),
+        make_record(3, 'A', 2, 1, 10),
+        make_record(4, 'w', 1, -1, 5),
+        make_record(5, 'a', 1, 1, -20),
+        make_record(6, 'A', 2, 0, 20),
+        make_record(7, JOURNAL_PREPARE, -1, 2, 9),
+        make_record(8, 'A', 1, 0, -10),
+        make_record(9, 'd', 2, -1, 1),
+    };
+    write_segment(1, records, 9);
+
+    assert(replay(0, UINT64_MAX, replayed) == 9);
+    assert(replayed->count == 5);
+    assert(replayed->lsns[0] == 1 && replayed->lsns[1] == 4);
+    assert(replayed->lsns[2] == 5 && replayed->lsns[3] == 6 && replayed->lsns[4] == 9);
+
+    // A group that up_to_lsn cuts through isn't applied
+    assert(replay(0, 5, replayed) == 5);
+    assert(replayed->count == 2);
+
+    assert(journal_ends_group(&records[0]) && journal_ends_group(&records[5]));
+    assert(!journal_ends_group(&records[4]) && !journal_ends_group(&records[1]));
+
+    // A group with more slots than any operation writes means the journal is damaged
+    journal_remove(PREFIX);
+    struct Journal_record damaged[] = {
+        make_record(1, 'a', 1, BATCH_MAX_LEGS + 1, -1),
+        make_record(2, 'A', 2, BATCH_MAX_LEGS, 1),
+    };
+    write_segment(1, damaged, 2);
+    assert(replay(0, UINT64_MAX, replayed) == -1);
+
+    printf("Partial journal groups are held back.\n");
+}
+
+
+void test_truncate_and_rotate(struct Replayed *replayed) {
+    journal_remove(PREFIX);
+
+    // Three segments of ten records each
+    struct Journal journal;
+    assert(journal_open(&journal, PREFIX, 0, 16, 0) == 1);
+    for (int segment = 0; segment < 3; segment++) {
+        for (int i = 0; i < 10; i++) {
+            journal_wait(&journal, journal_append(&journal, 1, 'd', i, -1, 100));
+        }
+        journal_rotate(&journal);
+    }
+    journal_wait(&journal, journal_append(&journal, 1, 'd', 0, -1, 100));
+    uint64_t *segments;
+    assert(list_numbered_files(PREFIX, &segments) == 4);
+    assert(segments[0] == 1 && segments[1] == 11 && segments[2] == 21 && segments[3] == 31);
+    free(segments);
+
+    // Replay skips the segments before the LSN it starts after, and reads on across them
+    assert(replay(15, UINT64_MAX, replayed) == 16);
+    assert(replayed->lsns[0] == 16 && replayed->lsns[15] == 31);
+
+    // Only segments that end below the LSN go, and never the one being written
+    assert(journal_truncate(&journal, 20) == 1);
+    assert(journal_oldest_lsn(&journal) == 11);
+    assert(journal_truncate(&journal, 21) == 1);
+    assert(journal_oldest_lsn(&journal) == 21);
+    assert(journal_truncate(&journal, UINT64_MAX) == 1);
+    assert(journal_oldest_lsn(&journal) == 31);
+    journal_close(&journal);
+    assert(replay(0, UINT64_MAX, replayed) == 1);
+    assert(replayed->lsns[0] == 31);
+
+    // A damaged record in an older segment ends replay there
+    assert(journal_open(&journal, PREFIX, 0, 16, 0) == 1);
+    for (int i = 0; i < 10; i++) {
+        journal_wait(&journal, journal_append(&journal, 1, 'd', i, -1, 100));
+    }
+    journal_rotate(&journal);
+    journal_wait(&journal, journal_append(&journal, 1, 'd', 0, -1, 100));
+    journal_close(&journal);
+    damage_record(31, 5);
+    assert(replay(0, UINT64_MAX, replayed) == 5);
+
+    assert(journal_remove(PREFIX) == 1);
+    assert(list_numbered_files(PREFIX, &segments) == 0);
+    free(segments);
+
+    printf("Journal truncation and rotation work.\n");
+}
+
+
+int main() {
+    struct Replayed *replayed = malloc(sizeof(struct Replayed));
+    assert(replayed);
+    test_group_commit(replayed);
+    test_torn_tail(replayed);
+    test_replay_range(replayed);
+    test_partial_groups(replayed);
+    test_truncate_and_rotate(replayed);
+    free(replayed);
+    printf("All tests passed!\n");
+    return 0;
+}